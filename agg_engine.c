@@ -0,0 +1,1010 @@
+#include "agg_engine.h"
+#include "aggregator.h"
+#include "kernels.h"
+#include "compression.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+int agg_engine_init(agg_engine_t *engine, size_t n_workers, size_t tile_size, const agg_staleness_t *staleness, const agg_reducer_t *reducer)
+{
+    // multiple of every element size
+    assert(tile_size >= sizeof(double));
+    engine->tile_size = tile_size - tile_size % sizeof(double);
+    engine->staleness = *staleness;
+    engine->reducer = *reducer;
+    memset(&engine->head, 0, sizeof(engine->head));
+    atomic_init(&engine->head_id, UINT64_MAX);
+
+    if (thread_pool_init(&engine->pool, n_workers) < 0)
+    {
+        perror("Failed to initialize aggregation thread pool");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void release_base(global_model_version_t *base)
+{
+    if (base->file == NULL)
+        return;
+
+    shared_buffer_release(base->file);
+    base->file = NULL;
+}
+
+void agg_engine_destroy(agg_engine_t *engine)
+{
+    thread_pool_destroy(&engine->pool);
+    release_base(&engine->head);
+}
+
+typedef struct
+{
+    agg_engine_t *engine;
+    const mf_layout_t *layout; // of base, split in tiles
+    char *out;                 // data section
+
+    // weighted mean
+    size_t len;
+    const char **inputs;
+    const double *weights;
+    const char *base;
+
+    // robust reducers
+    const mf_diffs_t *diffs;
+    size_t trim;
+    double *dist; // thread_pool_size(pool) matrices of n * n squared distances
+
+    // quantized, sparse and mixed type updates: every input is read through its own tensor views
+    uint8_t mixed;
+    const mf_quant_t *quants;              // of every diff
+    const mf_quant_t *const *input_quant; // of every weighted mean input, NULL for the base models
+    double *scratch;                       // thread_pool_size(pool) tiles the sparse diffs are scattered into
+} agg_task_t;
+
+// the scales and zero points are the ones of the tensor of the tile
+static void agg_tile_wavg_mixed(agg_task_t *task, const mf_tile_t *tile, size_t worker)
+{
+    size_t t = tile->t;
+    const mf_tensor_t *tensor = &task->layout->tensors[t];
+    size_t first_elem = tile->start - tensor->start;
+    double *scratch = task->scratch != NULL ? task->scratch + worker * task->layout->max_tile : NULL;
+    if (scratch != NULL)
+        memset(scratch, 0, sizeof(double) * tile->count);
+
+    mf_input_t inputs[task->len + 1];
+    double bias = 0;
+    size_t n = 0;
+    for (size_t j = 0; j < task->len; j++)
+    {
+        const mf_quant_t *quant = task->input_quant[j];
+        const mf_tensor_t *in = quant != NULL ? &quant->layout.tensors[t] : tensor;
+        double w = task->weights[j];
+        double b = 0;
+        if (quant != NULL && quant->scale != NULL)
+        {
+            // w * scale * (q - zero)
+            b = -w * quant->scale[t] * quant->zero[t];
+            w *= quant->scale[t];
+        }
+
+        if (quant != NULL && quant->sparse != NULL)
+        {
+            // only the stored elements of the tile, the dense pass adds them in float64
+            const mf_sparse_tensor_t *stored = &quant->sparse[t];
+            size_t first = mf_sparse_lower_bound(stored, first_elem);
+            size_t last = mf_sparse_lower_bound(stored, first_elem + tile->count);
+            mf_kernel_scatter(in->type, scratch, first_elem, stored->index + first,
+                              stored->values + first * MF_SIZE(in->type), w, b, last - first);
+            continue;
+        }
+
+        inputs[n].type = in->type;
+        inputs[n].data = mf_tensor_ptr(in, task->inputs[j], tile->start);
+        inputs[n].w = w;
+        bias += b;
+        n++;
+    }
+
+    if (scratch != NULL)
+        inputs[n++] = (mf_input_t){.type = MF_TFLOAT64, .data = scratch, .w = 1};
+
+    mf_kernel_wsum_mixed(tensor->type, (char *)mf_tensor_ptr(tensor, task->out, tile->start),
+                         mf_tensor_ptr(tensor, task->base, tile->start), inputs, n, bias, tile->count);
+}
+
+static void agg_tile_wavg(void *_task, size_t k, size_t worker)
+{
+    agg_task_t *task = (agg_task_t *)_task;
+    const mf_tile_t *tile = &task->layout->tiles[k];
+    if (task->mixed)
+    {
+        agg_tile_wavg_mixed(task, tile, worker);
+        return;
+    }
+
+    // every input has the tensor views of base
+    const mf_tensor_t *tensor = &task->layout->tensors[tile->t];
+    size_t offset = mf_tensor_offset(tensor, tile->start);
+
+    const void *inputs[task->len];
+    for (size_t j = 0; j < task->len; j++)
+        inputs[j] = task->inputs[j] + offset;
+
+    mf_kernel_wsum(tensor->type, task->out + offset, task->base + offset, inputs, task->weights, task->len, tile->count);
+}
+
+// median, trimmed mean or the Krum distances (task->dist) of a tile
+static void agg_tile_robust(void *_task, size_t k, size_t worker)
+{
+    agg_task_t *task = (agg_task_t *)_task;
+    const mf_tile_t *tile = &task->layout->tiles[k];
+    size_t t = tile->t;
+    const mf_tensor_t *tensor = &task->layout->tensors[t];
+
+    // the kernels see the tile as a data section of its own
+    size_t n = task->diffs->n;
+    const void *in[n];
+    const void *rebase[n];
+    uint8_t in_type[n];
+    double scale[n];
+    double zero[n];
+    mf_diffs_t diffs = *task->diffs;
+    diffs.type = tensor->type;
+    diffs.base = mf_tensor_ptr(tensor, task->diffs->base, tile->start);
+    diffs.in = in;
+    diffs.rebase = rebase;
+    for (size_t j = 0; j < n; j++)
+    {
+        const mf_quant_t *quant = &task->quants[j];
+        const mf_tensor_t *input = &quant->layout.tensors[t];
+        in[j] = mf_tensor_ptr(input, task->diffs->in[j], tile->start);
+        rebase[j] = task->diffs->rebase[j] != NULL ? mf_tensor_ptr(tensor, task->diffs->rebase[j], tile->start) : NULL;
+        in_type[j] = input->type;
+        scale[j] = quant->scale != NULL ? quant->scale[t] : 1;
+        zero[j] = quant->scale != NULL ? quant->zero[t] : 0;
+    }
+
+    if (task->mixed)
+    {
+        diffs.in_type = in_type;
+        diffs.scale = scale;
+        diffs.zero = zero;
+    }
+
+    char *out = (char *)mf_tensor_ptr(tensor, task->out, tile->start);
+    if (task->dist != NULL)
+        mf_kernel_sqdist(&diffs, task->dist + worker * n * n, 0, tile->count);
+    else if (task->engine->reducer.type == AGG_REDUCER_MEDIAN)
+        mf_kernel_median(&diffs, out, 0, tile->count);
+    else
+        mf_kernel_trimmed_mean(&diffs, out, task->trim, 0, tile->count);
+}
+
+// The weighted mean of the selected updates as wsum inputs: the diffs, then the bases of the stale ones
+// (v + diff - base, every base once with the weight of its updates) and base itself.
+// Returns the number of inputs (at most 2 * n + 1)
+static size_t mean_inputs(const mf_diffs_t *diffs, const mf_quant_t *quants, const double *dataset_weights, const uint8_t *selected,
+                          const char **inputs, const mf_quant_t **input_quant, double *weights)
+{
+    set_debug(1);
+
+    double total = 0;
+    for (size_t i = 0; i < diffs->n; i++)
+        total += selected[i] ? dataset_weights[i] : 0;
+
+    size_t n = 0;
+    for (size_t i = 0; i < diffs->n; i++)
+    {
+        if (!selected[i])
+            continue;
+
+        inputs[n] = (const char *)diffs->in[i];
+        input_quant[n] = &quants[i];
+        weights[n] = dataset_weights[i] * diffs->s[i] / total;
+        debug_print("\t%f\n", weights[n]);
+        n++;
+    }
+
+    size_t n_diffs = n;
+    double rebase_weight = 0;
+    for (size_t i = 0, k = 0; i < diffs->n; i++)
+    {
+        if (!selected[i])
+            continue;
+
+        double w = weights[k++];
+        if (diffs->rebase[i] == NULL)
+            continue;
+
+        size_t j = n_diffs;
+        while (j < n && inputs[j] != (const char *)diffs->rebase[i])
+            j++;
+
+        if (j == n)
+        {
+            inputs[n] = (const char *)diffs->rebase[i];
+            input_quant[n] = NULL;
+            weights[n++] = 0;
+        }
+
+        weights[j] += w;
+        rebase_weight += w;
+    }
+
+    if (n > n_diffs)
+    {
+        inputs[n] = (const char *)diffs->base;
+        input_quant[n] = NULL;
+        weights[n++] = -rebase_weight;
+    }
+
+    return n;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// multi-Krum: the m updates whose squared distances to their n - f - 2 nearest neighbours add up the least
+static int krum_select(agg_engine_t *engine, agg_task_t *task, size_t n_tiles, uint8_t *selected)
+{
+    set_debug(1);
+    size_t n = task->diffs->n;
+    size_t n_matrices = thread_pool_size(&engine->pool);
+
+    task->dist = (double *)calloc(n_matrices * n * n, sizeof(double));
+    if (task->dist == NULL)
+    {
+        perror("Failed to allocate Krum distances");
+        return -1;
+    }
+
+    thread_pool_run(&engine->pool, agg_tile_robust, task, n_tiles);
+
+    double *dist = task->dist;
+    for (size_t w = 1; w < n_matrices; w++)
+    {
+        for (size_t i = 0; i < n * n; i++)
+            dist[i] += dist[w * n * n + i];
+    }
+
+    size_t f = engine->reducer.f;
+    size_t neighbours = n > f + 2 ? n - f - 2 : 1;
+    size_t m = engine->reducer.m != 0 ? engine->reducer.m : (n > f ? n - f : 1);
+    if (m > n)
+        m = n;
+
+    // n is at most MAX_PENDING_MODEL_UPDATES, sorting the rows costs nothing next to the distances
+    double scores[n];
+    double row[n];
+    for (size_t a = 0; a < n; a++)
+    {
+        size_t k = 0;
+        for (size_t b = 0; b < n; b++)
+        {
+            if (b != a)
+                row[k++] = a < b ? dist[a * n + b] : dist[b * n + a];
+        }
+
+        qsort(row, k, sizeof(double), compare_double);
+        scores[a] = 0;
+        for (size_t j = 0; j < neighbours && j < k; j++)
+            scores[a] += row[j];
+    }
+
+    memset(selected, 0, n);
+    for (size_t j = 0; j < m; j++)
+    {
+        size_t best = n;
+        for (size_t a = 0; a < n; a++)
+        {
+            if (!selected[a] && (best == n || scores[a] < scores[best]))
+                best = a;
+        }
+
+        selected[best] = 1;
+        debug_print("Krum selected update %zu (score %f)\n", best, scores[best]);
+    }
+
+    free(task->dist);
+    task->dist = NULL;
+    return 0;
+}
+
+static void unmap_output_model(void *data, size_t size)
+{
+    munmap(data, size);
+}
+
+// Allocates the output model in memory with the same size and headers of base,
+// it is written to disk by agg_engine_write_model
+static int create_output_model(global_model_version_t *base, char **out)
+{
+    *out = mmap(NULL, base->file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (*out == MAP_FAILED)
+    {
+        perror("Failed to allocate output model");
+        return -1;
+    }
+
+#if defined(MADV_HUGEPAGE)
+    madvise(*out, base->file->size, MADV_HUGEPAGE);
+#endif
+
+    memcpy(*out, base->file->data, base->info.data_offset);
+    return 0;
+}
+
+// the output becomes immutable, it can be shared with the writer, the global model and the senders
+static shared_buffer_t *share_output_model(char *out, size_t size)
+{
+    mprotect(out, size, PROT_READ);
+    shared_buffer_t *model = shared_buffer_wrap(out, size, unmap_output_model);
+    if (model == NULL)
+    {
+        perror("Failed to allocate output model buffer");
+        munmap(out, size);
+    }
+
+    return model;
+}
+
+int agg_engine_write_model(uint64_t id, shared_buffer_t *model)
+{
+    char path[255];
+    char tmp_path[255];
+    snprintf(path, sizeof(path), "%s/%lu", MODEL_FOLDER, id);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%lu.tmp", MODEL_FOLDER, id);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror("Failed to open output model file");
+        return -1;
+    }
+
+    const char *data = (const char *)model->data;
+    size_t done = 0;
+    while (done < model->size)
+    {
+        ssize_t bytes = write(fd, data + done, model->size - done);
+        if (bytes == -1 && errno == EINTR)
+            continue;
+
+        if (bytes <= 0)
+        {
+            perror("Failed to write output model file");
+            close(fd);
+            remove(tmp_path);
+            return -1;
+        }
+
+        done += bytes;
+    }
+
+    // readers open <id> by name, it appears only once complete and durable
+    if (fsync(fd) == -1 || close(fd) == -1)
+    {
+        perror("Failed to sync output model file");
+        remove(tmp_path);
+        return -1;
+    }
+
+    if (rename(tmp_path, path) == -1)
+    {
+        perror("Failed to rename output model file");
+        remove(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline uint64_t head_id(agg_engine_t *engine)
+{
+    return engine->head.file != NULL ? engine->head.id : global_model_id;
+}
+
+// the base of a round (the engine head) or of a stale update
+static int acquire_base(agg_engine_t *engine, uint64_t id, global_model_version_t *base)
+{
+    if (engine->head.file != NULL && engine->head.id == id)
+    {
+        *base = engine->head;
+        shared_buffer_acquire(base->file);
+        return 0;
+    }
+
+    if (global_model_acquire(id, base) < 0)
+    {
+        fprintf(stderr, "Failed to load base model %lu\n", id);
+        return -1;
+    }
+
+    return 0;
+}
+
+// tensor views of base split in tiles, every tensor can have its own type
+static int base_layout(agg_engine_t *engine, global_model_version_t *base, mf_layout_t *layout)
+{
+    if (mf_layout_init(layout, &base->info, (char *)base->file->data) < 0)
+        return -1;
+
+    for (size_t t = 0; t < layout->n_tensors; t++)
+    {
+        if (!mf_kernel_supported_type(layout->tensors[t].type))
+            goto unsupported;
+    }
+
+    if (layout->data_size != base->info.data_size)
+        goto unsupported;
+
+    if (mf_layout_split(layout, engine->tile_size) < 0)
+    {
+        mf_layout_destroy(layout);
+        return -1;
+    }
+
+    return 0;
+
+unsupported:
+    perror("Unsupported model data type");
+    mf_layout_destroy(layout);
+    return -1;
+}
+
+static inline const char *base_data(global_model_version_t *base)
+{
+    return mfi_get_data_ptr(base->info, (const char *)base->file->data);
+}
+
+// the new model (same headers as base) is the base of the next round
+static void advance_head(agg_engine_t *engine, uint64_t id, shared_buffer_t *model, global_model_version_t *base)
+{
+    release_base(&engine->head);
+    engine->head.id = id;
+    engine->head.info = base->info;
+    engine->head.file = shared_buffer_acquire(model);
+    atomic_store(&engine->head_id, id);
+}
+
+// -1 if the update can not be rebased on base
+static int64_t update_staleness(agg_engine_t *engine, global_model_version_t *base, mapped_model_t *update)
+{
+    uint64_t diffed_from = update->info.diffed_from_model_version;
+    if (diffed_from > base->id || base->id - diffed_from > engine->staleness.max_staleness)
+        return -1;
+
+    return base->id - diffed_from;
+}
+
+static int map_update(model_upd_t *update, mapped_model_t *model)
+{
+    int fd = open(update->file_name, O_RDONLY);
+    if (fd == -1)
+    {
+        perror("Failed to open model update file");
+        return -1;
+    }
+
+    int res = map_model(fd, model);
+    close(fd);
+    if (res < 0)
+        return -1;
+
+    // compressed uploads are stored as received, they are inflated once here
+    if (mf_inflate_mapped_model(model) < 0)
+    {
+        perror("Failed to decompress model update");
+        unmap_model(model);
+        return -1;
+    }
+
+    return 0;
+}
+
+int agg_engine_aggregate(agg_engine_t *engine, model_upd_t **updates, size_t len, uint64_t *id, shared_buffer_t **model)
+{
+    set_debug(1);
+    assert(len > 0);
+
+    int ret_code = -1;
+    char *out = MAP_FAILED;
+    global_model_version_t base = {0};
+    global_model_version_t stale_bases[len];
+    size_t n_stale_bases = 0;
+    mapped_model_t inputs[len];
+    mf_quant_t quants[len];
+    mf_layout_t layout = {0};
+    size_t n_updates = 0;
+    const void *inputs_data[len];
+    uint8_t mixed = 0;
+    uint8_t sparse = 0;
+    const void *rebase[len]; // data of the base a stale update is diffed from
+    double weights[len];     // dataset_size
+    double factors[len];     // s(staleness)
+    uint8_t selected[len];
+    const char *mean_data[2 * len + 1];
+    const mf_quant_t *mean_quant[2 * len + 1];
+    double mean_weights[2 * len + 1];
+
+    memset(inputs, 0, sizeof(inputs));
+
+    if (acquire_base(engine, head_id(engine), &base) < 0)
+        goto release_all;
+
+    if (base_layout(engine, &base, &layout) < 0)
+        goto release_all;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        mapped_model_t *input = &inputs[n_updates];
+        if (map_update(updates[i], input) < 0)
+        {
+            fprintf(stderr, "Skipping update %s: failed to map it\n", updates[i]->file_name);
+            continue;
+        }
+
+        double w = updates[i]->weight;
+        int64_t t = update_staleness(engine, &base, input);
+        if (w <= 0 || t < 0)
+        {
+            fprintf(stderr, "Skipping update %s: diffed from %lu (base %lu), weight %f\n", updates[i]->file_name, input->info.diffed_from_model_version, base.id, w);
+            unmap_model(input);
+            continue;
+        }
+
+        size_t j = 0;
+        while (t > 0 && j < n_stale_bases && stale_bases[j].id != base.id - t)
+            j++;
+
+        if (t > 0 && j == n_stale_bases)
+        {
+            if (acquire_base(engine, base.id - t, &stale_bases[j]) < 0)
+            {
+                fprintf(stderr, "Skipping update %s: can not rebase it\n", updates[i]->file_name);
+                unmap_model(input);
+                continue;
+            }
+
+            if (stale_bases[j].info.data_size != base.info.data_size)
+            {
+                fprintf(stderr, "Skipping update %s: model %lu has a different size\n", updates[i]->file_name, stale_bases[j].id);
+                release_base(&stale_bases[j]);
+                unmap_model(input);
+                continue;
+            }
+
+            n_stale_bases++;
+        }
+
+        if (mf_quant_init(&quants[n_updates], &layout, &input->info, input->data, updates[i]->meta) < 0)
+        {
+            fprintf(stderr, "Skipping update %s: its tensors do not match the global model\n", updates[i]->file_name);
+            unmap_model(input);
+            continue;
+        }
+
+        // the robust reducers read every element of every diff
+        if (engine->reducer.type != AGG_REDUCER_MEAN && mf_quant_densify(&quants[n_updates]) < 0)
+        {
+            fprintf(stderr, "Skipping update %s: can not expand it\n", updates[i]->file_name);
+            mf_quant_destroy(&quants[n_updates]);
+            unmap_model(input);
+            continue;
+        }
+
+        sparse |= quants[n_updates].sparse != NULL;
+        mixed |= !quants[n_updates].plain;
+        rebase[n_updates] = t > 0 ? base_data(&stale_bases[j]) : NULL;
+        debug_print("Update %s: weight %f, staleness %ld\n", updates[i]->file_name, w, t);
+        weights[n_updates] = w;
+        factors[n_updates] = agg_staleness_factor(&engine->staleness, t);
+        inputs_data[n_updates] = quants[n_updates].dense != NULL ? (const void *)quants[n_updates].dense : mfi_get_data_ptr(input->info, input->data);
+        n_updates++;
+    }
+
+    if (n_updates == 0)
+    {
+        perror("No update to aggregate");
+        goto release_all;
+    }
+
+    debug_print("Mapped %zu model update files\n", n_updates);
+
+    if (create_output_model(&base, &out) < 0)
+    {
+        perror("Failed to create output model");
+        goto release_all;
+    }
+
+    debug_print("Allocated output model\n");
+
+    size_t n_tiles = layout.n_tiles;
+
+    // the type of every tensor is set by the tiles
+    mf_diffs_t diffs = {
+        .base = base_data(&base),
+        .in = inputs_data,
+        .rebase = rebase,
+        .s = factors,
+        .n = n_updates,
+    };
+
+    agg_task_t task = {
+        .engine = engine,
+        .layout = &layout,
+        .out = mfi_get_data_ptr(base.info, out),
+        .base = base_data(&base),
+        .diffs = &diffs,
+        .mixed = mixed,
+        .quants = quants,
+    };
+
+    uint8_t reducer = engine->reducer.type;
+    if (reducer == AGG_REDUCER_MEDIAN || reducer == AGG_REDUCER_TRIMMED_MEAN)
+    {
+        // at least one value is kept
+        task.trim = reducer == AGG_REDUCER_TRIMMED_MEAN ? (size_t)(engine->reducer.trim * n_updates) : 0;
+        if (2 * task.trim >= n_updates)
+            task.trim = (n_updates - 1) / 2;
+
+        thread_pool_run(&engine->pool, agg_tile_robust, &task, n_tiles);
+    }
+    else
+    {
+        memset(selected, 1, n_updates);
+        if (reducer == AGG_REDUCER_KRUM && krum_select(engine, &task, n_tiles, selected) < 0)
+            goto release_all;
+
+        if (sparse)
+        {
+            task.scratch = (double *)malloc(sizeof(double) * layout.max_tile * thread_pool_size(&engine->pool));
+            if (task.scratch == NULL)
+            {
+                perror("Failed to allocate sparse aggregation buffers");
+                goto release_all;
+            }
+        }
+
+        task.len = mean_inputs(&diffs, quants, weights, selected, mean_data, mean_quant, mean_weights);
+        task.inputs = mean_data;
+        task.input_quant = mean_quant;
+        task.weights = mean_weights;
+        thread_pool_run(&engine->pool, agg_tile_wavg, &task, n_tiles);
+        free(task.scratch);
+    }
+
+    debug_print("Reduced %zu elements (%zu tensors)\n", layout.n_elems, layout.n_tensors);
+
+    *model = share_output_model(out, base.file->size);
+    out = MAP_FAILED;
+    if (*model != NULL)
+    {
+        *id = base.id + 1;
+        advance_head(engine, *id, *model, &base);
+        ret_code = 0;
+    }
+
+release_all:
+    if (out != MAP_FAILED)
+        munmap(out, base.file->size);
+
+    release_base(&base);
+    for (size_t j = 0; j < n_stale_bases; j++)
+        release_base(&stale_bases[j]);
+    for (size_t i = 0; i < n_updates; i++)
+    {
+        mf_quant_destroy(&quants[i]);
+        unmap_model(&inputs[i]);
+    }
+
+    mf_layout_destroy(&layout);
+    return ret_code;
+}
+
+void agg_stream_init(agg_stream_t *stream, agg_engine_t *engine)
+{
+    memset(stream, 0, sizeof(agg_stream_t));
+    stream->engine = engine;
+}
+
+void agg_stream_destroy(agg_stream_t *stream)
+{
+    mf_layout_destroy(&stream->layout);
+    release_base(&stream->base);
+    free(stream->acc);
+    free(stream->sum);
+    stream->acc = NULL;
+    stream->sum = NULL;
+    stream->acc_capacity = 0;
+}
+
+typedef struct
+{
+    agg_stream_t *stream;
+    const char *x;
+    const mf_quant_t *quant; // NULL if x has the type of the model
+    const char *rebase[2];   // stale base and round base, added to sum with weights alpha and -alpha
+    double alpha;
+    double scale; // of acc when publishing
+    char *out;
+} agg_stream_task_t;
+
+static void agg_tile_fold(void *_task, size_t k, size_t worker)
+{
+    (void)worker;
+    agg_stream_task_t *task = (agg_stream_task_t *)_task;
+    agg_stream_t *stream = task->stream;
+    const mf_tile_t *tile = &stream->layout.tiles[k];
+    const mf_tensor_t *tensor = &stream->layout.tensors[tile->t];
+    double *acc = stream->acc + tile->start;
+
+    const mf_quant_t *quant = task->quant;
+    if (quant == NULL || quant->plain)
+    {
+        mf_kernel_rolling(tensor->type, acc, mf_tensor_ptr(tensor, task->x, tile->start), task->alpha, tile->count);
+        return;
+    }
+
+    const mf_tensor_t *in = &quant->layout.tensors[tile->t];
+    double scale = quant->scale != NULL ? quant->scale[tile->t] : 1;
+    double zero = quant->scale != NULL ? quant->zero[tile->t] : 0;
+    mf_kernel_rolling_q(in->type, acc, mf_tensor_ptr(in, task->x, tile->start), scale, zero, task->alpha, tile->count);
+}
+
+// v - base of a stale sparse diff, acc can not take it: its weight would go through 0 before the diff is added
+static void agg_tile_rebase_sum(void *_task, size_t k, size_t worker)
+{
+    (void)worker;
+    agg_stream_task_t *task = (agg_stream_task_t *)_task;
+    agg_stream_t *stream = task->stream;
+    const mf_tile_t *tile = &stream->layout.tiles[k];
+    const mf_tensor_t *tensor = &stream->layout.tensors[tile->t];
+
+    mf_input_t inputs[2] = {
+        {.type = tensor->type, .data = mf_tensor_ptr(tensor, task->rebase[0], tile->start), .w = task->alpha},
+        {.type = tensor->type, .data = mf_tensor_ptr(tensor, task->rebase[1], tile->start), .w = -task->alpha},
+    };
+    mf_kernel_wsum_mixed(MF_TFLOAT64, stream->sum + tile->start, stream->sum + tile->start, inputs, 2, 0, tile->count);
+}
+
+static void agg_tile_publish(void *_task, size_t k, size_t worker)
+{
+    (void)worker;
+    agg_stream_task_t *task = (agg_stream_task_t *)_task;
+    agg_stream_t *stream = task->stream;
+    const mf_tile_t *tile = &stream->layout.tiles[k];
+    const mf_tensor_t *tensor = &stream->layout.tensors[tile->t];
+    double *acc = stream->acc + tile->start;
+
+    if (stream->sum != NULL)
+    {
+        // acc becomes the weighted sum of every diff
+        const void *in = acc;
+        mf_kernel_wsum(MF_TFLOAT64, acc, stream->sum + tile->start, &in, &stream->total_weight, 1, tile->count);
+    }
+
+    char *out = task->out + stream->base.info.data_offset + mf_tensor_offset(tensor, tile->start);
+    mf_kernel_add_acc(tensor->type, out, mf_tensor_ptr(tensor, base_data(&stream->base), tile->start), acc, task->scale, tile->count);
+}
+
+static int agg_stream_open_round(agg_stream_t *stream)
+{
+    if (acquire_base(stream->engine, head_id(stream->engine), &stream->base) < 0)
+        return -1;
+
+    if (base_layout(stream->engine, &stream->base, &stream->layout) < 0)
+    {
+        release_base(&stream->base);
+        return -1;
+    }
+
+    size_t n_elems = stream->layout.n_elems;
+    stream->total_weight = 0;
+    stream->sum_weight = 0;
+    stream->dataset_weight = 0;
+    stream->n_updates = 0;
+
+    if (stream->acc_capacity < n_elems)
+    {
+        double *acc = (double *)malloc(sizeof(double) * n_elems);
+        if (acc == NULL)
+        {
+            perror("Failed to allocate memory for the aggregation accumulator");
+            mf_layout_destroy(&stream->layout);
+            release_base(&stream->base);
+            return -1;
+        }
+
+        free(stream->acc);
+        stream->acc = acc;
+        stream->acc_capacity = n_elems;
+    }
+
+    // the first fold has alpha == 1, but acc must not contain nan/inf
+    memset(stream->acc, 0, sizeof(double) * n_elems);
+    return 0;
+}
+
+// acc becomes the weighted mean of the folded x and this one, w can be negative to take back x
+static void agg_stream_fold_data(agg_stream_t *stream, const char *x, const mf_quant_t *quant, double w)
+{
+    agg_stream_task_t task = {
+        .stream = stream,
+        .x = x,
+        .quant = quant,
+        .alpha = w / (stream->total_weight + w),
+    };
+
+    thread_pool_run(&stream->engine->pool, agg_tile_fold, &task, stream->layout.n_tiles);
+    stream->total_weight += w;
+}
+
+// sum += w * x, only the stored elements of x are touched
+static int agg_stream_scatter(agg_stream_t *stream, const mf_quant_t *quant, double w)
+{
+    if (stream->sum == NULL)
+    {
+        // zero filled pages, the ones no update touches are never allocated
+        stream->sum = (double *)calloc(stream->layout.n_elems > 0 ? stream->layout.n_elems : 1, sizeof(double));
+        if (stream->sum == NULL)
+        {
+            perror("Failed to allocate memory for the sparse accumulator");
+            return -1;
+        }
+    }
+
+    for (size_t t = 0; t < stream->layout.n_tensors; t++)
+    {
+        const mf_sparse_tensor_t *stored = &quant->sparse[t];
+        double scale = quant->scale != NULL ? quant->scale[t] : 1;
+        double zero = quant->scale != NULL ? quant->zero[t] : 0;
+        mf_kernel_scatter(quant->layout.tensors[t].type, stream->sum + stream->layout.tensors[t].start, 0, stored->index,
+                          stored->values, w * scale, -w * scale * zero, stored->nnz);
+    }
+
+    stream->sum_weight += w;
+    return 0;
+}
+
+int agg_stream_fold(agg_stream_t *stream, model_upd_t *update)
+{
+    set_debug(1);
+
+    mapped_model_t model = {0};
+    global_model_version_t stale_base = {0};
+    mf_quant_t quant = {0};
+    if (map_update(update, &model) < 0)
+    {
+        perror("Failed to map model update");
+        return -1;
+    }
+
+    int ret_code = -1;
+    if (!mfi_is_diff_format(model.info))
+    {
+        perror("Model is not in diff format");
+        goto unmap;
+    }
+
+    if (stream->base.file == NULL && agg_stream_open_round(stream) < 0)
+    {
+        perror("Failed to start a new aggregation round");
+        goto unmap;
+    }
+
+    int64_t t = update_staleness(stream->engine, &stream->base, &model);
+    if (t < 0)
+    {
+        fprintf(stderr, "Update is diffed from %lu, the round base is %lu\n", model.info.diffed_from_model_version, stream->base.id);
+        goto unmap;
+    }
+
+    if (mf_quant_init(&quant, &stream->layout, &model.info, model.data, update->meta) < 0)
+    {
+        perror("Update tensors do not match the global model");
+        goto unmap;
+    }
+
+    double w = update->weight;
+    if (w <= 0)
+    {
+        perror("Update has no dataset size");
+        goto unmap;
+    }
+
+    if (t > 0 && (acquire_base(stream->engine, stream->base.id - t, &stale_base) < 0 ||
+                  stale_base.info.data_size != stream->base.info.data_size))
+    {
+        perror("Failed to rebase update");
+        goto unmap;
+    }
+
+    // x is folded with weight dataset_size * s(t), publishing scales acc back by sum(s(t) * w) / sum(w)
+    double k = w * agg_staleness_factor(&stream->engine->staleness, t);
+    if (quant.sparse != NULL)
+    {
+        if (agg_stream_scatter(stream, &quant, k) < 0)
+            goto unmap;
+
+        if (t > 0)
+        {
+            agg_stream_task_t task = {
+                .stream = stream,
+                .rebase = {base_data(&stale_base), base_data(&stream->base)},
+                .alpha = k,
+            };
+            thread_pool_run(&stream->engine->pool, agg_tile_rebase_sum, &task, stream->layout.n_tiles);
+        }
+    }
+    else
+    {
+        agg_stream_fold_data(stream, mfi_get_data_ptr(model.info, model.data), &quant, k);
+    }
+
+    if (t > 0 && quant.sparse == NULL)
+    {
+        // v + diff - base
+        agg_stream_fold_data(stream, base_data(&stale_base), NULL, k);
+        agg_stream_fold_data(stream, base_data(&stream->base), NULL, -k);
+    }
+
+    stream->dataset_weight += w;
+    stream->n_updates++;
+    debug_print("Folded update %zu (weight %f, staleness %ld, total weight %f)\n", stream->n_updates, k, t, stream->total_weight + stream->sum_weight);
+    ret_code = 0;
+
+unmap:
+    mf_quant_destroy(&quant);
+    release_base(&stale_base);
+    unmap_model(&model);
+    return ret_code;
+}
+
+int agg_stream_publish(agg_stream_t *stream, uint64_t *id, shared_buffer_t **model)
+{
+    if (stream->base.file == NULL || stream->n_updates == 0)
+    {
+        perror("No update to publish");
+        return -1;
+    }
+
+    uint64_t new_global_model_id = stream->base.id + 1;
+
+    // with sparse diffs acc is turned into a sum by the publish pass
+    agg_stream_task_t task = {
+        .stream = stream,
+        .scale = (stream->sum != NULL ? 1 : stream->total_weight) / stream->dataset_weight,
+    };
+    if (create_output_model(&stream->base, &task.out) < 0)
+        return -1;
+
+    thread_pool_run(&stream->engine->pool, agg_tile_publish, &task, stream->layout.n_tiles);
+
+    *model = share_output_model(task.out, stream->base.file->size);
+    if (*model != NULL)
+    {
+        *id = new_global_model_id;
+        advance_head(stream->engine, new_global_model_id, *model, &stream->base);
+    }
+
+    // next round starts from the published model
+    mf_layout_destroy(&stream->layout);
+    release_base(&stream->base);
+    free(stream->sum);
+    stream->sum = NULL;
+    stream->n_updates = 0;
+    stream->total_weight = 0;
+    stream->sum_weight = 0;
+    stream->dataset_weight = 0;
+
+    return *model != NULL ? 0 : -1;
+}
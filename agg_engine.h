@@ -0,0 +1,125 @@
+#ifndef AGG_ENGINE_H
+#define AGG_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+#include "globals.h"
+#include "thread_pool.h"
+#include "shared_buffer.h"
+#include "global_model.h"
+#include "quant.h"
+
+// Bytes of the output model reduced by a single task, the inputs of a tile
+// (len * AGG_DEFAULT_TILE_SIZE) are streamed once by the kernels
+#define AGG_DEFAULT_TILE_SIZE (64 * 1024)
+
+// Staleness functions (FedAsync), s(0) == 1 with every decay
+#define AGG_DECAY_CONSTANT 0   // s(t) = 1
+#define AGG_DECAY_POLYNOMIAL 1 // s(t) = (t + 1)^-a
+#define AGG_DECAY_HINGE 2      // s(t) = 1 if t <= b, 1 / (a * (t - b) + 1) otherwise
+
+#define AGG_DEFAULT_MAX_STALENESS (GLOBAL_MODEL_VERSIONS - 1) // the bases of the stale updates are resident
+
+// An update diffed from model v is t = head - v rounds stale, head being the base of the round.
+// It is rebased on head (v + diff - head) and weighted dataset_size * s(t) / sum(dataset_size):
+// fresh updates keep the plain weighted mean, stale ones move the model less.
+typedef struct
+{
+    uint8_t decay;
+    double a;
+    double b;
+    uint64_t max_staleness; // more stale updates are discarded
+} agg_staleness_t;
+
+static inline double agg_staleness_factor(const agg_staleness_t *staleness, uint64_t t)
+{
+    switch (staleness->decay)
+    {
+    case AGG_DECAY_POLYNOMIAL:
+        return pow((double)t + 1, -staleness->a);
+    case AGG_DECAY_HINGE:
+        return t <= staleness->b ? 1 : 1 / (staleness->a * ((double)t - staleness->b) + 1);
+    default:
+        return 1;
+    }
+}
+
+// Reducers of a batch round (the streaming mode is always a weighted mean).
+// Every update is first rebased and decayed as above, median and trimmed mean ignore the dataset_size.
+#define AGG_REDUCER_MEAN 0         // weighted mean (FedAvg)
+#define AGG_REDUCER_MEDIAN 1       // coordinate-wise median
+#define AGG_REDUCER_TRIMMED_MEAN 2 // coordinate-wise mean without the trim * n smallest and largest values
+#define AGG_REDUCER_KRUM 3         // multi-Krum: weighted mean of the m updates closest to their n - f - 2 neighbours
+
+typedef struct
+{
+    uint8_t type;
+    double trim; // TRIMMED_MEAN: fraction of the updates dropped on each side
+    size_t f;    // KRUM: byzantine updates tolerated
+    size_t m;    // KRUM: updates selected, 0 is n - f
+} agg_reducer_t;
+
+typedef struct
+{
+    size_t tile_size;
+    thread_pool_t pool;
+    agg_staleness_t staleness;
+    agg_reducer_t reducer;
+
+    // the last model produced, base of the next round (file == NULL before the first round,
+    // the base is the published global model). It can be newer than global_model_id while
+    // the model is written and published.
+    global_model_version_t head;
+    atomic_uint_fast64_t head_id; // id of head for the other threads, UINT64_MAX before the first round
+} agg_engine_t;
+
+int agg_engine_init(agg_engine_t *engine, size_t n_workers, size_t tile_size, const agg_staleness_t *staleness, const agg_reducer_t *reducer);
+void agg_engine_destroy(agg_engine_t *engine);
+
+// The base of the next round the engine reduces, the staleness of an update is measured from it.
+// Safe to call from any thread.
+static inline uint64_t agg_engine_head(agg_engine_t *engine)
+{
+    uint64_t id = atomic_load(&engine->head_id);
+    return id != UINT64_MAX ? id : global_model_id;
+}
+
+// Maps every update and the base models they were diffed from, then reduces the data section
+// tile by tile across the engine pool into a new model in memory (*model, see agg_engine_write_model)
+// with id *id. The updates too stale (or diffed from an unknown model) are skipped.
+// Returns -1 on failure
+int agg_engine_aggregate(agg_engine_t *engine, model_upd_t **updates, size_t len, uint64_t *id, shared_buffer_t **model);
+
+// Writes the model file <id> durably (fsync), it is visible under its final name only once complete
+int agg_engine_write_model(uint64_t id, shared_buffer_t *model);
+
+// Streaming aggregation: every update is folded into a float64 rolling weighted mean
+// as soon as it is available, publishing the new model is a single pass over the accumulator
+typedef struct
+{
+    agg_engine_t *engine;
+    global_model_version_t base; // engine head when the round started, file == NULL until the first fold of a round
+    mf_layout_t layout; // tensors of base split in tiles, quantized updates are dequantized tensor by tensor
+
+    double *acc; // weighted mean of the (rebased, decayed) diffs folded in the current round
+    size_t acc_capacity;
+    double total_weight;   // sum(dataset_size * s(t)), the weight of acc
+    double *sum;           // weighted sum of the sparse diffs, scattered in O(nnz), NULL until the first one of the round
+    double sum_weight;
+    double dataset_weight; // sum(dataset_size)
+    size_t n_updates;
+} agg_stream_t;
+
+void agg_stream_init(agg_stream_t *stream, agg_engine_t *engine);
+void agg_stream_destroy(agg_stream_t *stream);
+
+// The update file is not needed anymore once this function returns, a stale update is rebased on the round base
+int agg_stream_fold(agg_stream_t *stream, model_upd_t *update);
+
+// Computes base + acc as the next global model in memory (*model, with id *id) and starts a new round
+// Returns -1 on failure
+int agg_stream_publish(agg_stream_t *stream, uint64_t *id, shared_buffer_t **model);
+
+#endif // AGG_ENGINE_H
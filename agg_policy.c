@@ -0,0 +1,126 @@
+#include "agg_policy.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int agg_policy_init(agg_policy_t *policy, const char *spec)
+{
+    memset(policy, 0, sizeof(agg_policy_t));
+    policy->type = AGG_POLICY_COUNT;
+    policy->count = AGG_POLICY_DEFAULT_COUNT;
+    if (spec == NULL)
+        return 0;
+
+    int n = 0;
+    if (sscanf(spec, "count:%zu%n", &policy->count, &n) == 1 && spec[n] == '\0')
+    {
+        policy->type = AGG_POLICY_COUNT;
+    }
+    else if (sscanf(spec, "deadline:%lf%n", &policy->seconds, &n) == 1)
+    {
+        policy->type = AGG_POLICY_DEADLINE;
+        policy->count = 1;
+    }
+    else if (sscanf(spec, "weight:%lf%n", &policy->weight, &n) == 1 && spec[n] == '\0')
+    {
+        policy->type = AGG_POLICY_WEIGHT;
+    }
+    else if (sscanf(spec, "adaptive:%lf%n", &policy->seconds, &n) == 1)
+    {
+        policy->type = AGG_POLICY_ADAPTIVE;
+        policy->count = 1;
+    }
+    else
+    {
+        return -1;
+    }
+
+    // optional min updates of deadline and adaptive
+    if ((policy->type == AGG_POLICY_DEADLINE || policy->type == AGG_POLICY_ADAPTIVE) && spec[n] != '\0')
+    {
+        int m = 0;
+        if (sscanf(spec + n, ":%zu%n", &policy->count, &m) != 1 || spec[n + m] != '\0')
+            return -1;
+    }
+
+    if (policy->count == 0 || policy->count > MAX_PENDING_MODEL_UPDATES || policy->seconds < 0 || policy->weight < 0)
+        return -1;
+
+    policy->adaptive_count = policy->count;
+    return 0;
+}
+
+static double seconds_since(const struct timespec *start, const struct timespec *now)
+{
+    return (double)(now->tv_sec - start->tv_sec) + (double)(now->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// WAIT: the dequeue wakes up after seconds even if no update arrives (absolute CLOCK_REALTIME)
+static void wait_for(agg_config_t *conf, double seconds)
+{
+    clock_gettime(CLOCK_REALTIME, &conf->ts);
+    time_t sec = (time_t)seconds;
+    long nsec = conf->ts.tv_nsec + (long)((seconds - (double)sec) * 1e9);
+    conf->ts.tv_sec += sec + nsec / 1000000000L;
+    conf->ts.tv_nsec = nsec % 1000000000L;
+    conf->type = 2;
+}
+
+// the threshold moves halfway to the updates the measured rate brings in policy->seconds
+static void adapt_count(agg_policy_t *policy, size_t updates, double elapsed)
+{
+    if (elapsed <= 0)
+        return;
+
+    double target = (double)updates / elapsed * policy->seconds;
+    policy->adaptive_count = (policy->adaptive_count + target) / 2;
+    if (policy->adaptive_count < policy->count)
+        policy->adaptive_count = policy->count;
+    if (policy->adaptive_count > MAX_PENDING_MODEL_UPDATES)
+        policy->adaptive_count = MAX_PENDING_MODEL_UPDATES;
+}
+
+void agg_policy_decide(agg_policy_t *policy, const agg_round_t *round, agg_config_t *conf)
+{
+    conf->type = 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = seconds_since(&round->last_aggregation, &now);
+
+    switch (policy->type)
+    {
+    case AGG_POLICY_COUNT:
+        if (round->updates >= policy->count)
+            conf->type = 1;
+        break;
+    case AGG_POLICY_WEIGHT:
+        if (round->updates > 0 && round->weight >= policy->weight)
+            conf->type = 1;
+        break;
+    case AGG_POLICY_DEADLINE:
+        // with less than count updates the round waits for the next one
+        if (round->updates < policy->count)
+            break;
+
+        if (elapsed >= policy->seconds)
+            conf->type = 1;
+        else
+            wait_for(conf, policy->seconds - elapsed);
+        break;
+    case AGG_POLICY_ADAPTIVE:
+        if (round->updates < policy->count)
+            break;
+
+        if (round->updates >= (size_t)policy->adaptive_count || elapsed >= AGG_POLICY_ADAPTIVE_SLACK * policy->seconds)
+        {
+            adapt_count(policy, round->updates, elapsed);
+            conf->type = 1;
+        }
+        else
+        {
+            wait_for(conf, AGG_POLICY_ADAPTIVE_SLACK * policy->seconds - elapsed);
+        }
+        break;
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef AGG_POLICY_H
+#define AGG_POLICY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "aggregator.h"
+
+// When the buffered updates become the next round, evaluated by should_aggregate_models
+// after every update and whenever the WAIT deadline it asked for expires
+#define AGG_POLICY_COUNT 0    // count updates
+#define AGG_POLICY_DEADLINE 1 // seconds after the last aggregation, with at least count updates
+#define AGG_POLICY_WEIGHT 2   // the updates add up to weight (dataset_size)
+#define AGG_POLICY_ADAPTIVE 3 // the count follows the arrival rate so that a round takes seconds
+
+#define AGG_POLICY_DEFAULT_COUNT 10
+#define AGG_POLICY_ADAPTIVE_SLACK 2 // adaptive rounds are closed anyway after slack * seconds
+
+typedef struct
+{
+    uint8_t type;
+    size_t count;
+    double seconds;
+    double weight;
+
+    double adaptive_count; // ADAPTIVE: updates expected in seconds at the last measured rate
+} agg_policy_t;
+
+// count:<updates> | deadline:<seconds>[:<min updates>] | weight:<dataset size> | adaptive:<seconds>[:<min updates>]
+// NULL is the default policy (count:AGG_POLICY_DEFAULT_COUNT)
+int agg_policy_init(agg_policy_t *policy, const char *spec);
+
+void agg_policy_decide(agg_policy_t *policy, const agg_round_t *round, agg_config_t *conf);
+
+#endif // AGG_POLICY_H
@@ -1,105 +1,393 @@
 #include "aggregator.h"
 
-int normalize_update(model_upd_t *update, uint64_t latest_version)
+static void discard_update(model_upd_t *update)
 {
+    if (remove(update->file_name) == -1)
+        perror("Failed to remove model update file");
 
-    int fd = open(update->file_name, O_RDONLY);
-    if (fd == -1)
+    free(update->meta);
+    free(update);
+}
+
+// validates a whole batch against round_base in one pass, using the header fields
+// captured at SEND_WEIGHT time (no file is opened). The invalid updates are discarded,
+// the valid ones are moved to the front of updates keeping their order.
+// round_base is the model the buffered round will be reduced on (see agg_pipeline_t), the updates
+// up to max_staleness versions behind it are accepted and rebased by the fold stage, so an update
+// counted in a round is never skipped there for being too stale.
+// returns the number of valid updates
+static int normalize_updates(model_upd_t **updates, int len, uint64_t round_base, uint64_t max_staleness)
+{
+    int valid = 0;
+    for (int i = 0; i < len; i++)
     {
-        perror("Failed to open model update file");
-        return -1;
+        model_upd_t *update = updates[i];
+        if (!(update->flags & MF_FLAG_DIFF_FORMAT))
+        {
+            fprintf(stderr, "Model is not in diff format: %s\n", update->file_name);
+            discard_update(update);
+        }
+        else if (update->diffed_from > round_base || round_base - update->diffed_from > max_staleness)
+        {
+            fprintf(stderr, "Update too stale: %s (%lu, round base %lu)\n", update->file_name, update->diffed_from, round_base);
+            discard_update(update);
+        }
+        else
+        {
+            updates[valid++] = update;
+        }
     }
 
-    model_file_info_t model_info = {0};
-    if (load_model_info_from_file(fd, &model_info) < 0)
+    return valid;
+}
+
+define_mpsc_ring_methods(agg_job_t *, agg_job);
+
+typedef struct
+{
+    aggregator_config_t *config;
+
+    agg_job_ring_t fold_queue;
+    agg_job_ring_t write_queue;
+    agg_job_ring_t publish_queue;
+    pthread_t fold_thread;
+    pthread_t write_thread;
+    pthread_t publish_thread;
+
+    // base of the round being buffered: the engine head once the rounds sent before it are reduced.
+    // Bumped by the ingest thread for every round it sends, undone by the fold stage if the round fails.
+    atomic_uint_fast64_t round_base;
+    atomic_uint stopping; // set by agg_pipeline_stop, the writes are not retried anymore
+} agg_pipeline_t;
+
+static agg_job_t *new_job(uint8_t type, model_upd_t **updates, size_t len)
+{
+    agg_job_t *job = (agg_job_t *)malloc(sizeof(agg_job_t) + len * sizeof(model_upd_t *));
+    if (job == NULL)
     {
-        perror("Failed to load model info from file");
-        return -1;
+        perror("Failed to allocate aggregation job");
+        return NULL;
     }
 
-    close(fd);
+    job->type = type;
+    job->id = UINT64_MAX;
+    job->model = NULL;
+    job->len = len;
+    memcpy(job->updates, updates, len * sizeof(model_upd_t *));
+    return job;
+}
+
+static void free_job(agg_job_t *job)
+{
+    if (job->model != NULL)
+        shared_buffer_release(job->model);
+    free(job);
+}
+
+static void *fold_stage(void *_pipe)
+{
+    set_debug(1);
+    agg_pipeline_t *pipe = (agg_pipeline_t *)_pipe;
+
+    agg_stream_t stream;
+    agg_stream_init(&stream, pipe->config->engine);
 
-    if (!mfi_is_diff_format(model_info))
+    agg_job_t *jobs[AGG_STAGE_QUEUE_SIZE];
+    int n;
+    while ((n = ring_agg_job_dequeue_batch(&pipe->fold_queue, jobs, AGG_STAGE_QUEUE_SIZE, NULL)) > 0)
     {
-        perror("Model is not in diff format");
-        return -1;
+        for (int i = 0; i < n; i++)
+        {
+            agg_job_t *job = jobs[i];
+            if (job->type == AGG_JOB_FOLD)
+            {
+                if (agg_stream_fold(&stream, job->updates[0]) < 0)
+                    debug_print("Failed to fold %s\n", job->updates[0]->file_name);
+
+                discard_update(job->updates[0]);
+                free(job);
+                continue;
+            }
+
+            int res = job->type == AGG_JOB_ROUND ? aggregate_models(job->updates, job->len, &job->id, &job->model) : agg_stream_publish(&stream, &job->id, &job->model);
+            for (size_t j = 0; j < job->len; j++)
+                discard_update(job->updates[j]);
+            job->len = 0;
+
+            if (res < 0)
+            {
+                perror("Failed to aggregate models");
+                atomic_fetch_sub(&pipe->round_base, 1);
+                free_job(job);
+                continue;
+            }
+
+            debug_print("Aggregated model %lu\n", job->id);
+            ring_agg_job_enqueue(&pipe->write_queue, job);
+        }
     }
 
-    if (model_info.diffed_from_model_version != latest_version)
+    agg_stream_destroy(&stream);
+    ring_agg_job_close(&pipe->write_queue);
+    return NULL;
+}
+
+// sleeps delay_ms and doubles it for the next failure, up to AGG_WRITE_RETRY_MAX_MS
+static void retry_backoff(unsigned int *delay_ms)
+{
+    struct timespec delay = {.tv_sec = *delay_ms / 1000, .tv_nsec = (*delay_ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+    *delay_ms = *delay_ms * 2 < AGG_WRITE_RETRY_MAX_MS ? *delay_ms * 2 : AGG_WRITE_RETRY_MAX_MS;
+}
+
+// the engine head is already this model: the next rounds are built on it, so it is written until
+// it succeeds. Gives up only once the pipeline is stopping.
+static int write_job(agg_pipeline_t *pipe, agg_job_t *job)
+{
+    unsigned int delay_ms = AGG_WRITE_RETRY_MS;
+    while (agg_engine_write_model(job->id, job->model) < 0)
     {
-        perror("Strugglers not yet supported");
-        return -1;
+        if (atomic_load(&pipe->stopping))
+            return -1;
+
+        fprintf(stderr, "Failed to write model %lu, retrying in %u ms\n", job->id, delay_ms);
+        retry_backoff(&delay_ms);
     }
 
     return 0;
 }
 
-void model_queue_thread(void *_args)
+static void *write_stage(void *_pipe)
 {
     set_debug(1);
-    model_upd_t *updates[MAX_PENDING_MODEL_UPDATES];
-    size_t updates_index = 0;
+    agg_pipeline_t *pipe = (agg_pipeline_t *)_pipe;
 
-    model_upd_t *update;
-    struct timespec last_aggregation = {0};
-    agg_config_t agg_config = {0};
-
-    int stat = 0;
-    while (1)
+    // once a model is lost the ones built on it can not be published either
+    uint8_t failed = 0;
+    agg_job_t *jobs[AGG_STAGE_QUEUE_SIZE];
+    int n;
+    while ((n = ring_agg_job_dequeue_batch(&pipe->write_queue, jobs, AGG_STAGE_QUEUE_SIZE, NULL)) > 0)
     {
-        if (agg_config.type == 2)
-            stat = queue_model_upd_tdequeue(&model_queue, &update, &agg_config.ts);
-        else
-            stat = queue_model_upd_dequeue(&model_queue, &update);
-
-        if (stat < 0)
+        for (int i = 0; i < n; i++)
         {
-            if (stat == QUEUE_CLOSED)
+            if (failed || write_job(pipe, jobs[i]) < 0)
             {
-                return;
+                fprintf(stderr, "Failed to write model %lu, it is not published\n", jobs[i]->id);
+                failed = 1;
+                free_job(jobs[i]);
+                continue;
             }
 
-            perror("Failed to dequeue model update");
-            return;
+            debug_print("Written model %lu\n", jobs[i]->id);
+            ring_agg_job_enqueue(&pipe->publish_queue, jobs[i]);
         }
+    }
+
+    ring_agg_job_close(&pipe->publish_queue);
+    return NULL;
+}
 
-        if (normalize_update(update, global_model_id) >= 0)
+// a failed publish still serves the (written) model from its file, it is retried to keep it
+// resident for the readers. Gives up only once the pipeline is stopping.
+static int publish_job(agg_pipeline_t *pipe, agg_job_t *job)
+{
+    unsigned int delay_ms = AGG_WRITE_RETRY_MS;
+    while (global_model_publish(job->id, job->model) < 0)
+    {
+        if (atomic_load(&pipe->stopping))
+            return -1;
+
+        fprintf(stderr, "Failed to publish model %lu, retrying in %u ms\n", job->id, delay_ms);
+        retry_backoff(&delay_ms);
+    }
+
+    return 0;
+}
+
+static void *publish_stage(void *_pipe)
+{
+    agg_pipeline_t *pipe = (agg_pipeline_t *)_pipe;
+
+    agg_job_t *jobs[AGG_STAGE_QUEUE_SIZE];
+    int n;
+    while ((n = ring_agg_job_dequeue_batch(&pipe->publish_queue, jobs, AGG_STAGE_QUEUE_SIZE, NULL)) > 0)
+    {
+        for (int i = 0; i < n; i++)
         {
-            updates[updates_index++] = update;
+            if (publish_job(pipe, jobs[i]) < 0)
+                fprintf(stderr, "Failed to publish model %lu, it is served from its file\n", jobs[i]->id);
+            else
+                printf("Published model %lu\n", jobs[i]->id);
+            shared_buffer_release(jobs[i]->model);
+            free(jobs[i]);
         }
+    }
+
+    return NULL;
+}
+
+static int agg_pipeline_start(agg_pipeline_t *pipe, aggregator_config_t *config)
+{
+    pipe->config = config;
+    atomic_init(&pipe->round_base, agg_engine_head(config->engine));
+    atomic_init(&pipe->stopping, 0);
+
+    if (ring_agg_job_init(&pipe->fold_queue, AGG_FOLD_QUEUE_SIZE) < 0 ||
+        ring_agg_job_init(&pipe->write_queue, AGG_STAGE_QUEUE_SIZE) < 0 ||
+        ring_agg_job_init(&pipe->publish_queue, AGG_STAGE_QUEUE_SIZE) < 0)
+    {
+        perror("Failed to initialize aggregation queues");
+        return -1;
+    }
+
+    if (pthread_create(&pipe->fold_thread, NULL, fold_stage, pipe) != 0 ||
+        pthread_create(&pipe->write_thread, NULL, write_stage, pipe) != 0 ||
+        pthread_create(&pipe->publish_thread, NULL, publish_stage, pipe) != 0)
+    {
+        perror("Failed to create aggregation stage");
+        return -1;
+    }
+
+    return 0;
+}
 
-        should_aggregate_models(updates_index, &last_aggregation, &agg_config);
-        if (agg_config.type == 0)
+// the rounds already sent are written and published before returning (a model that can not be
+// written anymore is dropped, with the ones after it)
+static void agg_pipeline_stop(agg_pipeline_t *pipe)
+{
+    atomic_store(&pipe->stopping, 1);
+    ring_agg_job_close(&pipe->fold_queue);
+    pthread_join(pipe->fold_thread, NULL);
+    pthread_join(pipe->write_thread, NULL);
+    pthread_join(pipe->publish_thread, NULL);
+
+    ring_agg_job_destroy(&pipe->fold_queue);
+    ring_agg_job_destroy(&pipe->write_queue);
+    ring_agg_job_destroy(&pipe->publish_queue);
+}
+
+typedef struct
+{
+    aggregator_config_t *config;
+    agg_pipeline_t *pipe;
+    model_upd_t *updates[MAX_PENDING_MODEL_UPDATES];
+    agg_round_t round;
+    agg_config_t agg_config;
+} aggregator_state_t;
+
+// the update has already been validated by normalize_updates
+static void buffer_update(aggregator_state_t *state, model_upd_t *update)
+{
+    if (state->config->mode == AGG_MODE_STREAMING)
+    {
+        agg_job_t *job = new_job(AGG_JOB_FOLD, &update, 1);
+        if (job == NULL)
         {
-            continue;
+            discard_update(update);
+            return;
         }
 
-        if (agg_config.type == 1)
+        // the fold stage frees the update
+        state->round.updates++;
+        state->round.weight += update->weight;
+        ring_agg_job_enqueue(&state->pipe->fold_queue, job);
+    }
+    else
+    {
+        state->updates[state->round.updates++] = update;
+        state->round.weight += update->weight;
+    }
+}
+
+// returns 1 if a round has been sent to the fold stage
+static int try_aggregate(aggregator_state_t *state)
+{
+    aggregator_config_t *config = state->config;
+    agg_round_t *round = &state->round;
+    should_aggregate_models(round, &state->agg_config);
+
+    // the batch buffer is full
+    if (round->updates >= MAX_PENDING_MODEL_UPDATES)
+        state->agg_config.type = 1;
+
+    if (state->agg_config.type != 1 || round->updates == 0)
+        return 0;
+
+    printf("Aggregating %zu models\n", round->updates);
+
+    agg_job_t *job = config->mode == AGG_MODE_STREAMING
+                         ? new_job(AGG_JOB_PUBLISH, NULL, 0)
+                         : new_job(AGG_JOB_ROUND, state->updates, round->updates);
+    if (job == NULL)
+        return 0;
+
+    // the updates buffered from now on are reduced on the model of this round
+    atomic_fetch_add(&state->pipe->round_base, 1);
+    ring_agg_job_enqueue(&state->pipe->fold_queue, job);
+
+    clock_gettime(CLOCK_MONOTONIC, &round->last_aggregation);
+    round->updates = 0;
+    round->weight = 0;
+    return 1;
+}
+
+// a round sent mid-batch moves the base of the next one,
+// so the rest of the batch is validated again against the new one
+static void buffer_batch(aggregator_state_t *state, model_upd_t **batch, int len)
+{
+    uint64_t max_staleness = state->config->engine->staleness.max_staleness;
+    while (len > 0)
+    {
+        int valid = normalize_updates(batch, len, atomic_load(&state->pipe->round_base), max_staleness);
+        int i = 0;
+        while (i < valid)
         {
-            printf("Aggregating %zu models\n", updates_index);
+            buffer_update(state, batch[i++]);
+            if (try_aggregate(state))
+                break;
+        }
 
-            int new_id = aggregate_models(updates, updates_index);
-            if (new_id < 0)
-            {
-                debug_print("Failed to aggregate models\n");
-                perror("Failed to aggregate models");
-                continue;
-            }
+        batch += i;
+        len = valid - i;
+    }
+}
 
-            debug_print("Aggregated models\n");
+void model_queue_thread(void *_args)
+{
+    set_debug(1);
+    agg_pipeline_t pipe;
+    aggregator_state_t state = {0};
+    state.config = (aggregator_config_t *)_args;
+    state.pipe = &pipe;
 
-            set_global_model_id(new_id);
+    if (agg_pipeline_start(&pipe, state.config) < 0)
+        return;
 
-            for (size_t i = 0; i < updates_index; i++)
-            {
-                if (remove(updates[i]->file_name) == -1)
-                {
-                    perror("Failed to remove model update file");
-                    return;
-                }
-                free(updates[i]);
-            }
-            updates_index = 0;
+    clock_gettime(CLOCK_MONOTONIC, &state.round.last_aggregation);
+
+    model_upd_t *batch[MODEL_QUEUE_BATCH];
+    while (1)
+    {
+        // type 2 (WAIT) asks to be called again at agg_config.ts even if nothing arrives
+        const struct timespec *ts = state.agg_config.type == 2 ? &state.agg_config.ts : NULL;
+        int n = ring_model_upd_dequeue_batch(&model_queue, batch, MODEL_QUEUE_BATCH, ts);
+        if (n == QUEUE_CLOSED)
+            break;
+
+        if (n == QUEUE_EMPTY)
+        {
+            try_aggregate(&state);
+            continue;
+        }
+
+        if (n < 0)
+        {
+            perror("Failed to dequeue model update");
+            break;
         }
+
+        buffer_batch(&state, batch, n);
     }
-}
\ No newline at end of file
+
+    agg_pipeline_stop(&pipe);
+}
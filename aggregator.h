@@ -5,24 +5,74 @@
 #include <time.h>
 
 #include "globals.h"
+#include "agg_engine.h"
+#include "global_model.h"
+
+#define AGG_MODE_BATCH 0     // updates are buffered on disk and reduced all at once by aggregate_models
+#define AGG_MODE_STREAMING 1 // updates are folded into an in-memory accumulator as soon as they are dequeued
 
 typedef struct
 {
-    uint8_t type; // 0: NO, 1: YES, 2: WAIT
+    uint8_t mode;
+    agg_engine_t *engine;
+} aggregator_config_t;
+
+// Aggregation runs as a pipeline, every stage on its own thread with bounded queues in between:
+// ingest (model_queue_thread: dequeue, validate, decide) -> fold (reduce the round in memory)
+// -> write (model file + fsync) -> publish (global model). The ingest of the next round overlaps
+// the reduction and the write out of the previous one.
+#define AGG_JOB_FOLD 0    // streaming mode: fold updates[0] into the accumulator
+#define AGG_JOB_ROUND 1   // batch mode: reduce the len updates into the next model
+#define AGG_JOB_PUBLISH 2 // streaming mode: turn the accumulator into the next model
+
+#define AGG_FOLD_QUEUE_SIZE 256 // power of two, in streaming mode every update is a job
+#define AGG_STAGE_QUEUE_SIZE 4  // power of two, rounds waiting to be written / published
+
+// The engine builds the next round on a model as soon as it is reduced, a model file that can not be
+// written is retried (the full write queue holds the fold stage back) instead of being skipped,
+// so is a model that can not be made resident when it is published
+#define AGG_WRITE_RETRY_MS 100      // first delay, doubled after every failure
+#define AGG_WRITE_RETRY_MAX_MS 5000
+
+typedef struct
+{
+    uint8_t type;
+
+    // set by the fold stage
+    uint64_t id;
+    shared_buffer_t *model;
+
+    size_t len;
+    model_upd_t *updates[]; // owned by the job until the fold stage discards them
+} agg_job_t;
+
+declare_mpsc_ring_type(agg_job_t *, agg_job);
+
+typedef struct
+{
+    uint8_t type; // 0: NO, 1: YES, 2: WAIT (ask again at ts, absolute CLOCK_REALTIME, if no update arrives)
     struct timespec ts;
 } agg_config_t;
 
-// This function must be defined by the user
-int aggregate_models(model_upd_t **updates, size_t len);
+// The round being buffered
+typedef struct
+{
+    size_t updates;
+    double weight;                    // sum of the dataset_size of the updates
+    struct timespec last_aggregation; // CLOCK_MONOTONIC, the round started then
+} agg_round_t;
 
 // This function must be defined by the user
-double get_weights_from_metadata(char *buff, size_t size);
+// Reduces the updates into the next global model, kept in memory in *model (written by the pipeline)
+// with id *id. Returns -1 on failure
+int aggregate_models(model_upd_t **updates, size_t len, uint64_t *id, shared_buffer_t **model);
 
-// This function must be defined by the user
-// Note that all updates are ensured as diffs from the latest global model
-void should_aggregate_models(size_t buffered_updates, struct timespec *last_aggregation, agg_config_t *conf);
+// This function must be defined by the user (e.g. with an agg_policy_t)
+// Note that all updates are ensured as diffs from one of the last max_staleness + 1 global models.
+// A round is aggregated anyway once MAX_PENDING_MODEL_UPDATES updates are buffered.
+void should_aggregate_models(const agg_round_t *round, agg_config_t *conf);
 
-// thread for handling model updates
+// thread for handling model updates, _args is an aggregator_config_t *
 void model_queue_thread(void *_args);
 
 #endif // AGGREGATOR_H
\ No newline at end of file
@@ -0,0 +1,191 @@
+#include "compression.h"
+#include "lz4.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// byte planes: the same byte of every element is stored together, exponents and high bytes
+// of floats become long runs LZ4 can find
+static void shuffle(char *dst, const char *src, size_t size, size_t elem_size)
+{
+    size_t n = size / elem_size;
+    for (size_t b = 0; b < elem_size; b++)
+        for (size_t i = 0; i < n; i++)
+            dst[b * n + i] = src[i * elem_size + b];
+
+    memcpy(dst + n * elem_size, src + n * elem_size, size - n * elem_size);
+}
+
+static void unshuffle(char *dst, const char *src, size_t size, size_t elem_size)
+{
+    size_t n = size / elem_size;
+    for (size_t b = 0; b < elem_size; b++)
+        for (size_t i = 0; i < n; i++)
+            dst[i * elem_size + b] = src[b * n + i];
+
+    memcpy(dst + n * elem_size, src + n * elem_size, size - n * elem_size);
+}
+
+static inline void put_chunk_header(char *dst, uint32_t raw_size, uint32_t stored_size, uint8_t mode)
+{
+    memcpy(dst, &raw_size, sizeof(raw_size));
+    memcpy(dst + sizeof(raw_size), &stored_size, sizeof(stored_size));
+    dst[2 * sizeof(uint32_t)] = (char)mode;
+}
+
+static inline void get_chunk_header(const char *src, uint32_t *raw_size, uint32_t *stored_size, uint8_t *mode)
+{
+    memcpy(raw_size, src, sizeof(*raw_size));
+    memcpy(stored_size, src + sizeof(*raw_size), sizeof(*stored_size));
+    *mode = (uint8_t)src[2 * sizeof(uint32_t)];
+}
+
+int mf_compress_model(const char *model, size_t size, model_file_info_t *info, char **out, size_t *out_size)
+{
+    if (info->data_offset > size || mfi_is_compressed(*info))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // the shuffle needs every tensor to have the same type (as the kernels)
+    int data_type = mfi_data_type(info, (char *)model);
+    size_t elem_size = data_type < 0 ? 1 : MF_SIZE(data_type);
+    if (elem_size > 0x0f)
+        elem_size = 1;
+
+    size_t data_size = size - info->data_offset;
+    size_t n_chunks = (data_size + MF_CHUNK_SIZE - 1) / MF_CHUNK_SIZE;
+    size_t capacity = info->data_offset + n_chunks * MF_CHUNK_HEADER_SIZE + data_size;
+
+    char *dst = (char *)malloc(capacity);
+    char *shuffled = elem_size > 1 ? (char *)malloc(MF_CHUNK_SIZE) : NULL;
+    if (dst == NULL || (elem_size > 1 && shuffled == NULL))
+    {
+        perror("Failed to allocate compressed model");
+        free(dst);
+        free(shuffled);
+        return -1;
+    }
+
+    memcpy(dst, model, info->data_offset);
+    size_t pos = info->data_offset;
+    const char *data = model + info->data_offset;
+    for (size_t off = 0; off < data_size; off += MF_CHUNK_SIZE)
+    {
+        size_t raw_size = data_size - off < MF_CHUNK_SIZE ? data_size - off : MF_CHUNK_SIZE;
+        const char *src = data + off;
+        uint8_t mode = MF_CHUNK_LZ4;
+        if (shuffled != NULL)
+        {
+            shuffle(shuffled, src, raw_size, elem_size);
+            src = shuffled;
+            mode |= (uint8_t)(elem_size << 4);
+        }
+
+        // a chunk that does not shrink is stored as is
+        char *payload = dst + pos + MF_CHUNK_HEADER_SIZE;
+        ssize_t stored_size = lz4_compress_block(src, raw_size, payload, raw_size - 1);
+        if (stored_size < 0)
+        {
+            memcpy(payload, data + off, raw_size);
+            stored_size = raw_size;
+            mode = MF_CHUNK_STORED;
+        }
+
+        put_chunk_header(dst + pos, raw_size, stored_size, mode);
+        pos += MF_CHUNK_HEADER_SIZE + stored_size;
+    }
+
+    free(shuffled);
+
+    uint64_t file_size = pos;
+    memcpy(dst + MF_SIZE_OFF, &file_size, sizeof(file_size));
+    mf_add_flags(MF_FLAG_COMPRESSED, dst);
+
+    char *shrunk = (char *)realloc(dst, pos);
+    *out = shrunk != NULL ? shrunk : dst;
+    *out_size = pos;
+    return 0;
+}
+
+int mf_decompress_model(const char *model, size_t size, model_file_info_t *info, char **out, size_t *out_size)
+{
+    set_debug(1);
+
+    if (info->data_offset > size || !mfi_is_compressed(*info))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // the chunk headers first: the raw size, and nothing is decoded from a truncated upload
+    size_t raw_data_size = 0;
+    for (size_t pos = info->data_offset; pos < size;)
+    {
+        uint32_t raw_size, stored_size;
+        uint8_t mode;
+        if (size - pos < MF_CHUNK_HEADER_SIZE)
+            goto malformed;
+
+        get_chunk_header(model + pos, &raw_size, &stored_size, &mode);
+        pos += MF_CHUNK_HEADER_SIZE;
+        if (raw_size > MF_CHUNK_SIZE || stored_size > size - pos ||
+            (mf_chunk_codec(mode) == MF_CHUNK_STORED && stored_size != raw_size) ||
+            mf_chunk_codec(mode) > MF_CHUNK_LZ4)
+            goto malformed;
+
+        raw_data_size += raw_size;
+        pos += stored_size;
+    }
+
+    size_t raw_file_size = info->data_offset + raw_data_size;
+    char *dst = mmap(NULL, raw_file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (dst == MAP_FAILED)
+    {
+        perror("Failed to allocate decompressed model");
+        return -1;
+    }
+
+    char shuffled[MF_CHUNK_SIZE];
+    size_t out_pos = info->data_offset;
+    for (size_t pos = info->data_offset; pos < size;)
+    {
+        uint32_t raw_size, stored_size;
+        uint8_t mode;
+        get_chunk_header(model + pos, &raw_size, &stored_size, &mode);
+        pos += MF_CHUNK_HEADER_SIZE;
+
+        size_t elem_size = mf_chunk_shuffle(mode);
+        if (mf_chunk_codec(mode) == MF_CHUNK_STORED)
+            memcpy(dst + out_pos, model + pos, raw_size);
+        else if (elem_size > 1)
+        {
+            if (lz4_decompress_block(model + pos, stored_size, shuffled, raw_size) != raw_size)
+                goto unmap;
+            unshuffle(dst + out_pos, shuffled, raw_size, elem_size);
+        }
+        else if (lz4_decompress_block(model + pos, stored_size, dst + out_pos, raw_size) != raw_size)
+            goto unmap;
+
+        pos += stored_size;
+        out_pos += raw_size;
+    }
+
+    memcpy(dst, model, info->data_offset);
+    uint64_t file_size = raw_file_size;
+    memcpy(dst + MF_SIZE_OFF, &file_size, sizeof(file_size));
+    mf_remove_flags(MF_FLAG_COMPRESSED, dst);
+
+    *out = dst;
+    *out_size = raw_file_size;
+    return 0;
+
+unmap:
+    munmap(dst, raw_file_size);
+malformed:
+    debug_print("Malformed compressed model\n");
+    errno = EINVAL;
+    return -1;
+}
@@ -0,0 +1,51 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "globals.h"
+
+// Compressed model files (MF_FLAG_COMPRESSED): the header is the one of the raw model (file_size is
+// the compressed one), the data section is a sequence of independent chunks of at most MF_CHUNK_SIZE
+// raw bytes, so they can be produced and consumed while streaming:
+//   u32 raw_size | u32 stored_size | u8 mode | stored_size bytes
+// mode & 0x0f is the codec (MF_CHUNK_STORED or MF_CHUNK_LZ4, an LZ4 block), mode >> 4 the element size
+// the chunk has been byte shuffled with before compressing it (0: not shuffled). Integers are little endian
+// like the rest of the header.
+
+#define MF_CHUNK_SIZE (64 * 1024)
+#define MF_CHUNK_HEADER_SIZE (2 * sizeof(uint32_t) + sizeof(uint8_t))
+
+#define MF_CHUNK_STORED 0
+#define MF_CHUNK_LZ4 1
+
+#define mf_chunk_codec(mode) ((mode) & 0x0f)
+#define mf_chunk_shuffle(mode) ((mode) >> 4)
+
+// Compressed copy of a raw model file (malloc'd).
+int mf_compress_model(const char *model, size_t size, model_file_info_t *info, char **out, size_t *out_size);
+
+// Raw copy of a compressed model file in anonymous memory (release it with unmap_file),
+// -1 if any chunk is malformed.
+int mf_decompress_model(const char *model, size_t size, model_file_info_t *info, char **out, size_t *out_size);
+
+// Replaces a compressed mapped model with its raw copy, unmap_model releases it as before.
+// Raw models are left untouched.
+static inline int mf_inflate_mapped_model(mapped_model_t *model)
+{
+    if (!mfi_is_compressed(model->info))
+        return 0;
+
+    char *data = NULL;
+    size_t size = 0;
+    if (mf_decompress_model(model->data, model->size, &model->info, &data, &size) < 0)
+        return -1;
+
+    unmap_model(model);
+    model->data = data;
+    model->size = size;
+    return extract_file_info(&model->info, data, size);
+}
+
+#endif // COMPRESSION_H
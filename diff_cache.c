@@ -0,0 +1,456 @@
+#include "diff_cache.h"
+#include "kernels.h"
+#include "global_model.h"
+#include "compression.h"
+#include "tensor.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void *diff_cache_thread(void *arg);
+
+int diff_cache_init(diff_cache_t *cache, size_t max_bytes, size_t n_threads)
+{
+    if (pthread_mutex_init(&cache->lock, NULL) != 0)
+        return -1;
+
+    if (pthread_cond_init(&cache->work, NULL) != 0)
+    {
+        pthread_mutex_destroy(&cache->lock);
+        return -1;
+    }
+
+    cache->max_bytes = max_bytes;
+    cache->bytes = 0;
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->pending_head = NULL;
+    cache->pending_tail = NULL;
+    cache->stop = 0;
+    cache->n_threads = 0;
+    cache->threads = (pthread_t *)malloc(sizeof(pthread_t) * n_threads);
+    if (cache->threads == NULL)
+    {
+        perror("Failed to allocate memory for diff cache threads");
+        diff_cache_destroy(cache);
+        return -1;
+    }
+
+    for (size_t i = 0; i < n_threads; i++)
+    {
+        if (pthread_create(&cache->threads[i], NULL, diff_cache_thread, cache) != 0)
+        {
+            perror("Failed to create diff cache thread");
+            diff_cache_destroy(cache);
+            return -1;
+        }
+
+        cache->n_threads++;
+    }
+
+    return 0;
+}
+
+static void free_entry(diff_cache_entry_t *entry)
+{
+    if (entry->diff != NULL)
+        shared_buffer_release(entry->diff);
+    free(entry);
+}
+
+// called without the cache lock, each waiter already holds its own reference to diff (if any)
+static void notify_waiters(diff_cache_waiter_t *waiter, shared_buffer_t *diff)
+{
+    while (waiter != NULL)
+    {
+        diff_cache_waiter_t *next = waiter->next;
+        waiter->done(waiter->arg, diff);
+        free(waiter);
+        waiter = next;
+    }
+}
+
+void diff_cache_stop(diff_cache_t *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->stop = 1;
+    pthread_cond_broadcast(&cache->work);
+    pthread_mutex_unlock(&cache->lock);
+
+    for (size_t i = 0; i < cache->n_threads; i++)
+        pthread_join(cache->threads[i], NULL);
+    cache->n_threads = 0;
+
+    // no thread is left to compute them, pending entries are still linked in the LRU list
+    diff_cache_entry_t *entry = cache->pending_head;
+    while (entry != NULL)
+    {
+        diff_cache_entry_t *next = entry->pending_next;
+        notify_waiters(entry->waiters, NULL);
+        entry->waiters = NULL;
+        entry->state = DIFF_ENTRY_FAILED;
+        entry = next;
+    }
+
+    cache->pending_head = NULL;
+    cache->pending_tail = NULL;
+}
+
+void diff_cache_destroy(diff_cache_t *cache)
+{
+    if (cache->threads != NULL)
+        diff_cache_stop(cache);
+
+    free(cache->threads);
+    cache->threads = NULL;
+
+    diff_cache_entry_t *entry = cache->head;
+    while (entry != NULL)
+    {
+        diff_cache_entry_t *next = entry->next;
+        free_entry(entry);
+        entry = next;
+    }
+
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->bytes = 0;
+    pthread_cond_destroy(&cache->work);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+// ALL THE FOLLOWING list_* FUNCTIONS MUST BE CALLED WITH THE CACHE LOCK HELD
+
+static void list_unlink(diff_cache_t *cache, diff_cache_entry_t *entry)
+{
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void list_push_front(diff_cache_t *cache, diff_cache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL)
+        cache->head->prev = entry;
+    cache->head = entry;
+
+    if (cache->tail == NULL)
+        cache->tail = entry;
+}
+
+static void pending_push(diff_cache_t *cache, diff_cache_entry_t *entry)
+{
+    entry->pending_next = NULL;
+    if (cache->pending_tail != NULL)
+        cache->pending_tail->pending_next = entry;
+    else
+        cache->pending_head = entry;
+    cache->pending_tail = entry;
+}
+
+static diff_cache_entry_t *pending_pop(diff_cache_t *cache)
+{
+    diff_cache_entry_t *entry = cache->pending_head;
+    cache->pending_head = entry->pending_next;
+    if (cache->pending_head == NULL)
+        cache->pending_tail = NULL;
+
+    entry->pending_next = NULL;
+    return entry;
+}
+
+static diff_cache_entry_t *list_find(diff_cache_t *cache, uint64_t from, uint64_t to, uint8_t compressed)
+{
+    for (diff_cache_entry_t *entry = cache->head; entry != NULL; entry = entry->next)
+    {
+        if (entry->from == from && entry->to == to && entry->compressed == compressed)
+            return entry;
+    }
+
+    return NULL;
+}
+
+// evicts the least recently used diffs until the cache fits in max_bytes,
+// the ones still being sent are freed by their last shared_buffer_release
+static void list_evict(diff_cache_t *cache)
+{
+    diff_cache_entry_t *entry = cache->tail;
+    while (entry != NULL && cache->bytes > cache->max_bytes)
+    {
+        diff_cache_entry_t *prev = entry->prev;
+        if (entry->state == DIFF_ENTRY_READY)
+        {
+            list_unlink(cache, entry);
+            cache->bytes -= entry->diff->size;
+            free_entry(entry);
+        }
+        entry = prev;
+    }
+}
+
+// the cache threads are not global model readers, they take a reference to the model (resident or loaded)
+static int acquire_model(uint64_t id, mapped_model_t *model, shared_buffer_t **file)
+{
+    global_model_version_t version = {0};
+    if (global_model_acquire(id, &version) < 0)
+    {
+        debug_print("Model %lu not available\n", id);
+        return -1;
+    }
+
+    model->data = (char *)version.file->data;
+    model->size = version.file->size;
+    model->info = version.info;
+    *file = version.file;
+    return 0;
+}
+
+static int compute_diff(uint64_t from, uint64_t to, char **data, size_t *size)
+{
+    set_debug(1);
+
+    int ret_code = -1;
+    mapped_model_t from_model = {0};
+    mapped_model_t to_model = {0};
+    shared_buffer_t *from_file = NULL;
+    shared_buffer_t *to_file = NULL;
+    mf_layout_t layout = {0};
+    mf_layout_t from_layout = {0};
+
+    if (acquire_model(from, &from_model, &from_file) < 0 || acquire_model(to, &to_model, &to_file) < 0)
+        goto release;
+
+    if (mf_layout_init(&layout, &to_model.info, to_model.data) < 0 ||
+        mf_layout_init(&from_layout, &from_model.info, from_model.data) < 0 ||
+        !mf_layout_same_shapes(&layout, &from_layout) ||
+        layout.data_size != to_model.info.data_size ||
+        from_layout.data_size != from_model.info.data_size)
+    {
+        debug_print("Model data layout mismatch (%lu, %lu)\n", from, to);
+        goto release;
+    }
+
+    for (size_t t = 0; t < layout.n_tensors; t++)
+    {
+        if (layout.tensors[t].type != from_layout.tensors[t].type || !mf_kernel_supported_type(layout.tensors[t].type))
+        {
+            debug_print("Model data layout mismatch (%lu, %lu)\n", from, to);
+            goto release;
+        }
+    }
+
+    char *diff = (char *)malloc(to_model.size);
+    if (diff == NULL)
+    {
+        perror("Failed to allocate memory for diff model");
+        goto release;
+    }
+
+    // the diff has the layout of to, the models can have different versions (and padding)
+    memcpy(diff, to_model.data, to_model.info.data_offset);
+    size_t end = 0;
+    for (size_t t = 0; t < layout.n_tensors; t++)
+    {
+        const mf_tensor_t *tensor = &layout.tensors[t];
+        memset(mfi_get_data_ptr(to_model.info, diff) + end, 0, tensor->offset - end);
+        mf_kernel_sub(tensor->type,
+                      mfi_get_data_ptr(to_model.info, diff) + tensor->offset,
+                      mfi_get_data_ptr(to_model.info, to_model.data) + tensor->offset,
+                      mfi_get_data_ptr(from_model.info, from_model.data) + from_layout.tensors[t].offset,
+                      tensor->n_elems);
+        end = tensor->offset + tensor->size;
+    }
+
+    // set file format to diff
+    mf_add_flags(MF_FLAG_DIFF_FORMAT, diff);
+    mfi_set_diffed_from_version(to_model.info, from, diff);
+
+    *data = diff;
+    *size = to_model.size;
+    ret_code = 0;
+
+release:
+    mf_layout_destroy(&layout);
+    mf_layout_destroy(&from_layout);
+    if (from_file != NULL)
+        shared_buffer_release(from_file);
+    if (to_file != NULL)
+        shared_buffer_release(to_file);
+    return ret_code;
+}
+
+static int compress_model(uint64_t id, char **data, size_t *size)
+{
+    mapped_model_t model = {0};
+    shared_buffer_t *file = NULL;
+    if (acquire_model(id, &model, &file) < 0)
+        return -1;
+
+    int res = mf_compress_model(model.data, model.size, &model.info, data, size);
+    shared_buffer_release(file);
+    return res;
+}
+
+static int compute_entry(uint64_t from, uint64_t to, uint8_t compressed, char **data, size_t *size)
+{
+    if (from == DIFF_CACHE_FULL_MODEL)
+        return compress_model(to, data, size);
+
+    if (compute_diff(from, to, data, size) < 0)
+        return -1;
+
+    if (!compressed)
+        return 0;
+
+    char *diff = *data;
+    model_file_info_t info = {0};
+    int res = extract_file_info(&info, diff, *size);
+    if (res == 0)
+        res = mf_compress_model(diff, *size, &info, data, size);
+    free(diff);
+    return res;
+}
+
+shared_buffer_t *diff_cache_find(diff_cache_t *cache, uint64_t from, uint64_t to, uint8_t compressed)
+{
+    shared_buffer_t *diff = NULL;
+    pthread_mutex_lock(&cache->lock);
+
+    diff_cache_entry_t *entry = list_find(cache, from, to, compressed);
+    if (entry != NULL && entry->state == DIFF_ENTRY_READY)
+    {
+        list_unlink(cache, entry);
+        list_push_front(cache, entry);
+        diff = shared_buffer_acquire(entry->diff);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return diff;
+}
+
+int diff_cache_request(diff_cache_t *cache, uint64_t from, uint64_t to, uint8_t compressed, diff_cache_done_t done, void *arg)
+{
+    diff_cache_waiter_t *waiter = (diff_cache_waiter_t *)malloc(sizeof(diff_cache_waiter_t));
+    if (waiter == NULL)
+    {
+        perror("Failed to allocate memory for diff cache waiter");
+        return -1;
+    }
+
+    waiter->done = done;
+    waiter->arg = arg;
+    pthread_mutex_lock(&cache->lock);
+    if (cache->stop)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        free(waiter);
+        return -1;
+    }
+
+    // FAILED entries are unlinked right away, a linked entry is READY or COMPUTING
+    diff_cache_entry_t *entry = list_find(cache, from, to, compressed);
+    if (entry != NULL)
+    {
+        list_unlink(cache, entry);
+        list_push_front(cache, entry);
+        if (entry->state == DIFF_ENTRY_READY)
+        {
+            shared_buffer_t *diff = shared_buffer_acquire(entry->diff);
+            pthread_mutex_unlock(&cache->lock);
+            free(waiter);
+            done(arg, diff);
+            return 0;
+        }
+    }
+    else
+    {
+        entry = (diff_cache_entry_t *)calloc(1, sizeof(diff_cache_entry_t));
+        if (entry == NULL)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            free(waiter);
+            perror("Failed to allocate memory for diff cache entry");
+            return -1;
+        }
+
+        entry->from = from;
+        entry->to = to;
+        entry->compressed = compressed;
+        entry->state = DIFF_ENTRY_COMPUTING;
+        list_push_front(cache, entry);
+        pending_push(cache, entry);
+        pthread_cond_signal(&cache->work);
+    }
+
+    // coalesce onto the computation in flight
+    waiter->next = entry->waiters;
+    entry->waiters = waiter;
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+static void *diff_cache_thread(void *arg)
+{
+    diff_cache_t *cache = (diff_cache_t *)arg;
+    pthread_mutex_lock(&cache->lock);
+    while (1)
+    {
+        while (!cache->stop && cache->pending_head == NULL)
+            pthread_cond_wait(&cache->work, &cache->lock);
+
+        if (cache->stop)
+            break;
+
+        diff_cache_entry_t *entry = pending_pop(cache);
+        pthread_mutex_unlock(&cache->lock);
+
+        char *data = NULL;
+        size_t size = 0;
+        shared_buffer_t *diff = NULL;
+        if (compute_entry(entry->from, entry->to, entry->compressed, &data, &size) == 0)
+        {
+            diff = shared_buffer_wrap(data, size, NULL);
+            if (diff == NULL)
+                free(data);
+        }
+
+        pthread_mutex_lock(&cache->lock);
+        diff_cache_waiter_t *waiters = entry->waiters;
+        entry->waiters = NULL;
+        if (diff == NULL)
+        {
+            entry->state = DIFF_ENTRY_FAILED;
+            list_unlink(cache, entry);
+            free_entry(entry);
+        }
+        else
+        {
+            entry->diff = diff;
+            entry->state = DIFF_ENTRY_READY;
+            cache->bytes += size;
+
+            // a reference for each waiter, the entry can be evicted as soon as the lock is released
+            for (diff_cache_waiter_t *waiter = waiters; waiter != NULL; waiter = waiter->next)
+                shared_buffer_acquire(diff);
+            list_evict(cache);
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+        notify_waiters(waiters, diff);
+        pthread_mutex_lock(&cache->lock);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
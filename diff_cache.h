@@ -0,0 +1,80 @@
+#ifndef DIFF_CACHE_H
+#define DIFF_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "globals.h"
+#include "shared_buffer.h"
+
+#define DIFF_ENTRY_COMPUTING 0
+#define DIFF_ENTRY_READY 1
+#define DIFF_ENTRY_FAILED 2
+
+// from of the compressed copies of the whole model <to> (the raw ones are served from memory or from their file)
+#define DIFF_CACHE_FULL_MODEL UINT64_MAX
+
+// Called once per request with a new reference to the diff (NULL on failure, e.g. a missing model)
+typedef void (*diff_cache_done_t)(void *arg, shared_buffer_t *diff);
+
+typedef struct diff_cache_waiter
+{
+    diff_cache_done_t done;
+    void *arg;
+    struct diff_cache_waiter *next;
+} diff_cache_waiter_t;
+
+// A diff model file (model <to> - model <from>, in diff format) ready to be sent as is,
+// raw or compressed (see compression.h)
+typedef struct diff_cache_entry
+{
+    uint64_t from;
+    uint64_t to;
+    uint8_t compressed;
+    uint8_t state;
+    diff_cache_waiter_t *waiters; // requests waiting for the COMPUTING entry, protected by the cache lock
+
+    shared_buffer_t *diff; // the cache holds one reference, READY entries only
+
+    struct diff_cache_entry *prev;
+    struct diff_cache_entry *next;
+    struct diff_cache_entry *pending_next; // COMPUTING entries not picked up by a cache thread yet
+} diff_cache_entry_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    size_t max_bytes;
+    size_t bytes;
+
+    // LRU list, most recently used first
+    diff_cache_entry_t *head;
+    diff_cache_entry_t *tail;
+
+    // computed in order by the cache threads, off the event loops
+    diff_cache_entry_t *pending_head;
+    diff_cache_entry_t *pending_tail;
+    uint8_t stop;
+    size_t n_threads;
+    pthread_t *threads;
+} diff_cache_t;
+
+extern diff_cache_t diff_cache;
+
+int diff_cache_init(diff_cache_t *cache, size_t max_bytes, size_t n_threads);
+// Joins the cache threads, the requests not computed yet fail. Called before the servers that wait for them are freed.
+void diff_cache_stop(diff_cache_t *cache);
+void diff_cache_destroy(diff_cache_t *cache);
+
+// Returns a new reference to the diff model of (from, to), compressed if asked, NULL if it is not READY.
+shared_buffer_t *diff_cache_find(diff_cache_t *cache, uint64_t from, uint64_t to, uint8_t compressed);
+
+// done(arg, diff) is called once the diff model of (from, to) has been computed by a cache thread,
+// concurrent requests for the same pair share the computation. If the diff is already READY
+// done is called right away by the caller thread. Returns -1 if the request could not be queued (done is not called).
+// Evicted diffs stay alive until the last reference (e.g. a queued send) is released.
+int diff_cache_request(diff_cache_t *cache, uint64_t from, uint64_t to, uint8_t compressed, diff_cache_done_t done, void *arg);
+
+#endif // DIFF_CACHE_H
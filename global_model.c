@@ -0,0 +1,211 @@
+#include "global_model.h"
+#include "fs.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+_Atomic(global_model_t *) global_model = NULL;
+
+typedef struct
+{
+    _Alignas(64) atomic_uint_fast64_t epoch; // last epoch seen in a quiescent state, 0: unused slot
+} global_model_reader_t;
+
+static global_model_reader_t readers[GLOBAL_MODEL_MAX_READERS];
+static atomic_int n_readers = 0;
+static atomic_uint_fast64_t global_epoch = 1;
+static _Thread_local global_model_reader_t *thread_reader = NULL;
+
+// replaced models not yet freed, writer only
+static global_model_t *retired = NULL;
+
+static void unmap_model_file(void *data, size_t size)
+{
+    unmap_file((char *)data, size);
+}
+
+static int share_version(uint64_t id, shared_buffer_t *file, global_model_version_t *version)
+{
+    if (extract_file_info(&version->info, file->data, file->size) < 0 ||
+        version->info.file_size != file->size ||
+        version->info.data_offset > file->size)
+    {
+        perror("Malformed global model");
+        return -1;
+    }
+
+    version->file = shared_buffer_acquire(file);
+    version->id = id;
+    return 0;
+}
+
+static int load_version(uint64_t id, global_model_version_t *version)
+{
+    int fd = open_model(id);
+    if (fd == -1)
+    {
+        perror("Failed to open global model file");
+        return -1;
+    }
+
+    char *data = NULL;
+    size_t size = 0;
+    int res = load_file_resident(fd, &data, &size);
+    close(fd);
+    if (res < 0)
+        return -1;
+
+    if (extract_file_info(&version->info, data, size) < 0 ||
+        version->info.file_size != size ||
+        version->info.data_offset > size)
+    {
+        perror("Malformed global model file");
+        unmap_file(data, size);
+        return -1;
+    }
+
+    version->file = shared_buffer_wrap(data, size, unmap_model_file);
+    if (version->file == NULL)
+    {
+        perror("Failed to allocate global model buffer");
+        unmap_file(data, size);
+        return -1;
+    }
+
+    version->id = id;
+    return 0;
+}
+
+// the new model keeps the newest versions of prev, the older ones are evicted with prev
+static global_model_t *new_global_model(uint64_t id, shared_buffer_t *file, global_model_t *prev)
+{
+    global_model_t *model = (global_model_t *)calloc(1, sizeof(global_model_t));
+    if (model == NULL)
+    {
+        perror("Failed to allocate global model");
+        return NULL;
+    }
+
+    if ((file != NULL ? share_version(id, file, &model->versions[0]) : load_version(id, &model->versions[0])) < 0)
+    {
+        free(model);
+        return NULL;
+    }
+
+    model->id = id;
+    model->n_versions = 1;
+    for (size_t i = 0; prev != NULL && i < prev->n_versions && model->n_versions < GLOBAL_MODEL_VERSIONS; i++)
+    {
+        global_model_version_t *version = &model->versions[model->n_versions++];
+        *version = prev->versions[i];
+        shared_buffer_acquire(version->file);
+    }
+
+    return model;
+}
+
+static void free_global_model(global_model_t *model)
+{
+    for (size_t i = 0; i < model->n_versions; i++)
+        shared_buffer_release(model->versions[i].file);
+    free(model);
+}
+
+// frees the retired models no reader can still see
+static void reclaim(void)
+{
+    uint64_t min_epoch = UINT64_MAX;
+    int n = atomic_load(&n_readers);
+    for (int i = 0; i < n && i < GLOBAL_MODEL_MAX_READERS; i++)
+    {
+        uint64_t epoch = atomic_load(&readers[i].epoch);
+        if (epoch != 0 && epoch < min_epoch)
+            min_epoch = epoch;
+    }
+
+    global_model_t **link = &retired;
+    while (*link != NULL)
+    {
+        global_model_t *model = *link;
+        if (model->retired_epoch <= min_epoch)
+        {
+            *link = model->retired_next;
+            free_global_model(model);
+        }
+        else
+        {
+            link = &model->retired_next;
+        }
+    }
+}
+
+int global_model_publish(uint64_t id, shared_buffer_t *file)
+{
+    global_model_t *model = new_global_model(id, file, global_model_get());
+    if (model == NULL)
+    {
+        fprintf(stderr, "Global model %lu is served from its file\n", id);
+        atomic_store(&current_global_model, id);
+        return -1;
+    }
+
+    // the model first, a reader seeing the new id can find it
+    global_model_t *old = atomic_exchange(&global_model, model);
+    atomic_store(&current_global_model, id);
+
+    if (old != NULL)
+    {
+        // readers that pass a quiescent state from now on can not hold old anymore
+        old->retired_epoch = atomic_fetch_add(&global_epoch, 1) + 1;
+        old->retired_next = retired;
+        retired = old;
+    }
+
+    reclaim();
+    return 0;
+}
+
+void global_model_destroy(void)
+{
+    global_model_t *model = atomic_exchange(&global_model, NULL);
+    if (model != NULL)
+        free_global_model(model);
+
+    while (retired != NULL)
+    {
+        global_model_t *next = retired->retired_next;
+        free_global_model(retired);
+        retired = next;
+    }
+}
+
+void global_model_quiescent(void)
+{
+    if (thread_reader == NULL)
+    {
+        int slot = atomic_fetch_add(&n_readers, 1);
+        assert(slot < GLOBAL_MODEL_MAX_READERS);
+        thread_reader = &readers[slot];
+    }
+
+    atomic_store(&thread_reader->epoch, atomic_load(&global_epoch));
+}
+
+int global_model_acquire(uint64_t id, global_model_version_t *version)
+{
+    global_model_quiescent();
+    global_model_version_t *resident = global_model_find(global_model_get(), id);
+    if (resident != NULL)
+    {
+        *version = *resident;
+        shared_buffer_acquire(version->file);
+    }
+
+    // the thread holds no model until its next quiescent state, it does not delay the reclaim
+    atomic_store(&thread_reader->epoch, 0);
+
+    if (resident != NULL)
+        return 0;
+
+    return load_version(id, version);
+}
@@ -0,0 +1,78 @@
+#ifndef GLOBAL_MODEL_H
+#define GLOBAL_MODEL_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "globals.h"
+#include "shared_buffer.h"
+
+#define GLOBAL_MODEL_MAX_READERS 256
+
+// A global model resident in memory
+typedef struct
+{
+    uint64_t id;
+    model_file_info_t info;
+    shared_buffer_t *file; // the whole model file, the header is its first info.data_offset bytes
+} global_model_version_t;
+
+// The published global model, immutable once published.
+// Readers get it with a plain atomic load (global_model_get) and can use it until their next
+// global_model_quiescent() call; to keep the data longer (e.g. a queued send) they acquire
+// a reference to a version file. Replaced models are freed once every registered reader has
+// gone through a quiescent state (quiescent state based RCU).
+typedef struct global_model
+{
+    uint64_t id;
+    // the last GLOBAL_MODEL_VERSIONS published models, newest first (versions[0].id == id)
+    size_t n_versions;
+    global_model_version_t versions[GLOBAL_MODEL_VERSIONS];
+
+    // writer only
+    uint64_t retired_epoch;
+    struct global_model *retired_next;
+} global_model_t;
+
+extern _Atomic(global_model_t *) global_model;
+
+// Publishes model <id> with the previous GLOBAL_MODEL_VERSIONS - 1, it also updates global_model_id.
+// file is the model already in memory (a new reference is taken), if NULL the model file is loaded.
+// MUST be called by a single thread at a time (the aggregator, or main before the workers start).
+// If the model can not be loaded the id is published anyway and global_model keeps the previous ones.
+int global_model_publish(uint64_t id, shared_buffer_t *file);
+
+// Frees every model, no reader can be active
+void global_model_destroy(void);
+
+// Called by every reader thread between requests (e.g. once per event loop iteration):
+// the models read before this call can not be used after it. The first call registers the thread.
+void global_model_quiescent(void);
+
+// For threads that are not readers (e.g. the aggregator): a reference to model <id>, the resident version
+// if any, otherwise loaded from its file. Release it with shared_buffer_release(version->file).
+// It goes through a quiescent state, so it MUST NOT be called while reading a model from global_model_get.
+int global_model_acquire(uint64_t id, global_model_version_t *version);
+
+// NULL before the first publish, the model can be older than global_model_id (see global_model_publish)
+static inline global_model_t *global_model_get(void)
+{
+    return atomic_load_explicit(&global_model, memory_order_acquire);
+}
+
+// NULL if version id is not resident
+static inline global_model_version_t *global_model_find(global_model_t *model, uint64_t id)
+{
+    if (model == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < model->n_versions; i++)
+    {
+        if (model->versions[i].id == id)
+            return &model->versions[i];
+    }
+
+    return NULL;
+}
+
+#endif // GLOBAL_MODEL_H
@@ -8,18 +8,26 @@
 #include <stddef.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "socket_server.h"
 #include "buffer.h"
 #include "queue.h"
+#include "mpsc_ring.h"
 #include "debug.h"
 #include "model.h"
+#include "metadata.h"
 #include "fs.h"
 
 #define PORT 8080
 #define SERVER_EVENT_LOOP_TIMEOUT 1000
 #define MAX_MESSAGE_SIZE 1024 * 10
 #define MAX_PENDING_MODEL_UPDATES 100
+#define MODEL_QUEUE_CAPACITY 1024 // power of two, the workers block once it is full
+#define MODEL_QUEUE_BATCH 64      // updates drained by the aggregator at once
+#define DIFF_CACHE_MAX_BYTES (1024UL * 1024 * 1024) // diffs served to lagging clients kept in memory
+#define DIFF_CACHE_THREADS 2 // compute the diffs off the event loops
+#define GLOBAL_MODEL_VERSIONS 4 // global models kept in memory: the latest and the ones clients can still diff from
 
 #define MODEL_FOLDER "./data/"
 #define UPDATE_FOLDER "./data/updates/"
@@ -28,15 +36,22 @@
 typedef struct
 {
     char file_name[255];
+    // from the header validated by SEND_WEIGHT, the aggregator checks them without reading the file
+    uint8_t flags;
+    uint64_t diffed_from;
+    double weight;          // dataset_size, 0 if missing
+    mf_meta_index_t *meta; // owned, the aggregator never parses the metadata of the file
 } model_upd_t;
 
-declare_queue_type(model_upd_t *, model_upd);
+declare_mpsc_ring_type(model_upd_t *, model_upd);
 
 extern model_file_info_t global_model_info;
-extern model_upd_queue_t model_queue;
+extern model_upd_ring_t model_queue;
 
-extern uint64_t current_global_model;
-extern pthread_mutex_t global_model_lock;
+// published by global_model_publish (see global_model.h)
+extern atomic_uint_fast64_t current_global_model;
+
+extern uint8_t update_direct_io; // write update files with O_DIRECT, bypassing the page cache
 
 static inline int open_model(uint64_t id)
 {
@@ -57,28 +72,53 @@ static inline int open_model_w(uint64_t id)
     assert(n > 0);
     path[n] = '\0';
 
-    return open(path, O_WRONLY | O_CREAT, 0644);
+    return open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+}
+
+typedef struct
+{
+    char *data;
+    size_t size;
+    model_file_info_t info;
+} mapped_model_t;
+
+static inline int map_model(int fd, mapped_model_t *model)
+{
+    if (map_file_fd(fd, &model->data, &model->size) < 0)
+        return -1;
+
+    if (extract_file_info(&model->info, model->data, model->size) < 0 ||
+        model->info.file_size != model->size ||
+        model->info.data_offset > model->size)
+    {
+        perror("Malformed model file");
+        unmap_file(model->data, model->size);
+        model->data = NULL;
+        return -1;
+    }
+
+    return 0;
 }
 
-#define set_global_model_id(id)             \
-    pthread_mutex_lock(&global_model_lock); \
-    current_global_model = id;              \
-    pthread_mutex_unlock(&global_model_lock);
+static inline void unmap_model(mapped_model_t *model)
+{
+    if (model->data == NULL)
+        return;
+
+    unmap_file(model->data, model->size);
+    model->data = NULL;
+    model->size = 0;
+}
 
-#define global_model_id ({                    \
-    uint64_t id;                              \
-    pthread_mutex_lock(&global_model_lock);   \
-    id = current_global_model;                \
-    pthread_mutex_unlock(&global_model_lock); \
-    id;                                       \
-})
+// wait-free, it never goes back
+#define global_model_id ((uint64_t)atomic_load_explicit(&current_global_model, memory_order_acquire))
 
 #ifdef DECLARE_GLOBALS
-define_queue_methods(model_upd_t *, model_upd);
+define_mpsc_ring_methods(model_upd_t *, model_upd);
 model_file_info_t global_model_info = {0};
-model_upd_queue_t model_queue;
-uint64_t current_global_model = 0;
-pthread_mutex_t global_model_lock = PTHREAD_MUTEX_INITIALIZER;
+model_upd_ring_t model_queue;
+atomic_uint_fast64_t current_global_model = 0;
+uint8_t update_direct_io = 0;
 #endif
 
 // Session Types
@@ -97,6 +137,10 @@ typedef struct
     uint64_t written;
     uint64_t stream_size;
     uint8_t done;
+    uint8_t flags;
+    uint64_t diffed_from;
+    double weight;
+    mf_meta_index_t *meta; // owned until the update is queued
 } client_update_t;
 
 typedef struct
@@ -0,0 +1,1435 @@
+#include "kernels.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*wsum_f32_fn)(float *out, const float *base, const float *const *in, const double *w, size_t n, size_t count);
+typedef void (*wsum_f64_fn)(double *out, const double *base, const double *const *in, const double *w, size_t n, size_t count);
+typedef void (*wsum_f16_fn)(uint16_t *out, const uint16_t *base, const uint16_t *const *in, const double *w, size_t n, size_t count);
+
+typedef void (*sub_f32_fn)(float *dst, const float *a, const float *b, size_t count);
+typedef void (*sub_f64_fn)(double *dst, const double *a, const double *b, size_t count);
+typedef void (*sub_f16_fn)(uint16_t *dst, const uint16_t *a, const uint16_t *b, size_t count);
+
+typedef void (*scale_f32_fn)(float *dst, double s, size_t count);
+typedef void (*scale_f64_fn)(double *dst, double s, size_t count);
+typedef void (*scale_f16_fn)(uint16_t *dst, double s, size_t count);
+
+typedef void (*rolling_f32_fn)(double *acc, const float *x, double alpha, size_t count);
+typedef void (*rolling_f64_fn)(double *acc, const double *x, double alpha, size_t count);
+typedef void (*rolling_f16_fn)(double *acc, const uint16_t *x, double alpha, size_t count);
+
+typedef void (*add_acc_f32_fn)(float *out, const float *base, const double *acc, double s, size_t count);
+typedef void (*add_acc_f64_fn)(double *out, const double *base, const double *acc, double s, size_t count);
+typedef void (*add_acc_f16_fn)(uint16_t *out, const uint16_t *base, const double *acc, double s, size_t count);
+
+typedef void (*wsum_mixed_fn)(uint8_t type, void *out, const void *base, const mf_input_t *in, size_t n, double bias, size_t count);
+typedef void (*rolling_q_fn)(uint8_t x_type, double *acc, const void *x, double scale, double zero, double alpha, size_t count);
+
+typedef struct
+{
+    int isa;
+    wsum_f32_fn wsum_f32;
+    wsum_f64_fn wsum_f64;
+    wsum_f16_fn wsum_f16;
+    sub_f32_fn sub_f32;
+    sub_f64_fn sub_f64;
+    sub_f16_fn sub_f16;
+    scale_f32_fn scale_f32;
+    scale_f64_fn scale_f64;
+    scale_f16_fn scale_f16;
+    rolling_f32_fn rolling_f32;
+    rolling_f64_fn rolling_f64;
+    rolling_f16_fn rolling_f16;
+    add_acc_f32_fn add_acc_f32;
+    add_acc_f64_fn add_acc_f64;
+    add_acc_f16_fn add_acc_f16;
+    wsum_mixed_fn wsum_mixed;
+    rolling_q_fn rolling_q;
+} kernel_table_t;
+
+// ---------------------------------------------------------------------------
+// Scalar
+// ---------------------------------------------------------------------------
+
+// one element of any input type, the vector kernels use it for their last partial block
+static inline double load_elem(uint8_t type, const void *data, size_t i)
+{
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        return ((const float *)data)[i];
+    case MF_TFLOAT64:
+        return ((const double *)data)[i];
+    case MF_TINT8:
+        return ((const int8_t *)data)[i];
+    default:
+        return mf_f16_to_f32(((const uint16_t *)data)[i]);
+    }
+}
+
+static inline void store_elem(uint8_t type, void *data, size_t i, double value)
+{
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        ((float *)data)[i] = (float)value;
+        break;
+    case MF_TFLOAT64:
+        ((double *)data)[i] = value;
+        break;
+    default:
+        ((uint16_t *)data)[i] = mf_f32_to_f16((float)value);
+    }
+}
+
+// The *_tail functions start from element i, so that the vector kernels can finish their last partial block
+static void wsum_f32_tail(float *out, const float *base, const float *const *in, const double *w, size_t n, size_t i, size_t count)
+{
+    for (; i < count; i++)
+    {
+        double acc = base[i];
+        for (size_t j = 0; j < n; j++)
+            acc += w[j] * in[j][i];
+        out[i] = (float)acc;
+    }
+}
+
+static void wsum_f32_scalar(float *out, const float *base, const float *const *in, const double *w, size_t n, size_t count)
+{
+    wsum_f32_tail(out, base, in, w, n, 0, count);
+}
+
+static void wsum_f64_tail(double *out, const double *base, const double *const *in, const double *w, size_t n, size_t i, size_t count)
+{
+    for (; i < count; i++)
+    {
+        double acc = base[i];
+        for (size_t j = 0; j < n; j++)
+            acc += w[j] * in[j][i];
+        out[i] = acc;
+    }
+}
+
+static void wsum_f64_scalar(double *out, const double *base, const double *const *in, const double *w, size_t n, size_t count)
+{
+    wsum_f64_tail(out, base, in, w, n, 0, count);
+}
+
+static void wsum_f16_tail(uint16_t *out, const uint16_t *base, const uint16_t *const *in, const double *w, size_t n, size_t i, size_t count)
+{
+    for (; i < count; i++)
+    {
+        double acc = mf_f16_to_f32(base[i]);
+        for (size_t j = 0; j < n; j++)
+            acc += w[j] * mf_f16_to_f32(in[j][i]);
+        out[i] = mf_f32_to_f16((float)acc);
+    }
+}
+
+static void wsum_f16_scalar(uint16_t *out, const uint16_t *base, const uint16_t *const *in, const double *w, size_t n, size_t count)
+{
+    wsum_f16_tail(out, base, in, w, n, 0, count);
+}
+
+static void sub_f32_scalar(float *dst, const float *a, const float *b, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        dst[i] = a[i] - b[i];
+}
+
+static void sub_f64_scalar(double *dst, const double *a, const double *b, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        dst[i] = a[i] - b[i];
+}
+
+static void sub_f16_scalar(uint16_t *dst, const uint16_t *a, const uint16_t *b, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        dst[i] = mf_f32_to_f16(mf_f16_to_f32(a[i]) - mf_f16_to_f32(b[i]));
+}
+
+static void scale_f32_scalar(float *dst, double s, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        dst[i] = (float)(dst[i] * s);
+}
+
+static void scale_f64_scalar(double *dst, double s, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        dst[i] *= s;
+}
+
+static void scale_f16_scalar(uint16_t *dst, double s, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        dst[i] = mf_f32_to_f16((float)(mf_f16_to_f32(dst[i]) * s));
+}
+
+static void rolling_f32_tail(double *acc, const float *x, double alpha, size_t i, size_t count)
+{
+    for (; i < count; i++)
+        acc[i] += alpha * (x[i] - acc[i]);
+}
+
+static void rolling_f32_scalar(double *acc, const float *x, double alpha, size_t count)
+{
+    rolling_f32_tail(acc, x, alpha, 0, count);
+}
+
+static void rolling_f64_tail(double *acc, const double *x, double alpha, size_t i, size_t count)
+{
+    for (; i < count; i++)
+        acc[i] += alpha * (x[i] - acc[i]);
+}
+
+static void rolling_f64_scalar(double *acc, const double *x, double alpha, size_t count)
+{
+    rolling_f64_tail(acc, x, alpha, 0, count);
+}
+
+static void rolling_f16_tail(double *acc, const uint16_t *x, double alpha, size_t i, size_t count)
+{
+    for (; i < count; i++)
+        acc[i] += alpha * (mf_f16_to_f32(x[i]) - acc[i]);
+}
+
+static void rolling_f16_scalar(double *acc, const uint16_t *x, double alpha, size_t count)
+{
+    rolling_f16_tail(acc, x, alpha, 0, count);
+}
+
+static void add_acc_f32_tail(float *out, const float *base, const double *acc, double s, size_t i, size_t count)
+{
+    for (; i < count; i++)
+        out[i] = (float)(base[i] + s * acc[i]);
+}
+
+static void add_acc_f32_scalar(float *out, const float *base, const double *acc, double s, size_t count)
+{
+    add_acc_f32_tail(out, base, acc, s, 0, count);
+}
+
+static void add_acc_f64_tail(double *out, const double *base, const double *acc, double s, size_t i, size_t count)
+{
+    for (; i < count; i++)
+        out[i] = base[i] + s * acc[i];
+}
+
+static void add_acc_f64_scalar(double *out, const double *base, const double *acc, double s, size_t count)
+{
+    add_acc_f64_tail(out, base, acc, s, 0, count);
+}
+
+static void add_acc_f16_tail(uint16_t *out, const uint16_t *base, const double *acc, double s, size_t i, size_t count)
+{
+    for (; i < count; i++)
+        out[i] = mf_f32_to_f16((float)(mf_f16_to_f32(base[i]) + s * acc[i]));
+}
+
+static void add_acc_f16_scalar(uint16_t *out, const uint16_t *base, const double *acc, double s, size_t count)
+{
+    add_acc_f16_tail(out, base, acc, s, 0, count);
+}
+
+static void wsum_mixed_tail(uint8_t type, void *out, const void *base, const mf_input_t *in, size_t n, double bias, size_t i, size_t count)
+{
+    for (; i < count; i++)
+    {
+        double acc = load_elem(type, base, i) + bias;
+        for (size_t j = 0; j < n; j++)
+            acc += in[j].w * load_elem(in[j].type, in[j].data, i);
+        store_elem(type, out, i, acc);
+    }
+}
+
+static void wsum_mixed_scalar(uint8_t type, void *out, const void *base, const mf_input_t *in, size_t n, double bias, size_t count)
+{
+    wsum_mixed_tail(type, out, base, in, n, bias, 0, count);
+}
+
+static void rolling_q_tail(uint8_t x_type, double *acc, const void *x, double scale, double zero, double alpha, size_t i, size_t count)
+{
+    for (; i < count; i++)
+        acc[i] += alpha * (scale * (load_elem(x_type, x, i) - zero) - acc[i]);
+}
+
+static void rolling_q_scalar(uint8_t x_type, double *acc, const void *x, double scale, double zero, double alpha, size_t count)
+{
+    rolling_q_tail(x_type, acc, x, scale, zero, alpha, 0, count);
+}
+
+#ifdef KERNELS_X86
+
+// ---------------------------------------------------------------------------
+// SSE2 (no fma, no f16 conversions: float16 uses the scalar kernels)
+// ---------------------------------------------------------------------------
+
+__attribute__((target("sse2"))) static void wsum_f32_sse2(float *out, const float *base, const float *const *in, const double *w, size_t n, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 b = _mm_loadu_ps(base + i);
+        __m128d lo = _mm_cvtps_pd(b);
+        __m128d hi = _mm_cvtps_pd(_mm_movehl_ps(b, b));
+        for (size_t j = 0; j < n; j++)
+        {
+            __m128 x = _mm_loadu_ps(in[j] + i);
+            __m128d wj = _mm_set1_pd(w[j]);
+            lo = _mm_add_pd(lo, _mm_mul_pd(_mm_cvtps_pd(x), wj));
+            hi = _mm_add_pd(hi, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), wj));
+        }
+        _mm_storeu_ps(out + i, _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi)));
+    }
+
+    wsum_f32_tail(out, base, in, w, n, i, count);
+}
+
+__attribute__((target("sse2"))) static void wsum_f64_sse2(double *out, const double *base, const double *const *in, const double *w, size_t n, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128d a0 = _mm_loadu_pd(base + i);
+        __m128d a1 = _mm_loadu_pd(base + i + 2);
+        for (size_t j = 0; j < n; j++)
+        {
+            __m128d wj = _mm_set1_pd(w[j]);
+            a0 = _mm_add_pd(a0, _mm_mul_pd(_mm_loadu_pd(in[j] + i), wj));
+            a1 = _mm_add_pd(a1, _mm_mul_pd(_mm_loadu_pd(in[j] + i + 2), wj));
+        }
+        _mm_storeu_pd(out + i, a0);
+        _mm_storeu_pd(out + i + 2, a1);
+    }
+
+    wsum_f64_tail(out, base, in, w, n, i, count);
+}
+
+__attribute__((target("sse2"))) static void sub_f32_sse2(float *dst, const float *a, const float *b, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_ps(dst + i, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+
+    sub_f32_scalar(dst + i, a + i, b + i, count - i);
+}
+
+__attribute__((target("sse2"))) static void sub_f64_sse2(double *dst, const double *a, const double *b, size_t count)
+{
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(dst + i, _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+
+    sub_f64_scalar(dst + i, a + i, b + i, count - i);
+}
+
+__attribute__((target("sse2"))) static void scale_f32_sse2(float *dst, double s, size_t count)
+{
+    size_t i = 0;
+    __m128d vs = _mm_set1_pd(s);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(dst + i);
+        __m128d lo = _mm_mul_pd(_mm_cvtps_pd(x), vs);
+        __m128d hi = _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), vs);
+        _mm_storeu_ps(dst + i, _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi)));
+    }
+
+    scale_f32_scalar(dst + i, s, count - i);
+}
+
+__attribute__((target("sse2"))) static void scale_f64_sse2(double *dst, double s, size_t count)
+{
+    size_t i = 0;
+    __m128d vs = _mm_set1_pd(s);
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(dst + i, _mm_mul_pd(_mm_loadu_pd(dst + i), vs));
+
+    scale_f64_scalar(dst + i, s, count - i);
+}
+
+// ---------------------------------------------------------------------------
+// AVX2 + FMA + F16C
+// ---------------------------------------------------------------------------
+
+#define AVX2_TARGET __attribute__((target("avx2,fma,f16c")))
+
+AVX2_TARGET static inline void avx2_wsum_block_f32(__m256 b0, __m256 b1, const float *const *in, const double *w, size_t n, size_t i, __m256 *o0, __m256 *o1)
+{
+    __m256d a0 = _mm256_cvtps_pd(_mm256_castps256_ps128(b0));
+    __m256d a1 = _mm256_cvtps_pd(_mm256_extractf128_ps(b0, 1));
+    __m256d a2 = _mm256_cvtps_pd(_mm256_castps256_ps128(b1));
+    __m256d a3 = _mm256_cvtps_pd(_mm256_extractf128_ps(b1, 1));
+    for (size_t j = 0; j < n; j++)
+    {
+        __m256d wj = _mm256_set1_pd(w[j]);
+        const float *x = in[j] + i;
+        a0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(x)), wj, a0);
+        a1 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(x + 4)), wj, a1);
+        a2 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(x + 8)), wj, a2);
+        a3 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(x + 12)), wj, a3);
+    }
+    *o0 = _mm256_set_m128(_mm256_cvtpd_ps(a1), _mm256_cvtpd_ps(a0));
+    *o1 = _mm256_set_m128(_mm256_cvtpd_ps(a3), _mm256_cvtpd_ps(a2));
+}
+
+AVX2_TARGET static void wsum_f32_avx2(float *out, const float *base, const float *const *in, const double *w, size_t n, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256 o0, o1;
+        avx2_wsum_block_f32(_mm256_loadu_ps(base + i), _mm256_loadu_ps(base + i + 8), in, w, n, i, &o0, &o1);
+        _mm256_storeu_ps(out + i, o0);
+        _mm256_storeu_ps(out + i + 8, o1);
+    }
+
+    wsum_f32_tail(out, base, in, w, n, i, count);
+}
+
+AVX2_TARGET static void wsum_f64_avx2(double *out, const double *base, const double *const *in, const double *w, size_t n, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256d a0 = _mm256_loadu_pd(base + i);
+        __m256d a1 = _mm256_loadu_pd(base + i + 4);
+        for (size_t j = 0; j < n; j++)
+        {
+            __m256d wj = _mm256_set1_pd(w[j]);
+            a0 = _mm256_fmadd_pd(_mm256_loadu_pd(in[j] + i), wj, a0);
+            a1 = _mm256_fmadd_pd(_mm256_loadu_pd(in[j] + i + 4), wj, a1);
+        }
+        _mm256_storeu_pd(out + i, a0);
+        _mm256_storeu_pd(out + i + 4, a1);
+    }
+
+    wsum_f64_tail(out, base, in, w, n, i, count);
+}
+
+AVX2_TARGET static void wsum_f16_avx2(uint16_t *out, const uint16_t *base, const uint16_t *const *in, const double *w, size_t n, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 b = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(base + i)));
+        __m256d a0 = _mm256_cvtps_pd(_mm256_castps256_ps128(b));
+        __m256d a1 = _mm256_cvtps_pd(_mm256_extractf128_ps(b, 1));
+        for (size_t j = 0; j < n; j++)
+        {
+            __m256d wj = _mm256_set1_pd(w[j]);
+            __m256 x = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in[j] + i)));
+            a0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(x)), wj, a0);
+            a1 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)), wj, a1);
+        }
+        __m256 o = _mm256_set_m128(_mm256_cvtpd_ps(a1), _mm256_cvtpd_ps(a0));
+        _mm_storeu_si128((__m128i *)(out + i), _mm256_cvtps_ph(o, _MM_FROUND_TO_NEAREST_INT));
+    }
+
+    wsum_f16_tail(out, base, in, w, n, i, count);
+}
+
+AVX2_TARGET static void sub_f32_avx2(float *dst, const float *a, const float *b, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        _mm256_storeu_ps(dst + i, _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        _mm256_storeu_ps(dst + i + 8, _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+
+    sub_f32_scalar(dst + i, a + i, b + i, count - i);
+}
+
+AVX2_TARGET static void sub_f64_avx2(double *dst, const double *a, const double *b, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        _mm256_storeu_pd(dst + i, _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        _mm256_storeu_pd(dst + i + 4, _mm256_sub_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+
+    sub_f64_scalar(dst + i, a + i, b + i, count - i);
+}
+
+AVX2_TARGET static void sub_f16_avx2(uint16_t *dst, const uint16_t *a, const uint16_t *b, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 x = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(a + i)));
+        __m256 y = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(b + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm256_cvtps_ph(_mm256_sub_ps(x, y), _MM_FROUND_TO_NEAREST_INT));
+    }
+
+    sub_f16_scalar(dst + i, a + i, b + i, count - i);
+}
+
+AVX2_TARGET static void scale_f32_avx2(float *dst, double s, size_t count)
+{
+    size_t i = 0;
+    __m256d vs = _mm256_set1_pd(s);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(dst + i);
+        __m256d lo = _mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(x)), vs);
+        __m256d hi = _mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)), vs);
+        _mm256_storeu_ps(dst + i, _mm256_set_m128(_mm256_cvtpd_ps(hi), _mm256_cvtpd_ps(lo)));
+    }
+
+    scale_f32_scalar(dst + i, s, count - i);
+}
+
+AVX2_TARGET static void scale_f64_avx2(double *dst, double s, size_t count)
+{
+    size_t i = 0;
+    __m256d vs = _mm256_set1_pd(s);
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_loadu_pd(dst + i), vs));
+
+    scale_f64_scalar(dst + i, s, count - i);
+}
+
+AVX2_TARGET static void scale_f16_avx2(uint16_t *dst, double s, size_t count)
+{
+    size_t i = 0;
+    __m256 vs = _mm256_set1_ps((float)s);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 x = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(dst + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm256_cvtps_ph(_mm256_mul_ps(x, vs), _MM_FROUND_TO_NEAREST_INT));
+    }
+
+    scale_f16_scalar(dst + i, s, count - i);
+}
+
+AVX2_TARGET static void rolling_f32_avx2(double *acc, const float *x, double alpha, size_t count)
+{
+    size_t i = 0;
+    __m256d va = _mm256_set1_pd(alpha);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256d a0 = _mm256_loadu_pd(acc + i);
+        __m256d a1 = _mm256_loadu_pd(acc + i + 4);
+        __m256d x0 = _mm256_cvtps_pd(_mm_loadu_ps(x + i));
+        __m256d x1 = _mm256_cvtps_pd(_mm_loadu_ps(x + i + 4));
+        _mm256_storeu_pd(acc + i, _mm256_fmadd_pd(_mm256_sub_pd(x0, a0), va, a0));
+        _mm256_storeu_pd(acc + i + 4, _mm256_fmadd_pd(_mm256_sub_pd(x1, a1), va, a1));
+    }
+
+    rolling_f32_tail(acc, x, alpha, i, count);
+}
+
+AVX2_TARGET static void rolling_f64_avx2(double *acc, const double *x, double alpha, size_t count)
+{
+    size_t i = 0;
+    __m256d va = _mm256_set1_pd(alpha);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d a = _mm256_loadu_pd(acc + i);
+        _mm256_storeu_pd(acc + i, _mm256_fmadd_pd(_mm256_sub_pd(_mm256_loadu_pd(x + i), a), va, a));
+    }
+
+    rolling_f64_tail(acc, x, alpha, i, count);
+}
+
+AVX2_TARGET static void rolling_f16_avx2(double *acc, const uint16_t *x, double alpha, size_t count)
+{
+    size_t i = 0;
+    __m256d va = _mm256_set1_pd(alpha);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 xs = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(x + i)));
+        __m256d a0 = _mm256_loadu_pd(acc + i);
+        __m256d a1 = _mm256_loadu_pd(acc + i + 4);
+        __m256d x0 = _mm256_cvtps_pd(_mm256_castps256_ps128(xs));
+        __m256d x1 = _mm256_cvtps_pd(_mm256_extractf128_ps(xs, 1));
+        _mm256_storeu_pd(acc + i, _mm256_fmadd_pd(_mm256_sub_pd(x0, a0), va, a0));
+        _mm256_storeu_pd(acc + i + 4, _mm256_fmadd_pd(_mm256_sub_pd(x1, a1), va, a1));
+    }
+
+    rolling_f16_tail(acc, x, alpha, i, count);
+}
+
+AVX2_TARGET static void add_acc_f32_avx2(float *out, const float *base, const double *acc, double s, size_t count)
+{
+    __m256d vs = _mm256_set1_pd(s);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256d lo = _mm256_add_pd(_mm256_cvtps_pd(_mm_loadu_ps(base + i)), _mm256_mul_pd(vs, _mm256_loadu_pd(acc + i)));
+        __m256d hi = _mm256_add_pd(_mm256_cvtps_pd(_mm_loadu_ps(base + i + 4)), _mm256_mul_pd(vs, _mm256_loadu_pd(acc + i + 4)));
+        _mm256_storeu_ps(out + i, _mm256_set_m128(_mm256_cvtpd_ps(hi), _mm256_cvtpd_ps(lo)));
+    }
+
+    add_acc_f32_tail(out, base, acc, s, i, count);
+}
+
+AVX2_TARGET static void add_acc_f64_avx2(double *out, const double *base, const double *acc, double s, size_t count)
+{
+    __m256d vs = _mm256_set1_pd(s);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(base + i), _mm256_mul_pd(vs, _mm256_loadu_pd(acc + i))));
+
+    add_acc_f64_tail(out, base, acc, s, i, count);
+}
+
+AVX2_TARGET static void add_acc_f16_avx2(uint16_t *out, const uint16_t *base, const double *acc, double s, size_t count)
+{
+    __m256d vs = _mm256_set1_pd(s);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 b = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(base + i)));
+        __m256d lo = _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(b)), _mm256_mul_pd(vs, _mm256_loadu_pd(acc + i)));
+        __m256d hi = _mm256_add_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(b, 1)), _mm256_mul_pd(vs, _mm256_loadu_pd(acc + i + 4)));
+        __m256 o = _mm256_set_m128(_mm256_cvtpd_ps(hi), _mm256_cvtpd_ps(lo));
+        _mm_storeu_si128((__m128i *)(out + i), _mm256_cvtps_ph(o, _MM_FROUND_TO_NEAREST_INT));
+    }
+
+    add_acc_f16_tail(out, base, acc, s, i, count);
+}
+
+// 4 elements of any input type as float64, type is a constant once inlined in the per type loops below
+AVX2_TARGET static inline __attribute__((always_inline)) __m256d avx2_load4_pd(uint8_t type, const void *data, size_t i)
+{
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        return _mm256_cvtps_pd(_mm_loadu_ps((const float *)data + i));
+    case MF_TFLOAT64:
+        return _mm256_loadu_pd((const double *)data + i);
+    case MF_TINT8:
+    {
+        int32_t q;
+        memcpy(&q, (const int8_t *)data + i, sizeof(q));
+        return _mm256_cvtepi32_pd(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(q)));
+    }
+    default:
+        return _mm256_cvtps_pd(_mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)((const uint16_t *)data + i))));
+    }
+}
+
+AVX2_TARGET static inline __attribute__((always_inline)) void avx2_store4_pd(uint8_t type, void *data, size_t i, __m256d v)
+{
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        _mm_storeu_ps((float *)data + i, _mm256_cvtpd_ps(v));
+        break;
+    case MF_TFLOAT64:
+        _mm256_storeu_pd((double *)data + i, v);
+        break;
+    default:
+        _mm_storel_epi64((__m128i *)((uint16_t *)data + i), _mm_cvtps_ph(_mm256_cvtpd_ps(v), _MM_FROUND_TO_NEAREST_INT));
+    }
+}
+
+// a[k] += w * data[i + 4k, i + 4k + 4) for k in [0, 4)
+AVX2_TARGET static inline void avx2_fmadd16(uint8_t type, const void *data, size_t i, __m256d w, __m256d *a)
+{
+#define AVX2_FMADD16(T)                                                                  \
+    for (size_t k = 0; k < 4; k++)                                                       \
+        a[k] = _mm256_fmadd_pd(avx2_load4_pd(T, data, i + 4 * k), w, a[k]);
+
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        AVX2_FMADD16(MF_TFLOAT32);
+        break;
+    case MF_TFLOAT64:
+        AVX2_FMADD16(MF_TFLOAT64);
+        break;
+    case MF_TINT8:
+        AVX2_FMADD16(MF_TINT8);
+        break;
+    default:
+        AVX2_FMADD16(MF_TFLOAT16);
+    }
+#undef AVX2_FMADD16
+}
+
+AVX2_TARGET static void wsum_mixed_avx2(uint8_t type, void *out, const void *base, const mf_input_t *in, size_t n, double bias, size_t count)
+{
+    size_t i = 0;
+    __m256d vb = _mm256_set1_pd(bias);
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256d a[4];
+        for (size_t k = 0; k < 4; k++)
+            a[k] = _mm256_add_pd(avx2_load4_pd(type, base, i + 4 * k), vb);
+
+        for (size_t j = 0; j < n; j++)
+            avx2_fmadd16(in[j].type, in[j].data, i, _mm256_set1_pd(in[j].w), a);
+
+        for (size_t k = 0; k < 4; k++)
+            avx2_store4_pd(type, out, i + 4 * k, a[k]);
+    }
+
+    wsum_mixed_tail(type, out, base, in, n, bias, i, count);
+}
+
+AVX2_TARGET static inline __attribute__((always_inline)) size_t rolling_q_avx2_loop(uint8_t x_type, double *acc, const void *x, double scale, double zero, double alpha, size_t count)
+{
+    size_t i = 0;
+    __m256d vs = _mm256_set1_pd(scale);
+    __m256d vz = _mm256_set1_pd(-scale * zero);
+    __m256d va = _mm256_set1_pd(alpha);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d a = _mm256_loadu_pd(acc + i);
+        __m256d v = _mm256_fmadd_pd(avx2_load4_pd(x_type, x, i), vs, vz);
+        _mm256_storeu_pd(acc + i, _mm256_fmadd_pd(_mm256_sub_pd(v, a), va, a));
+    }
+
+    return i;
+}
+
+AVX2_TARGET static void rolling_q_avx2(uint8_t x_type, double *acc, const void *x, double scale, double zero, double alpha, size_t count)
+{
+    size_t i;
+    switch (x_type)
+    {
+    case MF_TFLOAT32:
+        i = rolling_q_avx2_loop(MF_TFLOAT32, acc, x, scale, zero, alpha, count);
+        break;
+    case MF_TFLOAT64:
+        i = rolling_q_avx2_loop(MF_TFLOAT64, acc, x, scale, zero, alpha, count);
+        break;
+    case MF_TINT8:
+        i = rolling_q_avx2_loop(MF_TINT8, acc, x, scale, zero, alpha, count);
+        break;
+    default:
+        i = rolling_q_avx2_loop(MF_TFLOAT16, acc, x, scale, zero, alpha, count);
+    }
+
+    rolling_q_tail(x_type, acc, x, scale, zero, alpha, i, count);
+}
+
+// ---------------------------------------------------------------------------
+// AVX-512F (float16 goes through F16C, available on every AVX-512 cpu)
+// ---------------------------------------------------------------------------
+
+#define AVX512_TARGET __attribute__((target("avx512f,avx2,fma,f16c")))
+
+AVX512_TARGET static void wsum_f32_avx512(float *out, const float *base, const float *const *in, const double *w, size_t n, size_t count)
+{
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m512d a0 = _mm512_cvtps_pd(_mm256_loadu_ps(base + i));
+        __m512d a1 = _mm512_cvtps_pd(_mm256_loadu_ps(base + i + 8));
+        __m512d a2 = _mm512_cvtps_pd(_mm256_loadu_ps(base + i + 16));
+        __m512d a3 = _mm512_cvtps_pd(_mm256_loadu_ps(base + i + 24));
+        for (size_t j = 0; j < n; j++)
+        {
+            __m512d wj = _mm512_set1_pd(w[j]);
+            const float *x = in[j] + i;
+            a0 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_loadu_ps(x)), wj, a0);
+            a1 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_loadu_ps(x + 8)), wj, a1);
+            a2 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_loadu_ps(x + 16)), wj, a2);
+            a3 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_loadu_ps(x + 24)), wj, a3);
+        }
+        _mm256_storeu_ps(out + i, _mm512_cvtpd_ps(a0));
+        _mm256_storeu_ps(out + i + 8, _mm512_cvtpd_ps(a1));
+        _mm256_storeu_ps(out + i + 16, _mm512_cvtpd_ps(a2));
+        _mm256_storeu_ps(out + i + 24, _mm512_cvtpd_ps(a3));
+    }
+
+    wsum_f32_tail(out, base, in, w, n, i, count);
+}
+
+AVX512_TARGET static void wsum_f64_avx512(double *out, const double *base, const double *const *in, const double *w, size_t n, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512d a0 = _mm512_loadu_pd(base + i);
+        __m512d a1 = _mm512_loadu_pd(base + i + 8);
+        for (size_t j = 0; j < n; j++)
+        {
+            __m512d wj = _mm512_set1_pd(w[j]);
+            a0 = _mm512_fmadd_pd(_mm512_loadu_pd(in[j] + i), wj, a0);
+            a1 = _mm512_fmadd_pd(_mm512_loadu_pd(in[j] + i + 8), wj, a1);
+        }
+        _mm512_storeu_pd(out + i, a0);
+        _mm512_storeu_pd(out + i + 8, a1);
+    }
+
+    wsum_f64_tail(out, base, in, w, n, i, count);
+}
+
+AVX512_TARGET static void wsum_f16_avx512(uint16_t *out, const uint16_t *base, const uint16_t *const *in, const double *w, size_t n, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512d a0 = _mm512_cvtps_pd(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(base + i))));
+        __m512d a1 = _mm512_cvtps_pd(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(base + i + 8))));
+        for (size_t j = 0; j < n; j++)
+        {
+            __m512d wj = _mm512_set1_pd(w[j]);
+            a0 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in[j] + i)))), wj, a0);
+            a1 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in[j] + i + 8)))), wj, a1);
+        }
+        _mm_storeu_si128((__m128i *)(out + i), _mm256_cvtps_ph(_mm512_cvtpd_ps(a0), _MM_FROUND_TO_NEAREST_INT));
+        _mm_storeu_si128((__m128i *)(out + i + 8), _mm256_cvtps_ph(_mm512_cvtpd_ps(a1), _MM_FROUND_TO_NEAREST_INT));
+    }
+
+    wsum_f16_tail(out, base, in, w, n, i, count);
+}
+
+AVX512_TARGET static void sub_f32_avx512(float *dst, const float *a, const float *b, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+        _mm512_storeu_ps(dst + i, _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+
+    sub_f32_scalar(dst + i, a + i, b + i, count - i);
+}
+
+AVX512_TARGET static void sub_f64_avx512(double *dst, const double *a, const double *b, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm512_storeu_pd(dst + i, _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i)));
+
+    sub_f64_scalar(dst + i, a + i, b + i, count - i);
+}
+
+AVX512_TARGET static void scale_f32_avx512(float *dst, double s, size_t count)
+{
+    size_t i = 0;
+    __m512d vs = _mm512_set1_pd(s);
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(dst + i, _mm512_cvtpd_ps(_mm512_mul_pd(_mm512_cvtps_pd(_mm256_loadu_ps(dst + i)), vs)));
+
+    scale_f32_scalar(dst + i, s, count - i);
+}
+
+AVX512_TARGET static void scale_f64_avx512(double *dst, double s, size_t count)
+{
+    size_t i = 0;
+    __m512d vs = _mm512_set1_pd(s);
+    for (; i + 8 <= count; i += 8)
+        _mm512_storeu_pd(dst + i, _mm512_mul_pd(_mm512_loadu_pd(dst + i), vs));
+
+    scale_f64_scalar(dst + i, s, count - i);
+}
+
+AVX512_TARGET static void rolling_f32_avx512(double *acc, const float *x, double alpha, size_t count)
+{
+    size_t i = 0;
+    __m512d va = _mm512_set1_pd(alpha);
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512d a0 = _mm512_loadu_pd(acc + i);
+        __m512d a1 = _mm512_loadu_pd(acc + i + 8);
+        __m512d x0 = _mm512_cvtps_pd(_mm256_loadu_ps(x + i));
+        __m512d x1 = _mm512_cvtps_pd(_mm256_loadu_ps(x + i + 8));
+        _mm512_storeu_pd(acc + i, _mm512_fmadd_pd(_mm512_sub_pd(x0, a0), va, a0));
+        _mm512_storeu_pd(acc + i + 8, _mm512_fmadd_pd(_mm512_sub_pd(x1, a1), va, a1));
+    }
+
+    rolling_f32_tail(acc, x, alpha, i, count);
+}
+
+AVX512_TARGET static void rolling_f64_avx512(double *acc, const double *x, double alpha, size_t count)
+{
+    size_t i = 0;
+    __m512d va = _mm512_set1_pd(alpha);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m512d a = _mm512_loadu_pd(acc + i);
+        _mm512_storeu_pd(acc + i, _mm512_fmadd_pd(_mm512_sub_pd(_mm512_loadu_pd(x + i), a), va, a));
+    }
+
+    rolling_f64_tail(acc, x, alpha, i, count);
+}
+
+AVX512_TARGET static void add_acc_f32_avx512(float *out, const float *base, const double *acc, double s, size_t count)
+{
+    __m512d vs = _mm512_set1_pd(s);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(out + i, _mm512_cvtpd_ps(_mm512_add_pd(_mm512_cvtps_pd(_mm256_loadu_ps(base + i)), _mm512_mul_pd(vs, _mm512_loadu_pd(acc + i)))));
+
+    add_acc_f32_tail(out, base, acc, s, i, count);
+}
+
+AVX512_TARGET static void add_acc_f64_avx512(double *out, const double *base, const double *acc, double s, size_t count)
+{
+    __m512d vs = _mm512_set1_pd(s);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm512_storeu_pd(out + i, _mm512_add_pd(_mm512_loadu_pd(base + i), _mm512_mul_pd(vs, _mm512_loadu_pd(acc + i))));
+
+    add_acc_f64_tail(out, base, acc, s, i, count);
+}
+
+// 8 elements of any input type as float64, see avx2_load4_pd
+AVX512_TARGET static inline __attribute__((always_inline)) __m512d avx512_load8_pd(uint8_t type, const void *data, size_t i)
+{
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        return _mm512_cvtps_pd(_mm256_loadu_ps((const float *)data + i));
+    case MF_TFLOAT64:
+        return _mm512_loadu_pd((const double *)data + i);
+    case MF_TINT8:
+        return _mm512_cvtepi32_pd(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)((const int8_t *)data + i))));
+    default:
+        return _mm512_cvtps_pd(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)((const uint16_t *)data + i))));
+    }
+}
+
+AVX512_TARGET static inline __attribute__((always_inline)) void avx512_store8_pd(uint8_t type, void *data, size_t i, __m512d v)
+{
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        _mm256_storeu_ps((float *)data + i, _mm512_cvtpd_ps(v));
+        break;
+    case MF_TFLOAT64:
+        _mm512_storeu_pd((double *)data + i, v);
+        break;
+    default:
+        _mm_storeu_si128((__m128i *)((uint16_t *)data + i), _mm256_cvtps_ph(_mm512_cvtpd_ps(v), _MM_FROUND_TO_NEAREST_INT));
+    }
+}
+
+// a[k] += w * data[i + 8k, i + 8k + 8) for k in [0, 4)
+AVX512_TARGET static inline void avx512_fmadd32(uint8_t type, const void *data, size_t i, __m512d w, __m512d *a)
+{
+#define AVX512_FMADD32(T)                                                                \
+    for (size_t k = 0; k < 4; k++)                                                       \
+        a[k] = _mm512_fmadd_pd(avx512_load8_pd(T, data, i + 8 * k), w, a[k]);
+
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        AVX512_FMADD32(MF_TFLOAT32);
+        break;
+    case MF_TFLOAT64:
+        AVX512_FMADD32(MF_TFLOAT64);
+        break;
+    case MF_TINT8:
+        AVX512_FMADD32(MF_TINT8);
+        break;
+    default:
+        AVX512_FMADD32(MF_TFLOAT16);
+    }
+#undef AVX512_FMADD32
+}
+
+AVX512_TARGET static void wsum_mixed_avx512(uint8_t type, void *out, const void *base, const mf_input_t *in, size_t n, double bias, size_t count)
+{
+    size_t i = 0;
+    __m512d vb = _mm512_set1_pd(bias);
+    for (; i + 32 <= count; i += 32)
+    {
+        __m512d a[4];
+        for (size_t k = 0; k < 4; k++)
+            a[k] = _mm512_add_pd(avx512_load8_pd(type, base, i + 8 * k), vb);
+
+        for (size_t j = 0; j < n; j++)
+            avx512_fmadd32(in[j].type, in[j].data, i, _mm512_set1_pd(in[j].w), a);
+
+        for (size_t k = 0; k < 4; k++)
+            avx512_store8_pd(type, out, i + 8 * k, a[k]);
+    }
+
+    wsum_mixed_tail(type, out, base, in, n, bias, i, count);
+}
+
+AVX512_TARGET static inline __attribute__((always_inline)) size_t rolling_q_avx512_loop(uint8_t x_type, double *acc, const void *x, double scale, double zero, double alpha, size_t count)
+{
+    size_t i = 0;
+    __m512d vs = _mm512_set1_pd(scale);
+    __m512d vz = _mm512_set1_pd(-scale * zero);
+    __m512d va = _mm512_set1_pd(alpha);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m512d a = _mm512_loadu_pd(acc + i);
+        __m512d v = _mm512_fmadd_pd(avx512_load8_pd(x_type, x, i), vs, vz);
+        _mm512_storeu_pd(acc + i, _mm512_fmadd_pd(_mm512_sub_pd(v, a), va, a));
+    }
+
+    return i;
+}
+
+AVX512_TARGET static void rolling_q_avx512(uint8_t x_type, double *acc, const void *x, double scale, double zero, double alpha, size_t count)
+{
+    size_t i;
+    switch (x_type)
+    {
+    case MF_TFLOAT32:
+        i = rolling_q_avx512_loop(MF_TFLOAT32, acc, x, scale, zero, alpha, count);
+        break;
+    case MF_TFLOAT64:
+        i = rolling_q_avx512_loop(MF_TFLOAT64, acc, x, scale, zero, alpha, count);
+        break;
+    case MF_TINT8:
+        i = rolling_q_avx512_loop(MF_TINT8, acc, x, scale, zero, alpha, count);
+        break;
+    default:
+        i = rolling_q_avx512_loop(MF_TFLOAT16, acc, x, scale, zero, alpha, count);
+    }
+
+    rolling_q_tail(x_type, acc, x, scale, zero, alpha, i, count);
+}
+
+#endif // KERNELS_X86
+
+// ---------------------------------------------------------------------------
+// Dispatch
+// ---------------------------------------------------------------------------
+
+static kernel_table_t kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static int detect_isa(void)
+{
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("f16c") && __builtin_cpu_supports("fma"))
+        return KERNEL_ISA_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c") && __builtin_cpu_supports("fma"))
+        return KERNEL_ISA_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return KERNEL_ISA_SSE2;
+#endif
+    return KERNEL_ISA_SCALAR;
+}
+
+static void init_kernels(void)
+{
+    int isa = detect_isa();
+
+    const char *forced = getenv("MF_KERNEL_ISA");
+    if (forced != NULL)
+    {
+        for (int i = KERNEL_ISA_SCALAR; i <= KERNEL_ISA_AVX512; i++)
+        {
+            if (strcmp(forced, mf_kernel_isa_name(i)) == 0 && i < isa)
+                isa = i;
+        }
+    }
+
+    kernels = (kernel_table_t){
+        .isa = KERNEL_ISA_SCALAR,
+        .wsum_f32 = wsum_f32_scalar,
+        .wsum_f64 = wsum_f64_scalar,
+        .wsum_f16 = wsum_f16_scalar,
+        .sub_f32 = sub_f32_scalar,
+        .sub_f64 = sub_f64_scalar,
+        .sub_f16 = sub_f16_scalar,
+        .scale_f32 = scale_f32_scalar,
+        .scale_f64 = scale_f64_scalar,
+        .scale_f16 = scale_f16_scalar,
+        .rolling_f32 = rolling_f32_scalar,
+        .rolling_f64 = rolling_f64_scalar,
+        .rolling_f16 = rolling_f16_scalar,
+        .add_acc_f32 = add_acc_f32_scalar,
+        .add_acc_f64 = add_acc_f64_scalar,
+        .add_acc_f16 = add_acc_f16_scalar,
+        .wsum_mixed = wsum_mixed_scalar,
+        .rolling_q = rolling_q_scalar,
+    };
+
+#ifdef KERNELS_X86
+    if (isa >= KERNEL_ISA_SSE2)
+    {
+        kernels.isa = KERNEL_ISA_SSE2;
+        kernels.wsum_f32 = wsum_f32_sse2;
+        kernels.wsum_f64 = wsum_f64_sse2;
+        kernels.sub_f32 = sub_f32_sse2;
+        kernels.sub_f64 = sub_f64_sse2;
+        kernels.scale_f32 = scale_f32_sse2;
+        kernels.scale_f64 = scale_f64_sse2;
+    }
+
+    if (isa >= KERNEL_ISA_AVX2)
+    {
+        kernels.isa = KERNEL_ISA_AVX2;
+        kernels.wsum_f32 = wsum_f32_avx2;
+        kernels.wsum_f64 = wsum_f64_avx2;
+        kernels.wsum_f16 = wsum_f16_avx2;
+        kernels.sub_f32 = sub_f32_avx2;
+        kernels.sub_f64 = sub_f64_avx2;
+        kernels.sub_f16 = sub_f16_avx2;
+        kernels.scale_f32 = scale_f32_avx2;
+        kernels.scale_f64 = scale_f64_avx2;
+        kernels.scale_f16 = scale_f16_avx2;
+        kernels.rolling_f32 = rolling_f32_avx2;
+        kernels.rolling_f64 = rolling_f64_avx2;
+        kernels.rolling_f16 = rolling_f16_avx2;
+        kernels.add_acc_f32 = add_acc_f32_avx2;
+        kernels.add_acc_f64 = add_acc_f64_avx2;
+        kernels.add_acc_f16 = add_acc_f16_avx2;
+        kernels.wsum_mixed = wsum_mixed_avx2;
+        kernels.rolling_q = rolling_q_avx2;
+    }
+
+    if (isa >= KERNEL_ISA_AVX512)
+    {
+        kernels.isa = KERNEL_ISA_AVX512;
+        kernels.wsum_f32 = wsum_f32_avx512;
+        kernels.wsum_f64 = wsum_f64_avx512;
+        kernels.wsum_f16 = wsum_f16_avx512;
+        kernels.sub_f32 = sub_f32_avx512;
+        kernels.sub_f64 = sub_f64_avx512;
+        kernels.scale_f32 = scale_f32_avx512;
+        kernels.scale_f64 = scale_f64_avx512;
+        kernels.rolling_f32 = rolling_f32_avx512;
+        kernels.rolling_f64 = rolling_f64_avx512;
+        kernels.add_acc_f32 = add_acc_f32_avx512;
+        kernels.add_acc_f64 = add_acc_f64_avx512;
+        kernels.wsum_mixed = wsum_mixed_avx512;
+        kernels.rolling_q = rolling_q_avx512;
+    }
+#endif
+}
+
+#define get_kernels() ({                          \
+    pthread_once(&kernels_once, init_kernels);    \
+    &kernels;                                     \
+})
+
+int mf_kernel_isa(void)
+{
+    return get_kernels()->isa;
+}
+
+const char *mf_kernel_isa_name(int isa)
+{
+    switch (isa)
+    {
+    case KERNEL_ISA_SSE2:
+        return "sse2";
+    case KERNEL_ISA_AVX2:
+        return "avx2";
+    case KERNEL_ISA_AVX512:
+        return "avx512";
+    case KERNEL_ISA_SCALAR:
+    default:
+        return "scalar";
+    }
+}
+
+int mf_kernel_wsum(uint8_t type, void *out, const void *base, const void *const *in, const double *w, size_t n, size_t count)
+{
+    kernel_table_t *k = get_kernels();
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        k->wsum_f32((float *)out, (const float *)base, (const float *const *)in, w, n, count);
+        return 0;
+    case MF_TFLOAT64:
+        k->wsum_f64((double *)out, (const double *)base, (const double *const *)in, w, n, count);
+        return 0;
+    case MF_TFLOAT16:
+        k->wsum_f16((uint16_t *)out, (const uint16_t *)base, (const uint16_t *const *)in, w, n, count);
+        return 0;
+    default:
+        return ERR_KERNEL_UNSUPPORTED_TYPE;
+    }
+}
+
+int mf_kernel_sub(uint8_t type, void *dst, const void *a, const void *b, size_t count)
+{
+    kernel_table_t *k = get_kernels();
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        k->sub_f32((float *)dst, (const float *)a, (const float *)b, count);
+        return 0;
+    case MF_TFLOAT64:
+        k->sub_f64((double *)dst, (const double *)a, (const double *)b, count);
+        return 0;
+    case MF_TFLOAT16:
+        k->sub_f16((uint16_t *)dst, (const uint16_t *)a, (const uint16_t *)b, count);
+        return 0;
+    default:
+        return ERR_KERNEL_UNSUPPORTED_TYPE;
+    }
+}
+
+int mf_kernel_scale(uint8_t type, void *dst, double s, size_t count)
+{
+    kernel_table_t *k = get_kernels();
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        k->scale_f32((float *)dst, s, count);
+        return 0;
+    case MF_TFLOAT64:
+        k->scale_f64((double *)dst, s, count);
+        return 0;
+    case MF_TFLOAT16:
+        k->scale_f16((uint16_t *)dst, s, count);
+        return 0;
+    default:
+        return ERR_KERNEL_UNSUPPORTED_TYPE;
+    }
+}
+
+int mf_kernel_rolling(uint8_t type, double *acc, const void *x, double alpha, size_t count)
+{
+    kernel_table_t *k = get_kernels();
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        k->rolling_f32(acc, (const float *)x, alpha, count);
+        return 0;
+    case MF_TFLOAT64:
+        k->rolling_f64(acc, (const double *)x, alpha, count);
+        return 0;
+    case MF_TFLOAT16:
+        k->rolling_f16(acc, (const uint16_t *)x, alpha, count);
+        return 0;
+    default:
+        return ERR_KERNEL_UNSUPPORTED_TYPE;
+    }
+}
+
+int mf_kernel_add_acc(uint8_t type, void *out, const void *base, const double *acc, double s, size_t count)
+{
+    kernel_table_t *k = get_kernels();
+    switch (type)
+    {
+    case MF_TFLOAT32:
+        k->add_acc_f32((float *)out, (const float *)base, acc, s, count);
+        return 0;
+    case MF_TFLOAT64:
+        k->add_acc_f64((double *)out, (const double *)base, acc, s, count);
+        return 0;
+    case MF_TFLOAT16:
+        k->add_acc_f16((uint16_t *)out, (const uint16_t *)base, acc, s, count);
+        return 0;
+    default:
+        return ERR_KERNEL_UNSUPPORTED_TYPE;
+    }
+}
+
+int mf_kernel_wsum_mixed(uint8_t type, void *out, const void *base, const mf_input_t *in, size_t n, double bias, size_t count)
+{
+    if (!mf_kernel_supported_type(type))
+        return ERR_KERNEL_UNSUPPORTED_TYPE;
+
+    for (size_t j = 0; j < n; j++)
+    {
+        if (!mf_kernel_input_type(in[j].type))
+            return ERR_KERNEL_UNSUPPORTED_TYPE;
+    }
+
+    get_kernels()->wsum_mixed(type, out, base, in, n, bias, count);
+    return 0;
+}
+
+int mf_kernel_rolling_q(uint8_t x_type, double *acc, const void *x, double scale, double zero, double alpha, size_t count)
+{
+    if (!mf_kernel_input_type(x_type))
+        return ERR_KERNEL_UNSUPPORTED_TYPE;
+
+    get_kernels()->rolling_q(x_type, acc, x, scale, zero, alpha, count);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Sparse updates
+// Bound by the latency of the random accesses to acc, the type switch is out of the loop
+// and the loop is left to the compiler (AVX-512 scatters are not faster than scalar stores).
+// ---------------------------------------------------------------------------
+
+#define SCATTER_LOOP(T, load)                              \
+    for (size_t k = 0; k < nnz; k++)                       \
+        acc[index[k] - origin] += w * (load(((const T *)x)[k])) + bias;
+
+#define SCATTER_LOAD(v) (v)
+#define SCATTER_LOAD_F16(v) mf_f16_to_f32(v)
+
+int mf_kernel_scatter(uint8_t x_type, double *acc, size_t origin, const uint32_t *index, const void *x, double w, double bias, size_t nnz)
+{
+    switch (x_type)
+    {
+    case MF_TFLOAT32:
+        SCATTER_LOOP(float, SCATTER_LOAD);
+        return 0;
+    case MF_TFLOAT64:
+        SCATTER_LOOP(double, SCATTER_LOAD);
+        return 0;
+    case MF_TFLOAT16:
+        SCATTER_LOOP(uint16_t, SCATTER_LOAD_F16);
+        return 0;
+    case MF_TINT8:
+        SCATTER_LOOP(int8_t, SCATTER_LOAD);
+        return 0;
+    default:
+        return ERR_KERNEL_UNSUPPORTED_TYPE;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Robust reductions
+// The diffs of MF_ROBUST_BLOCK coordinates are gathered as float64 (the loads are the only
+// part that depends on the type), then every coordinate is reduced with a selection
+// (quickselect, expected O(n)) instead of a sort.
+// ---------------------------------------------------------------------------
+
+// vals[c * c_stride + j * j_stride] = x[j][start + c] for c in [0, count)
+static void load_diffs(const mf_diffs_t *d, double *vals, size_t c_stride, size_t j_stride, size_t start, size_t count)
+{
+    for (size_t j = 0; j < d->n; j++)
+    {
+        double s = d->s[j];
+        const void *rebase = d->rebase[j];
+        uint8_t in_type = d->in_type != NULL ? d->in_type[j] : d->type;
+        double scale = d->scale != NULL ? d->scale[j] : 1;
+        double zero = d->scale != NULL ? d->zero[j] : 0;
+        for (size_t c = 0; c < count; c++)
+        {
+            double x = scale * (load_elem(in_type, d->in[j], start + c) - zero);
+            if (rebase != NULL)
+                x += load_elem(d->type, rebase, start + c) - load_elem(d->type, d->base, start + c);
+            vals[c * c_stride + j * j_stride] = s * x;
+        }
+    }
+}
+
+// nth_element: afterwards v[k] is the k-th smallest, v[0, k) <= v[k] <= v(k, n)
+static void select_nth(double *v, size_t n, size_t k)
+{
+    ptrdiff_t lo = 0;
+    ptrdiff_t hi = (ptrdiff_t)n - 1;
+    while (lo < hi)
+    {
+        // median of three, the scans below can not run out of [lo, hi]
+        double a = v[lo], b = v[lo + (hi - lo) / 2], c = v[hi];
+        double pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+
+        ptrdiff_t i = lo;
+        ptrdiff_t j = hi;
+        while (i <= j)
+        {
+            while (v[i] < pivot)
+                i++;
+            while (v[j] > pivot)
+                j--;
+            if (i <= j)
+            {
+                double t = v[i];
+                v[i++] = v[j];
+                v[j--] = t;
+            }
+        }
+
+        if ((ptrdiff_t)k <= j)
+            hi = j;
+        else if ((ptrdiff_t)k >= i)
+            lo = i;
+        else
+            return;
+    }
+}
+
+static double median_of(double *v, size_t n)
+{
+    select_nth(v, n, n / 2);
+    if (n % 2 == 1)
+        return v[n / 2];
+
+    // the lower middle is the largest of the first half
+    double lower = v[0];
+    for (size_t j = 1; j < n / 2; j++)
+        lower = v[j] > lower ? v[j] : lower;
+    return (lower + v[n / 2]) / 2;
+}
+
+static double trimmed_mean_of(double *v, size_t n, size_t trim)
+{
+    // the trim smallest first, then the trim largest of the rest last
+    select_nth(v, n, trim);
+    size_t kept = n - 2 * trim;
+    if (trim > 0)
+        select_nth(v + trim, n - trim, kept - 1);
+
+    double sum = 0;
+    for (size_t j = trim; j < trim + kept; j++)
+        sum += v[j];
+    return sum / kept;
+}
+
+int mf_kernel_median(const mf_diffs_t *d, void *out, size_t start, size_t count)
+{
+    if (!mf_kernel_supported_type(d->type))
+        return ERR_KERNEL_UNSUPPORTED_TYPE;
+
+    double vals[MF_ROBUST_BLOCK * d->n];
+    for (size_t i = start; i < start + count; i += MF_ROBUST_BLOCK)
+    {
+        size_t k = start + count - i < MF_ROBUST_BLOCK ? start + count - i : MF_ROBUST_BLOCK;
+        load_diffs(d, vals, d->n, 1, i, k);
+        for (size_t c = 0; c < k; c++)
+            store_elem(d->type, out, i + c, load_elem(d->type, d->base, i + c) + median_of(vals + c * d->n, d->n));
+    }
+
+    return 0;
+}
+
+int mf_kernel_trimmed_mean(const mf_diffs_t *d, void *out, size_t trim, size_t start, size_t count)
+{
+    if (!mf_kernel_supported_type(d->type))
+        return ERR_KERNEL_UNSUPPORTED_TYPE;
+
+    assert(2 * trim < d->n);
+    double vals[MF_ROBUST_BLOCK * d->n];
+    for (size_t i = start; i < start + count; i += MF_ROBUST_BLOCK)
+    {
+        size_t k = start + count - i < MF_ROBUST_BLOCK ? start + count - i : MF_ROBUST_BLOCK;
+        load_diffs(d, vals, d->n, 1, i, k);
+        for (size_t c = 0; c < k; c++)
+            store_elem(d->type, out, i + c, load_elem(d->type, d->base, i + c) + trimmed_mean_of(vals + c * d->n, d->n, trim));
+    }
+
+    return 0;
+}
+
+int mf_kernel_sqdist(const mf_diffs_t *d, double *dist, size_t start, size_t count)
+{
+    if (!mf_kernel_supported_type(d->type))
+        return ERR_KERNEL_UNSUPPORTED_TYPE;
+
+    // one row of MF_DIST_BLOCK coordinates per update, the inner loop is contiguous
+    double vals[d->n * MF_DIST_BLOCK];
+    for (size_t i = start; i < start + count; i += MF_DIST_BLOCK)
+    {
+        size_t k = start + count - i < MF_DIST_BLOCK ? start + count - i : MF_DIST_BLOCK;
+        load_diffs(d, vals, 1, MF_DIST_BLOCK, i, k);
+        for (size_t a = 0; a < d->n; a++)
+        {
+            for (size_t b = a + 1; b < d->n; b++)
+            {
+                const double *x = vals + a * MF_DIST_BLOCK;
+                const double *y = vals + b * MF_DIST_BLOCK;
+                double sum = 0;
+                for (size_t c = 0; c < k; c++)
+                    sum += (x[c] - y[c]) * (x[c] - y[c]);
+                dist[a * d->n + b] += sum;
+            }
+        }
+    }
+
+    return 0;
+}
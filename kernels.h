@@ -0,0 +1,169 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "model.h"
+
+// Arithmetic kernels on the data section of a model, keyed on the MF_T* data types.
+// Supported types are MF_TFLOAT32, MF_TFLOAT64 and MF_TFLOAT16, every kernel returns
+// ERR_KERNEL_UNSUPPORTED_TYPE for any other type.
+// The best implementation (AVX-512, AVX2, SSE2 or scalar) is selected at runtime on the first call,
+// the MF_KERNEL_ISA environment variable (scalar, sse2, avx2, avx512) can be used to lower it.
+
+#define ERR_KERNEL_UNSUPPORTED_TYPE -1
+
+#define KERNEL_ISA_SCALAR 0
+#define KERNEL_ISA_SSE2 1
+#define KERNEL_ISA_AVX2 2
+#define KERNEL_ISA_AVX512 3
+
+int mf_kernel_isa(void);
+const char *mf_kernel_isa_name(int isa);
+
+#define mf_kernel_supported_type(type) ((type) == MF_TFLOAT32 || (type) == MF_TFLOAT64 || (type) == MF_TFLOAT16)
+
+// out[i] = base[i] + sum_j(w[j] * in[j][i]), accumulated in float64
+int mf_kernel_wsum(uint8_t type, void *out, const void *base, const void *const *in, const double *w, size_t n, size_t count);
+
+// dst[i] = a[i] - b[i], dst can alias a
+int mf_kernel_sub(uint8_t type, void *dst, const void *a, const void *b, size_t count);
+
+// dst[i] *= s
+int mf_kernel_scale(uint8_t type, void *dst, double s, size_t count);
+
+// Rolling weighted mean: acc[i] += alpha * (x[i] - acc[i]), with alpha = w / (total_w + w)
+// acc stays the weighted mean of every x folded so far
+int mf_kernel_rolling(uint8_t type, double *acc, const void *x, double alpha, size_t count);
+
+// out[i] = base[i] + s * acc[i]
+int mf_kernel_add_acc(uint8_t type, void *out, const void *base, const double *acc, double s, size_t count);
+
+// Inputs the mixed kernels dequantize while reducing: the supported types and MF_TINT8
+#define mf_kernel_input_type(type) (mf_kernel_supported_type(type) || (type) == MF_TINT8)
+
+typedef struct
+{
+    uint8_t type; // see mf_kernel_input_type
+    const void *data;
+    double w; // a quantized input has its scale folded in, the zero points go in the bias
+} mf_input_t;
+
+// out[i] = base[i] + bias + sum_j(in[j].w * in[j].data[i]), accumulated in float64, out and base of type
+int mf_kernel_wsum_mixed(uint8_t type, void *out, const void *base, const mf_input_t *in, size_t n, double bias, size_t count);
+
+// acc[i] += alpha * (scale * (x[i] - zero) - acc[i]), x of type x_type (see mf_kernel_input_type)
+int mf_kernel_rolling_q(uint8_t x_type, double *acc, const void *x, double scale, double zero, double alpha, size_t count);
+
+// Sparse inputs: acc[index[k] - origin] += w * x[k] + bias for k in [0, nnz), x of type x_type
+// (see mf_kernel_input_type). The indexes must be distinct, every element is read and written once.
+int mf_kernel_scatter(uint8_t x_type, double *acc, size_t origin, const uint32_t *index, const void *x, double w, double bias, size_t nnz);
+
+// The diffs of a round as seen by the robust kernels, every index is an element of the data section:
+// x[j][i] = s[j] * (dq(in[j][i]) + rebase[j][i] - base[i]), rebase[j] is NULL for the updates diffed from base.
+// dq(q) = scale[j] * (q - zero[j]) with in[j] of type in_type[j], scale is NULL if no input is quantized
+// and in_type is NULL if every input has type (the aggregator calls the kernels on one tile of one tensor
+// at a time, with the pointers moved to the start of the tile)
+typedef struct
+{
+    uint8_t type;
+    const void *base;
+    const void *const *in;
+    const void *const *rebase;
+    const double *s;
+    size_t n;
+
+    const uint8_t *in_type;
+    const double *scale;
+    const double *zero;
+} mf_diffs_t;
+
+#define MF_ROBUST_BLOCK 8 // coordinates gathered and reduced together by median / trimmed mean
+#define MF_DIST_BLOCK 32  // coordinates gathered together by sqdist
+
+// out[i] = base[i] + median_j(x[j][i]) for i in [start, start + count)
+int mf_kernel_median(const mf_diffs_t *d, void *out, size_t start, size_t count);
+
+// out[i] = base[i] + mean of x[j][i] without the trim smallest and the trim largest, 2 * trim < n
+int mf_kernel_trimmed_mean(const mf_diffs_t *d, void *out, size_t trim, size_t start, size_t count);
+
+// dist[a * n + b] += sum_i((x[a][i] - x[b][i])^2) for a < b and i in [start, start + count)
+int mf_kernel_sqdist(const mf_diffs_t *d, double *dist, size_t start, size_t count);
+
+static inline float mf_f16_to_f32(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+
+    if (exp == 0x1f)
+    {
+        bits = sign | 0x7f800000 | (mant << 13); // inf / nan
+    }
+    else if (exp != 0)
+    {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+    else if (mant == 0)
+    {
+        bits = sign;
+    }
+    else
+    {
+        // subnormal, normalize it
+        exp = 113;
+        while ((mant & 0x400) == 0)
+        {
+            mant <<= 1;
+            exp--;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// round to nearest even
+static inline uint16_t mf_f32_to_f16(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int32_t exp = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mant ? 0x200 : 0); // inf / nan
+
+    if (exp >= 0x1f)
+        return sign | 0x7c00; // overflow
+
+    if (exp <= 0)
+    {
+        if (exp < -10)
+            return sign; // underflow to zero
+
+        mant |= 0x800000;
+        uint32_t shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (half & 1)))
+            half++;
+        return sign | half;
+    }
+
+    uint16_t h = sign | (exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        h++; // may carry into the exponent, which is the correct rounding
+    return h;
+}
+
+#endif // KERNELS_H
@@ -1,4 +1,6 @@
-#if defined(__linux__)
+#if defined(__linux__) && defined(EVENT_LOOP_URING)
+#include "event_loop_uring.c" // falls back to epoll when io_uring is not available
+#elif defined(__linux__)
 #include "event_loop_epoll.c"
 #elif defined(__APPLE__)
 #include "event_loop_kqueue.c"
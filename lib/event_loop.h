@@ -4,33 +4,56 @@
 #include <stddef.h>
 #include <stdint.h>
 
+struct event_loop_uring;
+
 typedef struct
 {
     int fd;
+    struct event_loop_uring *uring; // NULL unless the io_uring backend is in use
 } event_loop_t;
 
 typedef enum
 {
     EVENT_READ = 1 << 0,
     EVENT_WRITE = 1 << 1,
+    EVENT_ACCEPT = 1 << 2, // completion: res is the accepted (non blocking) fd
+    EVENT_RECV = 1 << 3,   // completion: res bytes received in buf, 0 on EOF, -errno on error
 } event_type_t;
 
 #define EVENT_ERROR 1 << 0
 #define EVENT_EOF 1 << 1
+#define EVENT_DONE 1 << 2 // last completion of a multishot request, it has to be armed again
 
 typedef struct
 {
     event_type_t events;
     uint8_t flags;
     void *data;
+    int res;
+    char *buf; // EVENT_RECV only, valid until the next event_loop_wait
 } event_t;
 
 int event_loop_init(event_loop_t *loop);
 int event_loop_destroy(event_loop_t *loop);
+// data_size > 0: a zeroed block is allocated and returned in *data_ptr (freed by the caller)
+// data_size == 0: data_ptr is the caller's data itself
+// in both cases the data MUST start with the int fd, it is set by this call
 int event_loop_add(event_loop_t *loop, int fd, event_type_t events, size_t data_size, void **data_ptr);
 // WARNING: DATA POINTER IS NOT RECOVERED FROM PREVIOS event_loop_add CALL
 int event_loop_modify(event_loop_t *loop, int fd, event_type_t events, void *data);
+// Also drops the events of fd not yet handled from the last event_loop_wait (their events are set to 0)
 int event_loop_delete(event_loop_t *loop, int fd);
 int event_loop_wait(event_loop_t *loop, event_t *events, int max_events, int timeout);
 
+// Completion style extension, only the io_uring backend supports it (the others fail with ENOTSUP).
+// fd must have been added with event_loop_add, its events carry the same data pointer.
+// Build with EVENT_LOOP_URING to use io_uring, EVENT_LOOP=epoll at startup forces epoll.
+int event_loop_completions(event_loop_t *loop);
+// EVENT_ACCEPT for every new connection of the listening socket fd
+int event_loop_accept_multishot(event_loop_t *loop, int fd);
+// EVENT_RECV for every chunk of data received on fd, in kernel provided buffers
+int event_loop_recv_multishot(event_loop_t *loop, int fd);
+// Stops the recv of fd, data can still be delivered until the EVENT_RECV with EVENT_DONE
+int event_loop_recv_cancel(event_loop_t *loop, int fd);
+
 #endif // EVENT_LOOP_H
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include <stdio.h>
+#include <errno.h>
 #include <assert.h>
 #include "event_loop.h"
 
@@ -14,6 +15,7 @@ int event_loop_init(event_loop_t *loop)
     int ret = 0;
 
     loop->fd = epoll_create1(0);
+    loop->uring = NULL;
 
     if (loop->fd == -1)
     {
@@ -137,6 +139,8 @@ int event_loop_wait(event_loop_t *loop, event_t *events, int max_events, int tim
         events[i].data = epoll_events[i].data.ptr;
         events[i].events = 0;
         events[i].flags = 0;
+        events[i].res = 0;
+        events[i].buf = NULL;
 
         if (epoll_events[i].events & EPOLLERR)
         {
@@ -164,4 +168,27 @@ int event_loop_wait(event_loop_t *loop, event_t *events, int max_events, int tim
 
 end:
     return ret;
-}
\ No newline at end of file
+}
+
+int event_loop_completions(event_loop_t *loop)
+{
+    return 0;
+}
+
+int event_loop_accept_multishot(event_loop_t *loop, int fd)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+int event_loop_recv_multishot(event_loop_t *loop, int fd)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+int event_loop_recv_cancel(event_loop_t *loop, int fd)
+{
+    errno = ENOTSUP;
+    return -1;
+}
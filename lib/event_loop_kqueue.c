@@ -4,10 +4,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 
 int event_loop_init(event_loop_t *loop)
 {
   loop->fd = kqueue();
+  loop->uring = NULL;
   return loop->fd;
 }
 
@@ -22,7 +24,8 @@ int event_loop_add(event_loop_t *loop, int fd, event_type_t events, size_t data_
   struct kevent changes[2];
   int n = 0;
 
-  void *dataPtr = NULL;
+  // as with epoll, without data_size the caller owns the data and data_ptr points to it
+  void *dataPtr = (void *)data_ptr;
   if (data_size > 0)
   {
     dataPtr = malloc(data_size);
@@ -32,6 +35,8 @@ int event_loop_add(event_loop_t *loop, int fd, event_type_t events, size_t data_
     memset(dataPtr, 0, data_size);
   }
 
+  *(int *)dataPtr = fd;
+
   if (events & EVENT_READ)
   {
     EV_SET(&changes[n++], fd, EVFILT_READ, EV_ADD, 0, 0, dataPtr);
@@ -43,11 +48,12 @@ int event_loop_add(event_loop_t *loop, int fd, event_type_t events, size_t data_
 
   if (kevent(loop->fd, changes, n, NULL, 0, NULL) < 0)
   {
-    free(dataPtr);
+    if (data_size > 0)
+      free(dataPtr);
     return -1;
   }
 
-  if (data_ptr != NULL)
+  if (data_size > 0)
     *data_ptr = dataPtr;
 
   return 0;
@@ -84,6 +90,8 @@ int event_loop_wait(event_loop_t *loop, event_t *events, int max_events, int tim
     events[i].events = 0;
     events[i].data = (void **)kevents[i].udata;
     events[i].flags = 0;
+    events[i].res = 0;
+    events[i].buf = NULL;
 
     if (kevents[i].flags & EV_ERROR)
       events[i].flags |= EVENT_ERROR;
@@ -97,4 +105,27 @@ int event_loop_wait(event_loop_t *loop, event_t *events, int max_events, int tim
       events[i].events |= EVENT_WRITE;
   }
   return n;
-}
\ No newline at end of file
+}
+
+int event_loop_completions(event_loop_t *loop)
+{
+  return 0;
+}
+
+int event_loop_accept_multishot(event_loop_t *loop, int fd)
+{
+  errno = ENOTSUP;
+  return -1;
+}
+
+int event_loop_recv_multishot(event_loop_t *loop, int fd)
+{
+  errno = ENOTSUP;
+  return -1;
+}
+
+int event_loop_recv_cancel(event_loop_t *loop, int fd)
+{
+  errno = ENOTSUP;
+  return -1;
+}
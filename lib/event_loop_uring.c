@@ -0,0 +1,716 @@
+// This file implements the event loop using io_uring (raw syscalls, no liburing).
+// Readiness events are multishot polls, adding/modifying/deleting a fd only queues SQEs
+// that are submitted together with the next wait, so toggling EVENT_WRITE costs no syscall.
+// The completion extension adds multishot accept and multishot recv into a provided buffer ring.
+// When io_uring is not usable (old kernel, seccomp, EVENT_LOOP=epoll) every call goes to epoll.
+
+#define event_loop_init __epoll_event_loop_init
+#define event_loop_destroy __epoll_event_loop_destroy
+#define event_loop_add __epoll_event_loop_add
+#define event_loop_modify __epoll_event_loop_modify
+#define event_loop_delete __epoll_event_loop_delete
+#define event_loop_wait __epoll_event_loop_wait
+#define event_loop_completions __epoll_event_loop_completions
+#define event_loop_accept_multishot __epoll_event_loop_accept_multishot
+#define event_loop_recv_multishot __epoll_event_loop_recv_multishot
+#define event_loop_recv_cancel __epoll_event_loop_recv_cancel
+#include "event_loop_epoll.c"
+#undef event_loop_init
+#undef event_loop_destroy
+#undef event_loop_add
+#undef event_loop_modify
+#undef event_loop_delete
+#undef event_loop_wait
+#undef event_loop_completions
+#undef event_loop_accept_multishot
+#undef event_loop_recv_multishot
+#undef event_loop_recv_cancel
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES (4 * URING_ENTRIES)
+#define URING_BUFFER_GROUP 0
+#define URING_BUFFER_COUNT 256 // power of 2
+#define URING_BUFFER_SIZE (32 * 1024)
+
+// user_data = seq (24 bits) | op (8 bits) | fd (32 bits), 0 is used by internal requests
+#define URING_OP_POLL 1
+#define URING_OP_ACCEPT 2
+#define URING_OP_RECV 3
+
+#define uring_ud(fd, op, seq) (((uint64_t)((seq) & 0xffffff) << 40) | ((uint64_t)(op) << 32) | (uint32_t)(fd))
+#define uring_ud_fd(ud) ((int)(uint32_t)(ud))
+#define uring_ud_op(ud) ((uint8_t)((ud) >> 32))
+
+struct uring_fd
+{
+    void *data;
+    uint8_t active;
+    uint8_t poll_mask; // EVENT_READ | EVENT_WRITE
+    uint8_t recv_stopping;
+    uint32_t seq;
+    // user_data of the armed requests, 0 if not armed
+    uint64_t poll_ud;
+    uint64_t accept_ud;
+    uint64_t recv_ud;
+};
+
+struct event_loop_uring
+{
+    int ring_fd;
+
+    void *ring_ptr;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    uint16_t buf_tail;
+    uint16_t recycle[URING_BUFFER_COUNT];
+    size_t n_recycle;
+
+    struct uring_fd *fds;
+    size_t n_fds;
+
+    // events returned by the last wait, see event_loop_delete
+    event_t *last_events;
+    int last_n;
+};
+
+static int __uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int __uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int __uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void __uring_free(struct event_loop_uring *u)
+{
+    if (u->buffers != NULL)
+        free(u->buffers);
+    if (u->buf_ring != NULL)
+        munmap(u->buf_ring, u->buf_ring_size);
+    if (u->sqes != NULL)
+        munmap(u->sqes, u->sqes_size);
+    if (u->ring_ptr != NULL)
+        munmap(u->ring_ptr, u->ring_size);
+    if (u->ring_fd != -1)
+        close(u->ring_fd);
+
+    free(u->fds);
+    free(u);
+}
+
+static void __uring_add_buffer(struct event_loop_uring *u, uint16_t bid)
+{
+    struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (URING_BUFFER_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(u->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    u->buf_tail++;
+}
+
+static struct event_loop_uring *__uring_create()
+{
+    struct event_loop_uring *u = (struct event_loop_uring *)calloc(1, sizeof(struct event_loop_uring));
+    if (u == NULL)
+        return NULL;
+
+    struct io_uring_params params = {0};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    u->ring_fd = __uring_setup(URING_ENTRIES, &params);
+    if (u->ring_fd < 0)
+    {
+        u->ring_fd = -1;
+        goto error;
+    }
+
+    // single mmap for both rings, no cqe drops and timeouts in io_uring_enter
+    uint32_t features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & features) != features)
+        goto error;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring_ptr = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->ring_ptr == MAP_FAILED)
+    {
+        u->ring_ptr = NULL;
+        goto error;
+    }
+
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        u->sqes = NULL;
+        goto error;
+    }
+
+    char *ring = (char *)u->ring_ptr;
+    u->sq_head = (unsigned *)(ring + params.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    u->sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+    u->sq_entries = params.sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+
+    // sqes are always used in ring order
+    unsigned *sq_array = (unsigned *)(ring + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++)
+        sq_array[i] = i;
+
+    u->cq_head = (unsigned *)(ring + params.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    u->cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    // provided buffers for multishot recv
+    u->buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    u->buf_ring = mmap(NULL, u->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buf_ring == MAP_FAILED)
+    {
+        u->buf_ring = NULL;
+        goto error;
+    }
+
+    struct io_uring_buf_reg reg = {0};
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (__uring_register(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto error;
+
+    u->buffers = (char *)malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (u->buffers == NULL)
+        goto error;
+
+    for (uint16_t i = 0; i < URING_BUFFER_COUNT; i++)
+        __uring_add_buffer(u, i);
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+
+    return u;
+
+error:
+    __uring_free(u);
+    return NULL;
+}
+
+static int __uring_submit(struct event_loop_uring *u, unsigned min_complete, unsigned flags, void *arg, size_t arg_size)
+{
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+
+    int res = __uring_enter(u->ring_fd, u->to_submit, min_complete, flags, arg, arg_size);
+    if (res >= 0)
+        u->to_submit -= (unsigned)res < u->to_submit ? (unsigned)res : u->to_submit;
+
+    return res;
+}
+
+static struct io_uring_sqe *__uring_get_sqe(struct event_loop_uring *u)
+{
+    if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+    {
+        // the submission queue is full, flush it
+        if (__uring_submit(u, 0, 0, NULL, 0) < 0 ||
+            u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail & u->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sq_local_tail++;
+    u->to_submit++;
+    return sqe;
+}
+
+static struct uring_fd *__uring_fd(struct event_loop_uring *u, int fd)
+{
+    if (fd < 0)
+        return NULL;
+
+    if ((size_t)fd >= u->n_fds)
+    {
+        size_t n_fds = u->n_fds == 0 ? 1024 : u->n_fds;
+        while (n_fds <= (size_t)fd)
+            n_fds *= 2;
+
+        struct uring_fd *fds = (struct uring_fd *)realloc(u->fds, n_fds * sizeof(struct uring_fd));
+        if (fds == NULL)
+            return NULL;
+
+        memset(fds + u->n_fds, 0, (n_fds - u->n_fds) * sizeof(struct uring_fd));
+        u->fds = fds;
+        u->n_fds = n_fds;
+    }
+
+    return &u->fds[fd];
+}
+
+// cancels (or removes, for polls) the request identified by ud, its completions are dropped
+static int __uring_cancel(struct event_loop_uring *u, uint8_t opcode, uint64_t ud)
+{
+    struct io_uring_sqe *sqe = __uring_get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = opcode;
+    sqe->fd = -1;
+    sqe->addr = ud;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = 0;
+    return 0;
+}
+
+static uint32_t __uring_poll_events(uint8_t mask)
+{
+    uint32_t events = 0;
+    if (mask & EVENT_READ)
+        events |= POLLIN;
+    if (mask & EVENT_WRITE)
+        events |= POLLOUT;
+    return events;
+}
+
+static int __uring_arm_poll(struct event_loop_uring *u, int fd, struct uring_fd *entry)
+{
+    struct io_uring_sqe *sqe = __uring_get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+
+    entry->poll_ud = uring_ud(fd, URING_OP_POLL, ++entry->seq);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = __uring_poll_events(entry->poll_mask);
+    sqe->user_data = entry->poll_ud;
+    return 0;
+}
+
+static int __uring_arm_accept(struct event_loop_uring *u, int fd, struct uring_fd *entry)
+{
+    struct io_uring_sqe *sqe = __uring_get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+
+    entry->accept_ud = uring_ud(fd, URING_OP_ACCEPT, ++entry->seq);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = entry->accept_ud;
+    return 0;
+}
+
+static int __uring_arm_recv(struct event_loop_uring *u, int fd, struct uring_fd *entry)
+{
+    struct io_uring_sqe *sqe = __uring_get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+
+    entry->recv_ud = uring_ud(fd, URING_OP_RECV, ++entry->seq);
+    entry->recv_stopping = 0;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = entry->recv_ud;
+    return 0;
+}
+
+int event_loop_init(event_loop_t *loop)
+{
+    loop->uring = NULL;
+
+    const char *backend = getenv("EVENT_LOOP");
+    if (backend == NULL || strcmp(backend, "epoll") != 0)
+        loop->uring = __uring_create();
+
+    if (loop->uring == NULL)
+        return __epoll_event_loop_init(loop);
+
+    loop->fd = loop->uring->ring_fd;
+    return 0;
+}
+
+int event_loop_destroy(event_loop_t *loop)
+{
+    if (loop->uring == NULL)
+        return __epoll_event_loop_destroy(loop);
+
+    __uring_free(loop->uring);
+    loop->uring = NULL;
+    loop->fd = -1;
+    return 0;
+}
+
+int event_loop_completions(event_loop_t *loop)
+{
+    return loop->uring != NULL;
+}
+
+int event_loop_add(event_loop_t *loop, int fd, event_type_t events, size_t data_size, void **data_ptr)
+{
+    struct event_loop_uring *u = loop->uring;
+    if (u == NULL)
+        return __epoll_event_loop_add(loop, fd, events, data_size, data_ptr);
+
+    assert(data_ptr != NULL);
+
+    struct uring_fd *entry = __uring_fd(u, fd);
+    if (entry == NULL)
+        return -1;
+
+    assert(!entry->active);
+
+    void *dataPtr = NULL;
+    if (data_size != 0)
+    {
+        dataPtr = malloc(data_size);
+        if (dataPtr == NULL)
+            return -1;
+
+        memset(dataPtr, 0, data_size);
+        *data_ptr = dataPtr;
+    }
+    else
+    {
+        dataPtr = data_ptr;
+    }
+
+    *(int *)dataPtr = fd;
+
+    entry->data = dataPtr;
+    entry->active = 1;
+    entry->poll_mask = events & (EVENT_READ | EVENT_WRITE);
+    entry->poll_ud = 0;
+    entry->accept_ud = 0;
+    entry->recv_ud = 0;
+    entry->recv_stopping = 0;
+
+    if (entry->poll_mask != 0 && __uring_arm_poll(u, fd, entry) < 0)
+    {
+        entry->active = 0;
+        if (data_size != 0)
+            free(dataPtr);
+        return -1;
+    }
+
+    return 0;
+}
+
+int event_loop_modify(event_loop_t *loop, int fd, event_type_t events, void *data)
+{
+    struct event_loop_uring *u = loop->uring;
+    if (u == NULL)
+        return __epoll_event_loop_modify(loop, fd, events, data);
+
+    struct uring_fd *entry = __uring_fd(u, fd);
+    if (entry == NULL || !entry->active)
+        return -1;
+
+    entry->data = data;
+    uint8_t mask = events & (EVENT_READ | EVENT_WRITE);
+    if (mask == entry->poll_mask && (mask == 0 || entry->poll_ud != 0))
+        return 0;
+
+    entry->poll_mask = mask;
+    if (entry->poll_ud != 0)
+    {
+        if (mask == 0)
+        {
+            int res = __uring_cancel(u, IORING_OP_POLL_REMOVE, entry->poll_ud);
+            entry->poll_ud = 0;
+            return res;
+        }
+
+        // update the armed poll in place, if it already ended its last completion arms it again
+        struct io_uring_sqe *sqe = __uring_get_sqe(u);
+        if (sqe == NULL)
+            return -1;
+
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = entry->poll_ud;
+        sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = __uring_poll_events(mask);
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = 0;
+        return 0;
+    }
+
+    return __uring_arm_poll(u, fd, entry);
+}
+
+int event_loop_delete(event_loop_t *loop, int fd)
+{
+    struct event_loop_uring *u = loop->uring;
+    if (u == NULL)
+        return __epoll_event_loop_delete(loop, fd);
+
+    struct uring_fd *entry = __uring_fd(u, fd);
+    if (entry == NULL || !entry->active)
+        return -1;
+
+    // the completions already queued for fd are dropped, they do not match the cleared user_data
+    int res = 0;
+    if (entry->poll_ud != 0)
+        res |= __uring_cancel(u, IORING_OP_POLL_REMOVE, entry->poll_ud);
+    if (entry->accept_ud != 0)
+        res |= __uring_cancel(u, IORING_OP_ASYNC_CANCEL, entry->accept_ud);
+    if (entry->recv_ud != 0)
+        res |= __uring_cancel(u, IORING_OP_ASYNC_CANCEL, entry->recv_ud);
+
+    // a single wait can return many completions of the same fd
+    for (int i = 0; i < u->last_n; i++)
+    {
+        if (u->last_events[i].data == entry->data)
+            u->last_events[i].events = 0;
+    }
+
+    entry->active = 0;
+    entry->data = NULL;
+    entry->poll_mask = 0;
+    entry->poll_ud = 0;
+    entry->accept_ud = 0;
+    entry->recv_ud = 0;
+    return res;
+}
+
+int event_loop_accept_multishot(event_loop_t *loop, int fd)
+{
+    struct event_loop_uring *u = loop->uring;
+    if (u == NULL)
+        return __epoll_event_loop_accept_multishot(loop, fd);
+
+    struct uring_fd *entry = __uring_fd(u, fd);
+    if (entry == NULL || !entry->active)
+        return -1;
+
+    if (entry->accept_ud != 0)
+        return 0;
+
+    return __uring_arm_accept(u, fd, entry);
+}
+
+int event_loop_recv_multishot(event_loop_t *loop, int fd)
+{
+    struct event_loop_uring *u = loop->uring;
+    if (u == NULL)
+        return __epoll_event_loop_recv_multishot(loop, fd);
+
+    struct uring_fd *entry = __uring_fd(u, fd);
+    if (entry == NULL || !entry->active)
+        return -1;
+
+    if (entry->recv_ud != 0)
+        return 0;
+
+    return __uring_arm_recv(u, fd, entry);
+}
+
+int event_loop_recv_cancel(event_loop_t *loop, int fd)
+{
+    struct event_loop_uring *u = loop->uring;
+    if (u == NULL)
+        return __epoll_event_loop_recv_cancel(loop, fd);
+
+    struct uring_fd *entry = __uring_fd(u, fd);
+    if (entry == NULL || !entry->active || entry->recv_ud == 0)
+        return -1;
+
+    if (entry->recv_stopping)
+        return 0;
+
+    // the recv ud is kept, its last completion (EVENT_DONE) still has to reach the caller
+    entry->recv_stopping = 1;
+    return __uring_cancel(u, IORING_OP_ASYNC_CANCEL, entry->recv_ud);
+}
+
+// turns a completion into an event, returns 0 if it has to be dropped
+static int __uring_event(struct event_loop_uring *u, struct io_uring_cqe *cqe, event_t *event)
+{
+    uint64_t ud = cqe->user_data;
+    if (ud == 0)
+        return 0;
+
+    struct uring_fd *entry = __uring_fd(u, uring_ud_fd(ud));
+    if (entry == NULL || !entry->active)
+        return 0;
+
+    uint8_t more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    event->data = entry->data;
+    event->events = 0;
+    event->flags = 0;
+    event->res = cqe->res;
+    event->buf = NULL;
+
+    switch (uring_ud_op(ud))
+    {
+    case URING_OP_POLL:
+        if (ud != entry->poll_ud)
+            return 0;
+
+        if (!more)
+        {
+            // ended by an error or by an update of a poll that was already ending
+            entry->poll_ud = 0;
+            if (entry->poll_mask != 0)
+                __uring_arm_poll(u, uring_ud_fd(ud), entry);
+        }
+
+        if (cqe->res < 0)
+            return 0;
+
+        if (cqe->res & (POLLIN | POLLHUP | POLLERR))
+            event->events |= EVENT_READ;
+        if (cqe->res & POLLOUT)
+            event->events |= EVENT_WRITE;
+
+        // the mask could have changed after the poll fired
+        event->events &= entry->poll_mask;
+        event->res = 0;
+        return event->events != 0;
+
+    case URING_OP_ACCEPT:
+        if (ud != entry->accept_ud)
+            return 0;
+
+        if (!more)
+        {
+            entry->accept_ud = 0;
+            __uring_arm_accept(u, uring_ud_fd(ud), entry);
+        }
+
+        if (cqe->res < 0)
+            return 0;
+
+        event->events = EVENT_ACCEPT;
+        return 1;
+
+    case URING_OP_RECV:
+        if (ud != entry->recv_ud)
+            return 0;
+
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            event->buf = u->buffers + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUFFER_SIZE;
+
+        if (!more)
+        {
+            // out of buffers or cqes: they are back at the next wait, keep receiving
+            if (!entry->recv_stopping && (cqe->res > 0 || cqe->res == -ENOBUFS))
+            {
+                entry->recv_ud = 0;
+                __uring_arm_recv(u, uring_ud_fd(ud), entry);
+                if (cqe->res < 0)
+                    return 0;
+            }
+            else
+            {
+                if (entry->recv_stopping && cqe->res == -ENOBUFS)
+                    event->res = -ECANCELED;
+
+                entry->recv_ud = 0;
+                entry->recv_stopping = 0;
+                event->flags |= EVENT_DONE;
+            }
+        }
+
+        event->events = EVENT_RECV;
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+int event_loop_wait(event_loop_t *loop, event_t *events, int max_events, int timeout)
+{
+    struct event_loop_uring *u = loop->uring;
+    if (u == NULL)
+        return __epoll_event_loop_wait(loop, events, max_events, timeout);
+
+    // the buffers of the previous events are not used anymore
+    for (size_t i = 0; i < u->n_recycle; i++)
+        __uring_add_buffer(u, u->recycle[i]);
+    if (u->n_recycle > 0)
+        __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+    u->n_recycle = 0;
+    u->last_events = events;
+    u->last_n = 0;
+
+    unsigned head = *u->cq_head;
+    uint8_t ready = head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    if (!ready || u->to_submit > 0)
+    {
+        // timeout is in milliseconds
+        struct __kernel_timespec ts = {0};
+        struct io_uring_getevents_arg arg = {0};
+        if (timeout >= 0)
+        {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+
+        unsigned min_complete = ready || timeout == 0 ? 0 : 1;
+        if (__uring_submit(u, min_complete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0)
+        {
+            if (errno == EINTR)
+                return -1;
+
+            if (errno != ETIME && errno != EBUSY)
+                return -1;
+        }
+    }
+
+    int n = 0;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && n < max_events)
+    {
+        struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+        head++;
+
+        // every selected buffer goes back to the ring, also the ones of dropped completions
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            u->recycle[u->n_recycle++] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (__uring_event(u, cqe, &events[n]))
+            n++;
+    }
+
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    u->last_n = n;
+    return n;
+}
@@ -4,6 +4,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -81,6 +82,99 @@ int load_file(const char *filename, char **file_data, size_t *file_size)
     return 1;
 }
 
+int map_file_fd(int fd, char **file_data, size_t *file_size)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        perror("Failed to get file size");
+        return -1;
+    }
+
+    if (st.st_size == 0)
+    {
+        perror("Cannot map an empty file");
+        return -1;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        perror("Failed to map file");
+        return -1;
+    }
+
+    // files are always consumed front to back
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    *file_data = (char *)data;
+    *file_size = (size_t)st.st_size;
+    return 0;
+}
+
+int load_file_resident(int fd, char **file_data, size_t *file_size)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        perror("Failed to get file size");
+        return -1;
+    }
+
+    if (st.st_size == 0)
+    {
+        perror("Cannot load an empty file");
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    char *data = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+    {
+        perror("Failed to map memory for file");
+        return -1;
+    }
+
+#if defined(MADV_HUGEPAGE)
+    madvise(data, size, MADV_HUGEPAGE);
+#endif
+
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t bytes = pread(fd, data + done, size - done, done);
+        if (bytes <= 0)
+        {
+            if (bytes == -1 && errno == EINTR)
+                continue;
+
+            perror("Failed to read file");
+            munmap(data, size);
+            return -1;
+        }
+
+        done += bytes;
+    }
+
+    // the copy is never written again
+    mprotect(data, size, PROT_READ);
+
+    *file_data = data;
+    *file_size = size;
+    return 0;
+}
+
+int unmap_file(char *file_data, size_t file_size)
+{
+    if (munmap(file_data, file_size) == -1)
+    {
+        perror("Failed to unmap file");
+        return -1;
+    }
+
+    return 0;
+}
+
 int ensure_dir_exists(const char *dir)
 {
     struct stat st = {0};
@@ -6,6 +6,13 @@
 
 int load_file_fd(int fd, char **file_data, size_t *file_size);
 int load_file(const char *filename, char **file_data, size_t *file_size);
+
+// read-only, private mapping of the whole file, release it with unmap_file
+int map_file_fd(int fd, char **file_data, size_t *file_size);
+int unmap_file(char *file_data, size_t file_size);
+// copy of the whole file in anonymous memory (transparent huge pages when the system allows it),
+// it does not depend on the page cache, release it with unmap_file
+int load_file_resident(int fd, char **file_data, size_t *file_size);
 int ensure_dir_exists(const char *dir);
 int remove_directory(const char *path);
 int recover_update_folder(const char *folder);
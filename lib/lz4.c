@@ -0,0 +1,208 @@
+#include "lz4.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_MFLIMIT 12       // the last match starts at least 12 bytes before the end of the block
+#define LZ4_LAST_LITERALS 5  // the last 5 bytes are always literals
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12     // 16KB table, it fits in L1 with the block being compressed
+#define LZ4_SKIP_TRIGGER 6   // the search step grows by one every 64 bytes without a match
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// the bytes following a token field that reached 15
+static inline uint8_t *put_length(uint8_t *op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static inline int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+    do
+    {
+        if (*ip >= iend)
+            return -1;
+
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+// one sequence: literals [anchor, ip), then a match of match_len bytes at offset (none if match_len == 0)
+static inline uint8_t *put_sequence(uint8_t *op, const uint8_t *anchor, size_t lit_len, size_t offset, size_t match_len)
+{
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15)
+        op = put_length(op, lit_len - 15);
+
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+
+    if (match_len == 0)
+        return op;
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+
+    match_len -= LZ4_MIN_MATCH;
+    *token |= (uint8_t)(match_len >= 15 ? 15 : match_len);
+    if (match_len >= 15)
+        op = put_length(op, match_len - 15);
+
+    return op;
+}
+
+// worst case size of a sequence
+static inline size_t sequence_bound(size_t lit_len, size_t match_len)
+{
+    return 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+}
+
+ssize_t lz4_compress_block(const char *src, size_t size, char *dst, size_t capacity)
+{
+    const uint8_t *base = (const uint8_t *)src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *iend = base + size;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *oend = op + capacity;
+    uint32_t table[1 << LZ4_HASH_BITS] = {0}; // positions in src, stale ones are rejected by the compare
+
+    if (size > LZ4_MFLIMIT)
+    {
+        const uint8_t *mflimit = iend - LZ4_MFLIMIT;
+        const uint8_t *match_limit = iend - LZ4_LAST_LITERALS;
+        while (ip < mflimit)
+        {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash32(seq);
+            const uint8_t *ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq)
+            {
+                ip += 1 + ((size_t)(ip - anchor) >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+
+            const uint8_t *match_end = ip + LZ4_MIN_MATCH;
+            const uint8_t *ref_end = ref + LZ4_MIN_MATCH;
+            while (match_end < match_limit && *match_end == *ref_end)
+            {
+                match_end++;
+                ref_end++;
+            }
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+
+            size_t lit_len = (size_t)(ip - anchor);
+            size_t match_len = (size_t)(match_end - ip);
+            if (sequence_bound(lit_len, match_len) > (size_t)(oend - op))
+                return -1;
+
+            op = put_sequence(op, anchor, lit_len, (size_t)(ip - ref), match_len);
+            ip = match_end;
+            anchor = ip;
+
+            // the position just before the match end is a good candidate for the next one
+            if (ip - 2 > base && ip < mflimit)
+                table[hash32(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    size_t lit_len = (size_t)(iend - anchor);
+    if (sequence_bound(lit_len, 0) > (size_t)(oend - op))
+        return -1;
+
+    op = put_sequence(op, anchor, lit_len, 0, 0);
+    return (ssize_t)(op - (uint8_t *)dst);
+}
+
+ssize_t lz4_decompress_block(const char *src, size_t size, char *dst, size_t capacity)
+{
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *iend = ip + size;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *oend = op + capacity;
+
+    if (size == 0)
+        return -1;
+
+    while (1)
+    {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && get_length(&ip, iend, &lit_len) < 0)
+            return -1;
+
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op))
+            return -1;
+
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // the last sequence has literals only
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst))
+            return -1;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_length(&ip, iend, &match_len) < 0)
+            return -1;
+
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (size_t)(oend - op) || ip >= iend)
+            return -1;
+
+        const uint8_t *ref = op - offset;
+        if (offset >= match_len)
+        {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        }
+        else
+        {
+            // overlapping copy, it repeats the last offset bytes
+            for (size_t i = 0; i < match_len; i++)
+                *op++ = ref[i];
+        }
+    }
+
+    return (ssize_t)(op - (uint8_t *)dst);
+}
@@ -0,0 +1,20 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md), compatible with
+// LZ4_compress_default / LZ4_decompress_safe. Blocks are independent and MUST be smaller than 2GB.
+
+// worst case size of a compressed block of size bytes
+#define LZ4_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+// returns the compressed size, -1 if it does not fit in capacity bytes (incompressible data, store it as is)
+ssize_t lz4_compress_block(const char *src, size_t size, char *dst, size_t capacity);
+
+// returns the decompressed size, -1 if the block is malformed or does not fit in capacity bytes.
+// It never reads or writes outside src and dst, whatever the input.
+ssize_t lz4_decompress_block(const char *src, size_t size, char *dst, size_t capacity);
+
+#endif // LZ4_H
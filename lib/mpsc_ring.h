@@ -0,0 +1,264 @@
+#ifndef MPSC_RING_H
+#define MPSC_RING_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+
+#include "queue.h" // QUEUE_OK, QUEUE_CLOSED, QUEUE_EMPTY, QUEUE_FULL
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+// Bounded lock-free multi producer / single consumer ring (capacity is a power of two).
+// Producers reserve a slot with a CAS on tail and publish it through the slot sequence,
+// the consumer drains batches without any atomic read-modify-write.
+// Sleeping is done on futex words (polling on other systems): the consumer waits for
+// items_seq to change when the ring is empty, the producers wait for space_seq when it is full.
+
+// ts is an absolute CLOCK_REALTIME deadline (as pthread_cond_timedwait), NULL waits forever
+static inline int __ring_wait(atomic_uint *word, unsigned int value, const struct timespec *ts)
+{
+#if defined(__linux__)
+    return syscall(SYS_futex, word, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, value, ts, NULL, FUTEX_BITSET_MATCH_ANY);
+#else
+    struct timespec tick = {0, 1000000};
+    while (atomic_load(word) == value)
+    {
+        if (ts != NULL)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (now.tv_sec > ts->tv_sec || (now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec))
+            {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+
+        nanosleep(&tick, NULL);
+    }
+
+    return 0;
+#endif
+}
+
+static inline void __ring_wake(atomic_uint *word, int n)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
+    (void)word;
+    (void)n;
+#endif
+}
+
+#define define_mpsc_ring(T, N)                                                   \
+    typedef struct                                                               \
+    {                                                                            \
+        atomic_size_t seq; /* position + 1 once published */                     \
+        T item;                                                                  \
+    } N##_ring_slot_t;                                                           \
+                                                                                 \
+    typedef struct                                                               \
+    {                                                                            \
+        N##_ring_slot_t *slots;                                                  \
+        size_t mask;                                                             \
+        atomic_uint closed;                                                      \
+        _Alignas(64) atomic_size_t tail; /* producers */                         \
+        atomic_uint items_seq;           /* bumped by every enqueue */           \
+        atomic_uint consumer_waiting;                                            \
+        _Alignas(64) size_t head; /* consumer only */                            \
+        atomic_uint space_seq;    /* bumped by every dequeue that freed slots */ \
+        atomic_uint producers_waiting;                                           \
+    } N##_ring_t;
+
+#define declare_mpsc_ring(T, N)                                                \
+    int ring_##N##_init(N##_ring_t *q, size_t capacity);                       \
+    void ring_##N##_destroy(N##_ring_t *q);                                    \
+    void ring_##N##_close(N##_ring_t *q);                                      \
+    int ring_##N##_try_enqueue(N##_ring_t *q, T item);                         \
+    int ring_##N##_enqueue(N##_ring_t *q, T item);                             \
+    int ring_##N##_try_dequeue_batch(N##_ring_t *q, T *items, int max);       \
+    int ring_##N##_dequeue_batch(N##_ring_t *q, T *items, int max, const struct timespec *ts);
+
+// ring_##N##_enqueue blocks while the ring is full (backpressure), try_enqueue returns QUEUE_FULL.
+// ring_##N##_dequeue_batch returns the number of items (> 0), QUEUE_EMPTY if ts expired
+// and QUEUE_CLOSED once the ring is closed and drained. It MUST be called by a single thread.
+#define define_mpsc_ring_methods(T, N)                                                            \
+    int ring_##N##_init(N##_ring_t *q, size_t capacity)                                           \
+    {                                                                                             \
+        if (capacity < 2 || (capacity & (capacity - 1)) != 0)                                     \
+        {                                                                                         \
+            errno = EINVAL;                                                                       \
+            return -1;                                                                            \
+        }                                                                                         \
+        q->slots = (N##_ring_slot_t *)malloc(capacity * sizeof(N##_ring_slot_t));                 \
+        if (q->slots == NULL)                                                                     \
+        {                                                                                         \
+            return -1;                                                                            \
+        }                                                                                         \
+        for (size_t i = 0; i < capacity; i++)                                                     \
+        {                                                                                         \
+            atomic_init(&q->slots[i].seq, i);                                                     \
+        }                                                                                         \
+        q->mask = capacity - 1;                                                                   \
+        q->head = 0;                                                                              \
+        atomic_init(&q->tail, 0);                                                                 \
+        atomic_init(&q->closed, 0);                                                               \
+        atomic_init(&q->items_seq, 0);                                                            \
+        atomic_init(&q->consumer_waiting, 0);                                                     \
+        atomic_init(&q->space_seq, 0);                                                            \
+        atomic_init(&q->producers_waiting, 0);                                                    \
+        return 0;                                                                                 \
+    }                                                                                             \
+                                                                                                  \
+    void ring_##N##_destroy(N##_ring_t *q)                                                        \
+    {                                                                                             \
+        free(q->slots);                                                                           \
+        q->slots = NULL;                                                                          \
+    }                                                                                             \
+                                                                                                  \
+    void ring_##N##_close(N##_ring_t *q)                                                          \
+    {                                                                                             \
+        atomic_store(&q->closed, 1);                                                              \
+        atomic_fetch_add(&q->items_seq, 1);                                                       \
+        atomic_fetch_add(&q->space_seq, 1);                                                       \
+        __ring_wake(&q->items_seq, 1);                                                            \
+        __ring_wake(&q->space_seq, INT32_MAX);                                                    \
+    }                                                                                             \
+                                                                                                  \
+    int ring_##N##_try_enqueue(N##_ring_t *q, T item)                                             \
+    {                                                                                             \
+        if (atomic_load_explicit(&q->closed, memory_order_relaxed))                               \
+        {                                                                                         \
+            return QUEUE_CLOSED;                                                                  \
+        }                                                                                         \
+        size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);                        \
+        N##_ring_slot_t *slot;                                                                    \
+        while (1)                                                                                 \
+        {                                                                                         \
+            slot = &q->slots[pos & q->mask];                                                      \
+            size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);                  \
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;                                         \
+            if (dif == 0)                                                                         \
+            {                                                                                     \
+                if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,                \
+                                                          memory_order_relaxed,                   \
+                                                          memory_order_relaxed))                  \
+                {                                                                                 \
+                    break;                                                                        \
+                }                                                                                 \
+            }                                                                                     \
+            else if (dif < 0)                                                                     \
+            {                                                                                     \
+                return QUEUE_FULL;                                                                \
+            }                                                                                     \
+            else                                                                                  \
+            {                                                                                     \
+                pos = atomic_load_explicit(&q->tail, memory_order_relaxed);                       \
+            }                                                                                     \
+        }                                                                                         \
+        slot->item = item;                                                                        \
+        atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);                         \
+        atomic_fetch_add(&q->items_seq, 1);                                                       \
+        if (atomic_load(&q->consumer_waiting))                                                    \
+        {                                                                                         \
+            __ring_wake(&q->items_seq, 1);                                                        \
+        }                                                                                         \
+        return QUEUE_OK;                                                                          \
+    }                                                                                             \
+                                                                                                  \
+    int ring_##N##_enqueue(N##_ring_t *q, T item)                                                 \
+    {                                                                                             \
+        while (1)                                                                                 \
+        {                                                                                         \
+            unsigned int space = atomic_load(&q->space_seq);                                      \
+            int ret = ring_##N##_try_enqueue(q, item);                                            \
+            if (ret != QUEUE_FULL)                                                                \
+            {                                                                                     \
+                return ret;                                                                       \
+            }                                                                                     \
+            atomic_fetch_add(&q->producers_waiting, 1);                                           \
+            ret = ring_##N##_try_enqueue(q, item);                                                \
+            if (ret == QUEUE_FULL)                                                                \
+            {                                                                                     \
+                __ring_wait(&q->space_seq, space, NULL);                                          \
+            }                                                                                     \
+            atomic_fetch_sub(&q->producers_waiting, 1);                                           \
+            if (ret != QUEUE_FULL)                                                                \
+            {                                                                                     \
+                return ret;                                                                       \
+            }                                                                                     \
+        }                                                                                         \
+    }                                                                                             \
+                                                                                                  \
+    int ring_##N##_try_dequeue_batch(N##_ring_t *q, T *items, int max)                           \
+    {                                                                                             \
+        int n = 0;                                                                                \
+        while (n < max)                                                                           \
+        {                                                                                         \
+            N##_ring_slot_t *slot = &q->slots[q->head & q->mask];                                 \
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != q->head + 1)            \
+            {                                                                                     \
+                break;                                                                            \
+            }                                                                                     \
+            items[n++] = slot->item;                                                              \
+            atomic_store_explicit(&slot->seq, q->head + q->mask + 1, memory_order_release);       \
+            q->head++;                                                                            \
+        }                                                                                         \
+        if (n > 0)                                                                                \
+        {                                                                                         \
+            atomic_fetch_add(&q->space_seq, 1);                                                   \
+            if (atomic_load(&q->producers_waiting))                                               \
+            {                                                                                     \
+                __ring_wake(&q->space_seq, INT32_MAX);                                            \
+            }                                                                                     \
+        }                                                                                         \
+        return n;                                                                                 \
+    }                                                                                             \
+                                                                                                  \
+    int ring_##N##_dequeue_batch(N##_ring_t *q, T *items, int max, const struct timespec *ts)    \
+    {                                                                                             \
+        while (1)                                                                                 \
+        {                                                                                         \
+            unsigned int seq = atomic_load(&q->items_seq);                                        \
+            int n = ring_##N##_try_dequeue_batch(q, items, max);                                  \
+            if (n > 0)                                                                            \
+            {                                                                                     \
+                return n;                                                                         \
+            }                                                                                     \
+            if (atomic_load(&q->closed))                                                          \
+            {                                                                                     \
+                return QUEUE_CLOSED;                                                              \
+            }                                                                                     \
+            atomic_store(&q->consumer_waiting, 1);                                                \
+            n = ring_##N##_try_dequeue_batch(q, items, max);                                      \
+            int ret = 0;                                                                          \
+            if (n == 0 && !atomic_load(&q->closed))                                               \
+            {                                                                                     \
+                ret = __ring_wait(&q->items_seq, seq, ts);                                        \
+            }                                                                                     \
+            atomic_store(&q->consumer_waiting, 0);                                                \
+            if (n > 0)                                                                            \
+            {                                                                                     \
+                return n;                                                                         \
+            }                                                                                     \
+            if (ret == -1 && errno == ETIMEDOUT)                                                  \
+            {                                                                                     \
+                n = ring_##N##_try_dequeue_batch(q, items, max);                                  \
+                return n > 0 ? n : QUEUE_EMPTY;                                                   \
+            }                                                                                     \
+        }                                                                                         \
+    }
+
+#define declare_mpsc_ring_type(T, N) \
+    define_mpsc_ring(T, N)           \
+        declare_mpsc_ring(T, N)
+
+#endif // MPSC_RING_H
@@ -8,6 +8,7 @@
 #define QUEUE_OK 0
 #define QUEUE_CLOSED -2
 #define QUEUE_EMPTY -3
+#define QUEUE_FULL -4
 
 #define define_queue(T, N)        \
     typedef struct                \
@@ -22,13 +23,14 @@
         pthread_cond_t wait_read; \
     } N##_queue_t;
 
-#define declare_queue(T, N)                             \
-    int queue_##N##_init(N##_queue_t *q, int capacity); \
-    void queue_##N##_destroy(N##_queue_t *q);           \
-    int queue_##N##_enqueue(N##_queue_t *q, T item);    \
-    int queue_##N##_dequeue(N##_queue_t *q, T *item);   \
-    void queue_##N##_close(N##_queue_t *q);             \
-    int queue_##N##_tdequeue(N##_queue_t *q, T *item, struct timespec *ts);
+#define declare_queue(T, N)                                                 \
+    int queue_##N##_init(N##_queue_t *q, int capacity);                     \
+    void queue_##N##_destroy(N##_queue_t *q);                               \
+    int queue_##N##_enqueue(N##_queue_t *q, T item);                        \
+    int queue_##N##_dequeue(N##_queue_t *q, T *item);                       \
+    void queue_##N##_close(N##_queue_t *q);                                 \
+    int queue_##N##_tdequeue(N##_queue_t *q, T *item, struct timespec *ts); \
+    int queue_##N##_dequeue_batch(N##_queue_t *q, T *items, int max, const struct timespec *ts);
 
 #define define_queue_methods(T, N)                                         \
     int queue_##N##_init(N##_queue_t *q, int capacity)                     \
@@ -46,6 +48,11 @@
         {                                                                  \
             return -1;                                                     \
         }                                                                  \
+        if (pthread_cond_init(&q->wait_read, NULL) != 0)                   \
+        {                                                                  \
+            pthread_mutex_destroy(&q->lock);                               \
+            return -1;                                                     \
+        }                                                                  \
         return 0;                                                          \
     }                                                                      \
     void queue_##N##_close(N##_queue_t *q)                                 \
@@ -130,6 +137,44 @@
         q->size--;                                                         \
         pthread_mutex_unlock(&q->lock);                                    \
         return QUEUE_OK;                                                   \
+    }                                                                      \
+    /* up to max items with a single lock, ts NULL waits forever */        \
+    /* returns the number of items, QUEUE_EMPTY or QUEUE_CLOSED */         \
+    int queue_##N##_dequeue_batch(N##_queue_t *q, T *items, int max,       \
+                                  const struct timespec *ts)               \
+    {                                                                      \
+        pthread_mutex_lock(&q->lock);                                      \
+        while (q->size == 0)                                               \
+        {                                                                  \
+            if (q->closed)                                                 \
+            {                                                              \
+                pthread_mutex_unlock(&q->lock);                            \
+                return QUEUE_CLOSED;                                       \
+            }                                                              \
+            int ret = ts == NULL                                           \
+                          ? pthread_cond_wait(&q->wait_read, &q->lock)     \
+                          : pthread_cond_timedwait(&q->wait_read,          \
+                                                   &q->lock, ts);          \
+            if (ret == ETIMEDOUT && q->size == 0)                          \
+            {                                                              \
+                pthread_mutex_unlock(&q->lock);                            \
+                return QUEUE_EMPTY;                                        \
+            }                                                              \
+            else if (ret != 0 && ret != ETIMEDOUT)                         \
+            {                                                              \
+                pthread_mutex_unlock(&q->lock);                            \
+                return -1;                                                 \
+            }                                                              \
+        }                                                                  \
+        int n = 0;                                                         \
+        while (n < max && q->size > 0)                                     \
+        {                                                                  \
+            items[n++] = q->data[q->head];                                 \
+            q->head = (q->head + 1) % q->capacity;                         \
+            q->size--;                                                     \
+        }                                                                  \
+        pthread_mutex_unlock(&q->lock);                                    \
+        return n;                                                          \
     }
 
 #define declare_queue_type(T, N) \
@@ -0,0 +1,51 @@
+#ifndef SHARED_BUFFER_H
+#define SHARED_BUFFER_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+// Immutable reference counted bytes, it can be queued on many sessions (also on different workers)
+// without copying it. The data is released by the last shared_buffer_release.
+typedef struct shared_buffer
+{
+    atomic_size_t refs;
+    void *data; // MUST NOT be written after the buffer has been shared
+    size_t size;
+    void (*destroy)(void *data, size_t size); // NULL: free(data)
+} shared_buffer_t;
+
+// Takes ownership of data, the returned buffer holds a single reference
+static inline shared_buffer_t *shared_buffer_wrap(void *data, size_t size, void (*destroy)(void *data, size_t size))
+{
+    shared_buffer_t *buffer = (shared_buffer_t *)malloc(sizeof(shared_buffer_t));
+    if (buffer == NULL)
+        return NULL;
+
+    atomic_init(&buffer->refs, 1);
+    buffer->data = data;
+    buffer->size = size;
+    buffer->destroy = destroy;
+    return buffer;
+}
+
+static inline shared_buffer_t *shared_buffer_acquire(shared_buffer_t *buffer)
+{
+    atomic_fetch_add_explicit(&buffer->refs, 1, memory_order_relaxed);
+    return buffer;
+}
+
+static inline void shared_buffer_release(shared_buffer_t *buffer)
+{
+    if (atomic_fetch_sub_explicit(&buffer->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    if (buffer->destroy != NULL)
+        buffer->destroy(buffer->data, buffer->size);
+    else
+        free(buffer->data);
+
+    free(buffer);
+}
+
+#endif // SHARED_BUFFER_H
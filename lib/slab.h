@@ -0,0 +1,100 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+// Pool of fixed size objects carved out of big chunks, freed objects are kept on a free list
+// and reused by the next slab_alloc. It is NOT thread safe: every worker owns its own slabs,
+// an object MUST be freed to the slab it has been allocated from.
+// The chunks are returned to the system only by slab_destroy.
+
+struct slab_free
+{
+    struct slab_free *next;
+};
+
+struct slab_chunk
+{
+    struct slab_chunk *next;
+    max_align_t objects[]; // objects_per_chunk * object_size bytes
+};
+
+typedef struct slab
+{
+    size_t object_size;
+    size_t objects_per_chunk;
+    struct slab_free *free_list;
+    struct slab_chunk *chunks;
+} slab_t;
+
+static inline void slab_init(slab_t *slab, size_t object_size, size_t objects_per_chunk)
+{
+    // every object is aligned like a malloc'd block and can hold the free list link
+    size_t align = sizeof(max_align_t);
+    if (object_size < sizeof(struct slab_free))
+        object_size = sizeof(struct slab_free);
+
+    slab->object_size = (object_size + align - 1) / align * align;
+    slab->objects_per_chunk = objects_per_chunk > 0 ? objects_per_chunk : 1;
+    slab->free_list = NULL;
+    slab->chunks = NULL;
+}
+
+static inline void slab_destroy(slab_t *slab)
+{
+    struct slab_chunk *chunk = slab->chunks;
+    while (chunk != NULL)
+    {
+        struct slab_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    slab->free_list = NULL;
+    slab->chunks = NULL;
+}
+
+// the objects of a new chunk are threaded on the free list, returns -1 if out of memory
+static inline int slab_grow(slab_t *slab)
+{
+    struct slab_chunk *chunk = (struct slab_chunk *)malloc(sizeof(struct slab_chunk) + slab->objects_per_chunk * slab->object_size);
+    if (chunk == NULL)
+        return -1;
+
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+
+    char *object = (char *)chunk->objects + (slab->objects_per_chunk - 1) * slab->object_size;
+    for (size_t i = 0; i < slab->objects_per_chunk; i++, object -= slab->object_size)
+    {
+        struct slab_free *node = (struct slab_free *)object;
+        node->next = slab->free_list;
+        slab->free_list = node;
+    }
+
+    return 0;
+}
+
+// returns an uninitialized object, NULL if out of memory
+static inline void *slab_alloc(slab_t *slab)
+{
+    if (slab->free_list == NULL && slab_grow(slab) < 0)
+        return NULL;
+
+    struct slab_free *object = slab->free_list;
+    slab->free_list = object->next;
+    return object;
+}
+
+static inline void slab_free(slab_t *slab, void *object)
+{
+    if (object == NULL)
+        return;
+
+    struct slab_free *node = (struct slab_free *)object;
+    node->next = slab->free_list;
+    slab->free_list = node;
+}
+
+#endif // SLAB_H
@@ -1,3 +1,7 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // splice
+#endif
+
 #include "socket_server.h"
 
 #include <signal.h> // sig_atomic_t
@@ -11,6 +15,11 @@
 #include <sys/resource.h> //getrlimit
 
 #include <sys/socket.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#else
+#include <sys/uio.h>
+#endif
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -22,13 +31,145 @@
 
 // END OF LINTER FIX
 
+static int __enqueue_node(generic_session_t *session, struct buffer_list_node_t *node);
+static int __client_pass_ownership_and_send(generic_session_t *session, void *data, size_t size, uint8_t type);
+static int __stream_write(generic_session_t *session, const char *data, size_t size);
+static int __end_stream(generic_session_t *session);
+static int __handle_frames(socket_server_config_t *config, generic_session_t *session);
+static void __close_session(socket_server_t *server, generic_session_t *session);
+
+struct deferred_reply
+{
+    uint8_t refs; // the queued node and the completion, worker thread only
+    socket_server_t *server;
+    generic_session_t *session; // NULL once the session has been closed, worker thread only
+    struct buffer_list_node_t *node;
+    shared_buffer_t *buffer; // set by client_complete_reply
+    struct deferred_reply *next; // completed_replies
+};
+
+// returns the number of bytes sent, -1 on error (errno is set)
+static ssize_t __sendfile(int sock, int fd, off_t offset, size_t size)
+{
+#if defined(__linux__)
+    return sendfile(sock, fd, &offset, size);
+#else
+    off_t len = size;
+    if (sendfile(fd, sock, offset, &len, NULL, 0) == -1 && len == 0)
+        return -1;
+    return len;
+#endif
+}
+
+static ssize_t __send_node(generic_session_t *session, struct buffer_list_node_t *node)
+{
+    size_t remaining = node->size - node->cursor;
+    if (node->type == BUFFER_NODE_FILE)
+        return __sendfile(session->fd, node->file_fd, node->file_offset + node->cursor, remaining);
+
+    return send(session->fd, node->data + node->cursor, remaining, 0);
+}
+
+static void __release_reply(deferred_reply_t *reply)
+{
+    if (--reply->refs != 0)
+        return;
+
+    if (reply->buffer != NULL)
+        shared_buffer_release(reply->buffer);
+    free(reply);
+}
+
+static void __free_node(socket_server_t *server, struct buffer_list_node_t *node)
+{
+    if (node->type == BUFFER_NODE_FILE)
+        close(node->file_fd);
+    else if (node->type == BUFFER_NODE_SHARED)
+        shared_buffer_release(node->shared);
+    else if (node->type == BUFFER_NODE_SMALL)
+        slab_free(&server->payload_pool, node->data);
+    else if (node->type == BUFFER_NODE_DEFERRED)
+    {
+        // the completion finds the session gone
+        node->reply->session = NULL;
+        __release_reply(node->reply);
+    }
+    else
+        free(node->data);
+
+    slab_free(&server->time_pool, node->request_time);
+    slab_free(&server->node_pool, node);
+}
+
+// drops a pending write event registration of a session that is being closed
+static void __forget_write_fd(socket_server_t *server, generic_session_t *session)
+{
+    for (size_t i = 0; i < server->write_fd_queue_size; i++)
+    {
+        if (server->write_fd_queue[i].session == session)
+        {
+            server->write_fd_queue[i] = server->write_fd_queue[server->write_fd_queue_size - 1];
+            server->write_fd_queue_size--;
+            return;
+        }
+    }
+}
+
+// releases everything still queued for a session that is being closed
+static void __free_buffer_list(generic_session_t *session)
+{
+    struct buffer_list_node_t *node = session->buffer_list;
+    while (node != NULL)
+    {
+        struct buffer_list_node_t *next = node->next;
+        __free_node(session->server, node);
+        node = next;
+    }
+
+    session->buffer_list = NULL;
+    session->buffer_list_end = NULL;
+}
+
+// the write event of the session is enabled before the next event_loop_wait
+static void __queue_write_fd(generic_session_t *session)
+{
+    size_t next_write_fd = session->server->write_fd_queue_size;
+
+    write_fd_t *write_fd = &(session->server->write_fd_queue[next_write_fd]);
+    write_fd->fd = session->fd;
+    write_fd->session = session;
+
+    session->server->write_fd_queue_size = next_write_fd + 1;
+}
+
+// the request time of a reply is the time its frame started to be received
+static int __stamp_request(generic_session_t *session)
+{
+    if (session->last_request_time != NULL)
+        return 0;
+
+    struct timespec *now = slab_alloc(&session->server->time_pool);
+    if (now == NULL)
+    {
+        perror("Failed to allocate memory for timespec");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, now);
+    session->last_request_time = now;
+    return 0;
+}
+
+// data can be sent right away only if nothing is already queued for the session
+#define __can_send_now(session) (!(session)->write_event_enabled && (session)->buffer_list == NULL)
+
 int client_clone_and_send(generic_session_t *session, void *data, size_t size)
 {
     set_debug(session->server->config.debug);
 
     assert(data != NULL);
 
-    if (!session->write_event_enabled)
+    if (__can_send_now(session))
     {
         // try to send data immediately
         ssize_t bytes = send(session->fd, data, size, 0);
@@ -45,7 +186,8 @@ int client_clone_and_send(generic_session_t *session, void *data, size_t size)
     }
 
     debug_print("Cloning and sending data (%p, %zu)\n", data, size);
-    void *data_clone = malloc(size);
+    uint8_t small = size <= SMALL_PAYLOAD_SIZE;
+    void *data_clone = small ? slab_alloc(&session->server->payload_pool) : malloc(size);
     if (data_clone == NULL)
     {
         perror("Failed to allocate memory for data clone");
@@ -53,68 +195,277 @@ int client_clone_and_send(generic_session_t *session, void *data, size_t size)
     }
 
     memcpy(data_clone, data, size);
-    int res = __client_pass_ownership_and_send(session, data_clone, size);
+    int res = __client_pass_ownership_and_send(session, data_clone, size, small ? BUFFER_NODE_SMALL : BUFFER_NODE_MEMORY);
+    if (res < 0)
+    {
+        if (small)
+            slab_free(&session->server->payload_pool, data_clone);
+        else
+            free(data_clone);
+    }
+
     return res;
 }
 
 int client_pass_ownership_and_send(generic_session_t *session, void *data, size_t size)
 {
-    if (!session->write_event_enabled)
+    size_t sent = 0;
+    if (__can_send_now(session))
     {
         // try to send data immediately
         ssize_t bytes = send(session->fd, data, size, 0);
         if (bytes == size)
         {
+            free(data);
             return 0;
         }
 
-        if (bytes > 0 && bytes < size)
-        {
-            data += bytes;
-            size -= bytes;
-        }
+        if (bytes > 0)
+            sent = bytes;
     }
 
-    return __client_pass_ownership_and_send(session, data, size);
+    if (__client_pass_ownership_and_send(session, data, size, BUFFER_NODE_MEMORY) < 0)
+        return -1;
+
+    session->buffer_list_end->cursor = sent;
+    return 0;
 }
 
-int __client_pass_ownership_and_send(generic_session_t *session, void *data, size_t size)
+static int __client_pass_ownership_and_send(generic_session_t *session, void *data, size_t size, uint8_t type)
 {
     set_debug(session->server->config.debug);
-    assert(session->last_request_time != NULL);
 
     debug_print("Passing ownership and sending data (%p, %zu)\n", data, size);
 
-    struct buffer_list_node_t *node = malloc(sizeof(struct buffer_list_node_t));
+    struct buffer_list_node_t *node = slab_alloc(&session->server->node_pool);
     if (node == NULL)
     {
         perror("Failed to allocate memory for buffer list node");
         return -1;
     }
 
+    node->type = type;
     node->data = data;
+    node->shared = NULL;
+    node->file_fd = -1;
+    node->file_offset = 0;
+    node->size = size;
+    node->cursor = 0;
+
+    return __enqueue_node(session, node);
+}
+
+int client_send_file(generic_session_t *session, int fd, off_t offset, size_t size)
+{
+    set_debug(session->server->config.debug);
+
+    struct buffer_list_node_t *node = slab_alloc(&session->server->node_pool);
+    if (node == NULL)
+    {
+        perror("Failed to allocate memory for buffer list node");
+        close(fd);
+        return -1;
+    }
+
+    node->type = BUFFER_NODE_FILE;
+    node->data = NULL;
+    node->shared = NULL;
+    node->file_fd = fd;
+    node->file_offset = offset;
     node->size = size;
     node->cursor = 0;
+
+    if (__can_send_now(session))
+    {
+        // try to send data immediately
+        ssize_t bytes = __send_node(session, node);
+        if (bytes == size)
+        {
+            close(fd);
+            slab_free(&session->server->node_pool, node);
+            return 0;
+        }
+
+        if (bytes > 0)
+            node->cursor = bytes;
+    }
+
+    debug_print("Queued file (fd %d, offset %ld, size %zu, sent %zu)\n", fd, (long)offset, size, node->cursor);
+    return __enqueue_node(session, node);
+}
+
+int client_send_shared(generic_session_t *session, shared_buffer_t *buffer, size_t offset, size_t size)
+{
+    set_debug(session->server->config.debug);
+
+    assert(offset + size <= buffer->size);
+
+    char *data = (char *)buffer->data + offset;
+    size_t sent = 0;
+    if (__can_send_now(session))
+    {
+        // try to send data immediately
+        ssize_t bytes = send(session->fd, data, size, 0);
+        if (bytes == size)
+            return 0;
+
+        if (bytes > 0)
+            sent = bytes;
+    }
+
+    struct buffer_list_node_t *node = slab_alloc(&session->server->node_pool);
+    if (node == NULL)
+    {
+        perror("Failed to allocate memory for buffer list node");
+        return -1;
+    }
+
+    node->type = BUFFER_NODE_SHARED;
+    node->data = data;
+    node->shared = shared_buffer_acquire(buffer);
+    node->file_fd = -1;
+    node->file_offset = 0;
+    node->size = size;
+    node->cursor = sent;
+
+    debug_print("Queued shared buffer (%p, size %zu, sent %zu)\n", data, size, sent);
+    return __enqueue_node(session, node);
+}
+
+static int __enqueue_node(generic_session_t *session, struct buffer_list_node_t *node)
+{
+    assert(session->last_request_time != NULL);
+
     node->next = NULL;
     node->request_time = session->last_request_time;
     session->last_request_time = NULL;
 
-    if (session->buffer_list == NULL)
+    uint8_t was_empty = session->buffer_list == NULL;
+    if (was_empty)
         session->buffer_list = node;
     else
         session->buffer_list_end->next = node;
 
     session->buffer_list_end = node;
 
-    if (session->write_event_enabled == 0)
+    // a non empty list is already waiting for its write event,
+    // a deferred reply has nothing to send until it is completed
+    if (was_empty && session->write_event_enabled == 0 && node->type != BUFFER_NODE_DEFERRED)
+        __queue_write_fd(session);
+
+    return 0;
+}
+
+deferred_reply_t *client_defer_reply(generic_session_t *session)
+{
+    set_debug(session->server->config.debug);
+
+    deferred_reply_t *reply = (deferred_reply_t *)malloc(sizeof(deferred_reply_t));
+    if (reply == NULL)
+    {
+        perror("Failed to allocate memory for deferred reply");
+        return NULL;
+    }
+
+    struct buffer_list_node_t *node = slab_alloc(&session->server->node_pool);
+    if (node == NULL)
+    {
+        perror("Failed to allocate memory for buffer list node");
+        free(reply);
+        return NULL;
+    }
+
+    reply->refs = 2;
+    reply->server = session->server;
+    reply->session = session;
+    reply->node = node;
+    reply->buffer = NULL;
+    reply->next = NULL;
+
+    node->type = BUFFER_NODE_DEFERRED;
+    node->data = NULL;
+    node->shared = NULL;
+    node->reply = reply;
+    node->file_fd = -1;
+    node->file_offset = 0;
+    node->size = 0;
+    node->cursor = 0;
+
+    debug_print("Deferred reply (fd %d)\n", session->fd);
+    __enqueue_node(session, node);
+    return reply;
+}
+
+// worker thread only: the node of the reply becomes a shared buffer node, it is sent in its turn
+static void __apply_reply(socket_server_t *server, deferred_reply_t *reply)
+{
+    generic_session_t *session = reply->session;
+    if (session != NULL && reply->buffer == NULL)
+    {
+        // also frees the node of the reply
+        __close_session(server, session);
+    }
+    else if (session != NULL)
+    {
+        struct buffer_list_node_t *node = reply->node;
+        node->type = BUFFER_NODE_SHARED;
+        node->data = reply->buffer->data;
+        node->shared = reply->buffer;
+        node->reply = NULL;
+        node->size = reply->buffer->size;
+        reply->buffer = NULL;
+        reply->session = NULL;
+        __release_reply(reply); // the reference of the node
+
+        // the write loop stopped in front of the reply
+        if (session->buffer_list == node && session->write_event_enabled == 0)
+            __queue_write_fd(session);
+    }
+
+    __release_reply(reply);
+}
+
+void client_complete_reply(deferred_reply_t *reply, shared_buffer_t *buffer)
+{
+    socket_server_t *server = reply->server;
+    reply->buffer = buffer;
+
+    // closing the session could free it under the request that is being handled
+    if (buffer != NULL && pthread_equal(pthread_self(), server->thread))
     {
-        size_t next_write_fd = session->server->write_fd_queue_size;
+        __apply_reply(server, reply);
+        return;
+    }
+
+    pthread_mutex_lock(&server->reply_lock);
+    uint8_t was_empty = server->completed_replies == NULL;
+    reply->next = server->completed_replies;
+    server->completed_replies = reply;
+    pthread_mutex_unlock(&server->reply_lock);
+
+    // a single wake up for every reply completed before the worker drains them
+    char byte = 0;
+    if (was_empty && write(server->reply_pipe[1], &byte, 1) < 0 && errno != EAGAIN)
+        perror("Failed to wake up the worker");
+}
+
+static void __apply_completed_replies(socket_server_t *server)
+{
+    // drained before taking the list, a reply completed afterwards wakes the worker again
+    char bytes[64];
+    while (read(server->reply_pipe[0], bytes, sizeof(bytes)) > 0)
+        ;
 
-        write_fd_t *write_fd = &(session->server->write_fd_queue[next_write_fd]);
-        write_fd->fd = session->fd;
-        write_fd->session = session;
+    pthread_mutex_lock(&server->reply_lock);
+    deferred_reply_t *reply = server->completed_replies;
+    server->completed_replies = NULL;
+    pthread_mutex_unlock(&server->reply_lock);
 
-        session->server->write_fd_queue_size = next_write_fd + 1;
+    while (reply != NULL)
+    {
+        deferred_reply_t *next = reply->next;
+        __apply_reply(server, reply);
+        reply = next;
     }
 }
 
@@ -186,13 +537,92 @@ int socket_server_init(socket_server_t *server, socket_server_config_t config)
         return -1;
     }
 
+    slab_init(&server->session_pool, config.session_size, 64);
+    slab_init(&server->node_pool, sizeof(struct buffer_list_node_t), 256);
+    slab_init(&server->time_pool, sizeof(struct timespec), 256);
+    slab_init(&server->payload_pool, SMALL_PAYLOAD_SIZE, 256);
+
+    server->completed_replies = NULL;
+    if (pthread_mutex_init(&server->reply_lock, NULL) != 0)
+    {
+        close(server_socket);
+        free(server->write_fd_queue);
+        perror("Failed to initialize reply lock");
+        return -1;
+    }
+
+    if (pipe(server->reply_pipe) < 0)
+    {
+        close(server_socket);
+        free(server->write_fd_queue);
+        pthread_mutex_destroy(&server->reply_lock);
+        perror("Failed to create reply pipe");
+        return -1;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(server->reply_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(server->reply_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    server->stream_pipe[0] = -1;
+    server->stream_pipe[1] = -1;
+    server->stream_pipe_size = 0;
+#if defined(__linux__)
+    if (pipe2(server->stream_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        close(server_socket);
+        free(server->write_fd_queue);
+        close(server->reply_pipe[0]);
+        close(server->reply_pipe[1]);
+        pthread_mutex_destroy(&server->reply_lock);
+        perror("Failed to create stream pipe");
+        return -1;
+    }
+
+    // bigger pipes mean fewer splice calls, the default size is used if the limit is lower
+    fcntl(server->stream_pipe[1], F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+    int pipe_size = fcntl(server->stream_pipe[1], F_GETPIPE_SZ);
+    server->stream_pipe_size = pipe_size > 0 ? pipe_size : 64 * 1024;
+#endif
+
     return 0;
 }
 
 void socket_server_destroy(socket_server_t *server)
 {
+    if (server->stream_pipe[0] != -1)
+    {
+        close(server->stream_pipe[0]);
+        close(server->stream_pipe[1]);
+        server->stream_pipe[0] = -1;
+        server->stream_pipe[1] = -1;
+    }
+
     free(server->write_fd_queue);
     server->write_fd_queue = NULL;
+
+    // completed after the worker stopped, the replies still queued on open sessions go with them
+    deferred_reply_t *reply = server->completed_replies;
+    while (reply != NULL)
+    {
+        deferred_reply_t *next = reply->next;
+        __release_reply(reply);
+        reply = next;
+    }
+
+    server->completed_replies = NULL;
+    close(server->reply_pipe[0]);
+    close(server->reply_pipe[1]);
+    pthread_mutex_destroy(&server->reply_lock);
+
+    // also the sessions still open when the server stopped
+    slab_destroy(&server->session_pool);
+    slab_destroy(&server->node_pool);
+    slab_destroy(&server->time_pool);
+    slab_destroy(&server->payload_pool);
+
     server->listening = 0;
     server->stop_server = 1;
     event_loop_destroy(&server->loop);
@@ -224,6 +654,181 @@ int socket_server_stop(socket_server_t *server)
     return 0;
 }
 
+// a session in readiness mode waits for EVENT_READ, the other modes get EVENT_RECV completions
+#define __rx_events(session) ((session)->rx_mode == RX_MODE_READINESS ? EVENT_READ : 0)
+
+static generic_session_t *__accept_client(socket_server_t *server, int client_socket)
+{
+    set_debug(server->config.debug);
+
+    event_loop_t *loop = &server->loop;
+    uint8_t completions = event_loop_completions(loop);
+
+    generic_session_t *c_session = slab_alloc(&server->session_pool);
+    if (c_session == NULL)
+    {
+        printf("Failed to allocate client session\n");
+        close(client_socket);
+        return NULL;
+    }
+
+    memset(c_session, 0, server->config.session_size);
+    if (event_loop_add(loop, client_socket, completions ? 0 : EVENT_READ, 0, (void **)c_session) < 0)
+    {
+        printf("Failed to add client socket to event loop\n");
+        slab_free(&server->session_pool, c_session);
+        close(client_socket);
+        return NULL;
+    }
+
+    c_session->server = server;
+    c_session->write_event_enabled = 0;
+    c_session->buffer_list = NULL;
+    c_session->buffer_list_end = NULL;
+    c_session->last_request_time = NULL;
+    c_session->buffer = NULL;
+    c_session->rx_buffer = NULL;
+    c_session->rx_size = 0;
+    c_session->rx_stream_fd = -1;
+    c_session->rx_stream_remaining = 0;
+    c_session->rx_stream_direct = 0;
+    c_session->rx_staging = NULL;
+    c_session->rx_staged = 0;
+    c_session->rx_mode = RX_MODE_READINESS;
+
+    if (completions)
+    {
+        if (event_loop_recv_multishot(loop, client_socket) < 0)
+        {
+            printf("Failed to start receiving from client socket\n");
+            event_loop_delete(loop, client_socket);
+            close(client_socket);
+            slab_free(&server->session_pool, c_session);
+            return NULL;
+        }
+
+        c_session->rx_mode = RX_MODE_MULTISHOT;
+    }
+
+    debug_print("(fd %d) Accepted client from: %d\n", client_socket, server->fd);
+    return c_session;
+}
+
+static void __close_session(socket_server_t *server, generic_session_t *session)
+{
+    slab_free(&server->time_pool, session->last_request_time);
+    __forget_write_fd(server, session);
+    __free_buffer_list(session);
+    client_cleanup(session);
+    event_loop_delete(&server->loop, session->fd);
+    close(session->fd);
+    free(session->rx_buffer);
+    free(session->rx_staging);
+    slab_free(&server->session_pool, session);
+}
+
+// back to EVENT_RECV completions once a spliced stream is over
+static int __resume_multishot(socket_server_t *server, generic_session_t *session)
+{
+    if (session->rx_mode != RX_MODE_READINESS)
+        return 0;
+
+    if (event_loop_recv_multishot(&server->loop, session->fd) < 0)
+        return -1;
+
+    session->rx_mode = RX_MODE_MULTISHOT;
+    return event_loop_modify(&server->loop, session->fd, session->write_event_enabled ? EVENT_WRITE : 0, session);
+}
+
+// data of a multishot recv: stream bytes go to their file, the rest is framed as in __handle_write_event
+static int __handle_received(socket_server_config_t *config, generic_session_t *session, const char *data, size_t size)
+{
+    if (session->rx_buffer == NULL)
+    {
+        session->rx_buffer = malloc(config->max_message_size);
+        if (session->rx_buffer == NULL)
+        {
+            perror("Failed to allocate receive buffer");
+            return -1;
+        }
+
+        session->rx_size = 0;
+    }
+
+    while (size > 0)
+    {
+        if (session->rx_stream_remaining > 0)
+        {
+            size_t n = size < session->rx_stream_remaining ? size : session->rx_stream_remaining;
+            if (__stream_write(session, data, n) < 0)
+                return -1;
+
+            data += n;
+            size -= n;
+            session->rx_stream_remaining -= n;
+            if (session->rx_stream_remaining == 0 && __end_stream(session) != 0)
+                return -1;
+
+            continue;
+        }
+
+        size_t n = config->max_message_size - session->rx_size;
+        if (n > size)
+            n = size;
+
+        memcpy(session->rx_buffer + session->rx_size, data, n);
+        session->rx_size += n;
+        data += n;
+        size -= n;
+
+        if (__handle_frames(config, session) != 0)
+            return -1;
+
+        assert(session->rx_size < config->max_message_size);
+    }
+
+    return 0;
+}
+
+// returns 0 on success, -1 on error, -2 on EOF
+static int __handle_recv_event(socket_server_config_t *config, generic_session_t *session, event_t *event)
+{
+    set_debug(config->debug);
+
+    socket_server_t *server = session->server;
+    if (event->res == 0)
+        return -2;
+
+    if (event->res < 0 && event->res != -ECANCELED)
+    {
+        debug_print("fd(%d) recv failed: %s\n", session->fd, strerror(-event->res));
+        return event->res == -ECONNRESET ? -2 : -1;
+    }
+
+    if (event->res > 0 && __handle_received(config, session, event->buf, event->res) < 0)
+        return -1;
+
+    if (event->flags & EVENT_DONE)
+    {
+        // the recv has been stopped to splice a large stream, the rest comes with EVENT_READ
+        session->rx_mode = RX_MODE_READINESS;
+        if (session->rx_stream_remaining == 0)
+            return __resume_multishot(server, session);
+
+        return event_loop_modify(&server->loop, session->fd, EVENT_READ | (session->write_event_enabled ? EVENT_WRITE : 0), session);
+    }
+
+    if (session->rx_mode == RX_MODE_MULTISHOT && session->rx_stream_remaining >= STREAM_SPLICE_MIN_SIZE)
+    {
+        if (event_loop_recv_cancel(&server->loop, session->fd) < 0)
+            return -1;
+
+        session->rx_mode = RX_MODE_STOPPING;
+    }
+
+    return 0;
+}
+
 int socket_server_run(socket_server_t *server)
 {
     set_debug(server->config.debug);
@@ -274,8 +879,21 @@ int socket_server_run(socket_server_t *server)
     //     return -1;
     // }
 
+    // with completions new connections and their data come as EVENT_ACCEPT / EVENT_RECV
+    uint8_t completions = event_loop_completions(loop);
+    debug_print("Event loop completions: %d\n", completions);
+
     generic_session_t server_session = {0};
-    if (event_loop_add(loop, server_socket, EVENT_READ, 0, (void *)&server_session) == -1)
+    if (event_loop_add(loop, server_socket, completions ? 0 : EVENT_READ, 0, (void *)&server_session) == -1 ||
+        (completions && event_loop_accept_multishot(loop, server_socket) == -1))
+    {
+        perror("event_loop_add");
+        return -1;
+    }
+
+    server->thread = pthread_self();
+    memset(&server->reply_session, 0, sizeof(generic_session_t));
+    if (event_loop_add(loop, server->reply_pipe[0], EVENT_READ, 0, (void *)&server->reply_session) == -1)
     {
         perror("event_loop_add");
         return -1;
@@ -292,7 +910,7 @@ int socket_server_run(socket_server_t *server)
             {
                 write_fd_t sock = server->write_fd_queue[i];
                 void *data = (void *)sock.session;
-                event_loop_modify(loop, sock.fd, EVENT_WRITE | EVENT_READ, (void *)sock.session);
+                event_loop_modify(loop, sock.fd, EVENT_WRITE | __rx_events(sock.session), (void *)sock.session);
                 // todo handle error
                 sock.session->write_event_enabled = 1;
             }
@@ -301,7 +919,7 @@ int socket_server_run(socket_server_t *server)
             server->write_fd_queue_size = 0;
         }
 
-        int n = event_loop_wait(loop, events, 1024, event_loop_timeout);
+        int n = event_loop_wait(loop, events, max_events, event_loop_timeout);
         if (n == -1)
         {
             if (errno == EINTR)
@@ -319,8 +937,24 @@ int socket_server_run(socket_server_t *server)
 
         for (int i = 0; i < n; i++)
         {
+            // dropped by event_loop_delete, the session has been closed by a previous event
+            if (events[i].events == 0)
+                continue;
+
             generic_session_t *session = (generic_session_t *)events[i].data;
             assert(session != NULL);
+            if (session == &server->reply_session)
+            {
+                __apply_completed_replies(server);
+                continue;
+            }
+
+            if (events[i].events & EVENT_ACCEPT)
+            {
+                __accept_client(server, events[i].res);
+                continue;
+            }
+
             if (session->fd == server_socket)
             {
                 int client_socket = accept(server_socket, NULL, NULL);
@@ -341,21 +975,19 @@ int socket_server_run(socket_server_t *server)
                     continue;
                 }
 
-                generic_session_t *c_session = NULL;
-                if (event_loop_add(loop, client_socket, EVENT_READ, session_size, (void **)&c_session) < 0)
+                __accept_client(server, client_socket);
+                continue;
+            }
+
+            if (events[i].events & EVENT_RECV)
+            {
+                int res = __handle_recv_event(&(server->config), session, &events[i]);
+                if (res < 0)
                 {
-                    printf("Failed to add client socket to event loop\n");
-                    close(client_socket);
-                    continue;
+                    debug_print("Closing session after recv completion (%d)\n", res);
+                    __close_session(server, session);
                 }
 
-                c_session->server = server;
-                c_session->write_event_enabled = 0;
-                c_session->buffer_list = NULL;
-                c_session->buffer_list_end = NULL;
-                c_session->last_request_time = NULL;
-
-                debug_print("[%d, %d / %d] (fd %d) Accepted client from: %d\n", wait_counter, i + 1, n, client_socket, server_socket);
                 continue;
             }
 
@@ -365,23 +997,6 @@ int socket_server_run(socket_server_t *server)
                 uint8_t should_close = 0;
 
                 generic_session_t *session = (generic_session_t *)events[i].data;
-                if (session->last_request_time == NULL)
-                {
-                    struct timespec *now = malloc(sizeof(struct timespec));
-                    if (now == NULL)
-                    {
-                        perror("Failed to allocate memory for timespec");
-                        should_close = 1;
-                    }
-                    else
-                    {
-                        clock_gettime(CLOCK_MONOTONIC, now);
-                        // todo handle error
-                        session->last_request_time = now;
-                    }
-                }
-
-                // todo handle error
                 int res = __handle_write_event(&(server->config), &events[i]);
                 if (res == -1)
                 {
@@ -397,11 +1012,15 @@ int socket_server_run(socket_server_t *server)
 
                 if (should_close)
                 {
-                    free(session->last_request_time);
-                    client_cleanup(session);
-                    event_loop_delete(loop, session->fd);
-                    close(session->fd);
-                    free(events[i].data);
+                    __close_session(server, session);
+                    continue; // the session is gone, skip its write event
+                }
+
+                // a large stream has been spliced, go back to the multishot recv
+                if (completions && session->rx_stream_remaining == 0 && __resume_multishot(server, session) < 0)
+                {
+                    __close_session(server, session);
+                    continue;
                 }
             }
 
@@ -413,12 +1032,12 @@ int socket_server_run(socket_server_t *server)
                 debug_print("session->write_event_enabled: %d\n", session->write_event_enabled);
 
                 int err = 0;
-                while (session->buffer_list != NULL)
+                // a deferred reply stops the queue until it is completed
+                while (session->buffer_list != NULL && session->buffer_list->type != BUFFER_NODE_DEFERRED)
                 {
                     struct buffer_list_node_t *node = session->buffer_list;
-                    void *data = node->data + node->cursor;
                     size_t remaining = node->size - node->cursor;
-                    ssize_t bytes = send(session->fd, data, remaining, 0);
+                    ssize_t bytes = __send_node(session, node);
                     if (bytes < 0)
                     {
                         if (errno == ECONNRESET || errno == EPIPE)
@@ -454,17 +1073,16 @@ int socket_server_run(socket_server_t *server)
                     fprintf(metrics_fd, "%ld,%ld,%ld,%ld\n", request_time->tv_sec, request_time->tv_nsec, now.tv_sec, now.tv_nsec);
                     // printf("Metrics: %ld,%ld,%ld,%ld\n", request_time->tv_sec, request_time->tv_nsec, now.tv_sec, now.tv_nsec);
 
-                    free(node->request_time);
-                    free(node->data);
-                    free(node);
+                    __free_node(server, node);
                 }
 
-                if (session->buffer_list == NULL)
+                if (session->buffer_list == NULL || session->buffer_list->type == BUFFER_NODE_DEFERRED)
                 {
-                    event_loop_modify(loop, session->fd, EVENT_READ, (void *)session);
+                    event_loop_modify(loop, session->fd, __rx_events(session), (void *)session);
                     // todo handle error
                     session->write_event_enabled = 0;
-                    session->buffer_list_end = NULL;
+                    if (session->buffer_list == NULL)
+                        session->buffer_list_end = NULL;
                 }
             }
         }
@@ -500,130 +1118,415 @@ buffer_t *cast_to_buffer(char *data, size_t raw_capacity, size_t target_capacity
     return buffer;
 }
 
-__thread char gbuffer[2048] = {0};
-int __handle_write_event(socket_server_config_t *config, event_t *event)
+// Frames are a 4 bytes big endian size (prefix included) followed by the packet.
+// Every session owns a single receive buffer of max_message_size bytes, allocated on its first read:
+// complete frames are handled in place, only the trailing partial frame is moved back to its start.
+#define FRAME_PREFIX_SIZE sizeof(uint32_t)
+#define FRAME_MIN_SIZE (FRAME_PREFIX_SIZE + sizeof(uint16_t)) // prefix + packet type
+
+// returns the size of the frame at data, 0 if the prefix is not complete, -1 if it is malformed
+static ssize_t __frame_size(socket_server_config_t *config, const char *data, size_t available)
 {
+    if (available < FRAME_PREFIX_SIZE)
+        return 0;
+
+    uint32_t message_size;
+    memcpy(&message_size, data, sizeof(message_size));
+    message_size = ntohl(message_size);
+    if (message_size < FRAME_MIN_SIZE || message_size > config->max_message_size)
+        return -1;
 
+    return message_size;
+}
+
+// hands every complete frame of the receive buffer to handle_packet_event, returns its error code
+static int __handle_frames(socket_server_config_t *config, generic_session_t *session)
+{
     set_debug(config->debug);
-    debug_print("Handling write event, data PTR: %p\n", event->data);
-    assert(event->data != NULL);
 
-    generic_session_t *session = (generic_session_t *)event->data;
-    ssize_t bytes = recv(session->fd, gbuffer, 2048, 0);
-    if (bytes < 0)
+    size_t cursor = 0;
+    int err = 0;
+    while (err == 0)
     {
-        if (errno == ECONNRESET || errno == EPIPE)
+        if (session->rx_stream_remaining > 0)
         {
-            debug_print("Client disconnected\n");
-            return -2;
+            // the client did not wait for the stream to start, write what is already here
+            size_t n = session->rx_size - cursor;
+            if (n > session->rx_stream_remaining)
+                n = session->rx_stream_remaining;
+
+            if (__stream_write(session, session->rx_buffer + cursor, n) < 0)
+                return -1;
+
+            cursor += n;
+            session->rx_stream_remaining -= n;
+            if (session->rx_stream_remaining > 0)
+                break;
+
+            err = __end_stream(session);
+            continue;
+        }
+
+        char *frame = session->rx_buffer + cursor;
+        ssize_t message_size = __frame_size(config, frame, session->rx_size - cursor);
+        if (message_size < 0)
+        {
+            debug_print("fd(%d) Invalid message size\n", session->fd);
+            return -1;
+        }
+
+        if (message_size == 0 || (size_t)message_size > session->rx_size - cursor)
+            break;
+
+        // a previous frame may have queued a reply with the last stamp
+        if (__stamp_request(session) < 0)
+            return -1;
+
+        // the packet is parsed in place, session->buffer is only a view valid during the call
+        struct raw_buffer_t packet = {
+            .size = message_size - FRAME_PREFIX_SIZE,
+            .capacity = message_size - FRAME_PREFIX_SIZE,
+            .type = 1,
+            .__data = frame + FRAME_PREFIX_SIZE,
+        };
+
+        session->buffer = (buffer_t *)&packet;
+        err = handle_packet_event(session);
+        session->buffer = NULL;
+        cursor += message_size;
+    }
+
+    if (cursor > 0)
+    {
+        session->rx_size -= cursor;
+        memmove(session->rx_buffer, session->rx_buffer + cursor, session->rx_size);
+    }
+
+    return err;
+}
+
+void client_receive_to_file(generic_session_t *session, int fd, size_t size)
+{
+    assert(session->rx_stream_remaining == 0);
+    session->rx_stream_fd = fd;
+    session->rx_stream_remaining = size;
+    session->rx_stream_direct = 0;
+}
+
+int client_receive_to_direct_file(generic_session_t *session, int fd, const void *prefix, size_t prefix_size, size_t size)
+{
+    assert(session->rx_stream_remaining == 0);
+    assert(prefix_size <= STREAM_STAGING_SIZE);
+
+    if (session->rx_staging == NULL)
+    {
+        void *staging = NULL;
+        int err = posix_memalign(&staging, STREAM_DIRECT_ALIGNMENT, STREAM_STAGING_SIZE);
+        if (err != 0)
+        {
+            errno = err;
+            perror("Failed to allocate stream staging buffer");
+            return -1;
+        }
+
+        session->rx_staging = staging;
+    }
+
+    memcpy(session->rx_staging, prefix, prefix_size);
+    session->rx_staged = prefix_size;
+    session->rx_stream_offset = 0;
+    session->rx_stream_fd = fd;
+    session->rx_stream_remaining = size;
+    session->rx_stream_direct = 1;
+    return 0;
+}
+
+static int __write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to write stream data");
+            return -1;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    return 0;
+}
+
+static int __pwrite_all(int fd, const char *data, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to write stream data");
+            return -1;
         }
 
-        debug_print("Failed to read data\n");
+        data += written;
+        size -= written;
+        offset += written;
+    }
+
+    return 0;
+}
+
+// writes the staged bytes, only a final flush can write a block that is not full
+static int __flush_staging(generic_session_t *session, uint8_t final)
+{
+    size_t aligned = session->rx_staged & ~((size_t)STREAM_DIRECT_ALIGNMENT - 1);
+    if (__pwrite_all(session->rx_stream_fd, session->rx_staging, aligned, session->rx_stream_offset) < 0)
         return -1;
+
+    size_t tail = session->rx_staged - aligned;
+    if (tail > 0)
+    {
+        assert(final);
+
+        // O_DIRECT can only write whole blocks, the end of the file goes through the page cache
+        int flags = fcntl(session->rx_stream_fd, F_GETFL);
+        if (flags == -1)
+        {
+            perror("Failed to get stream file flags");
+            return -1;
+        }
+
+#if defined(O_DIRECT)
+        flags &= ~O_DIRECT;
+#endif
+        if (fcntl(session->rx_stream_fd, F_SETFL, flags) == -1 ||
+            __pwrite_all(session->rx_stream_fd, session->rx_staging + aligned, tail, session->rx_stream_offset + aligned) < 0)
+        {
+            perror("Failed to write the end of the stream");
+            return -1;
+        }
     }
 
-    char ack = 1;
-    send(session->fd, &ack, sizeof(ack), 0);
+    session->rx_stream_offset += session->rx_staged;
+    session->rx_staged = 0;
     return 0;
+}
 
-    // if (session->buffer == NULL)
-    // {
-    //     uint32_t message_size;
-    //     ssize_t bytes = recv(session->fd, &message_size, sizeof(message_size), MSG_PEEK);
-    //     if (bytes < 0)
-    //     {
-    //         if (errno == ECONNRESET || errno == EPIPE)
-    //         {
-    //             debug_print("Client disconnected\n");
-    //             return -2;
-    //         }
-
-    //         debug_print("Failed to peek message size - %s - fd: (%d) \n", strerror(errno), session->fd);
-    //         return -1;
-    //     }
-
-    //     if (bytes == 0)
-    //     {
-    //         return -2;
-    //     }
-
-    //     if ((size_t)bytes < sizeof(message_size))
-    //     {
-    //         debug_print("fd(%d) Not enough data to read message size: MSG_PEEK: %zd, sizeof(message_size): %zu\n", session->fd, bytes, sizeof(message_size));
-    //         return 0;
-    //     }
-
-    //     if (recv(session->fd, &message_size, sizeof(message_size), 0) != sizeof(message_size))
-    //     {
-    //         debug_print("Failed to read message size - %s - fd: (%d) \n", strerror(errno), session->fd);
-    //         return -1;
-    //     }
-
-    //     message_size = ntohl(message_size);
-    //     debug_print("Received message size: %d\n", message_size);
-    //     if (message_size > config->max_message_size)
-    //     {
-    //         debug_print("Message size exceeds max_message_size\n");
-    //         return -1;
-    //     }
-
-    //     session->buffer = allocate_buffer(message_size - sizeof(uint32_t));
-    //     // session->buffer = cast_to_buffer(gbuffer, 2048, message_size - sizeof(uint32_t));
-    //     // session->buffer = convert_to_buffer(gbuffer, message_size - sizeof(uint32_t));
-
-    //     if (session->buffer == NULL)
-    //     {
-    //         debug_print("Failed to allocate buffer\n");
-    //         return -1;
-    //     }
-
-    //     debug_print("buffer size: %zu, capacity: %zu, ptr: %p\n", session->buffer->size, session->buffer->capacity, session->buffer);
-
-    //     return 0;
-    // }
+static int __stream_write(generic_session_t *session, const char *data, size_t size)
+{
+    if (!session->rx_stream_direct)
+        return __write_all(session->rx_stream_fd, data, size);
+
+    while (size > 0)
+    {
+        size_t n = STREAM_STAGING_SIZE - session->rx_staged;
+        if (n > size)
+            n = size;
 
-    // buffer_t *buffer = session->buffer;
+        memcpy(session->rx_staging + session->rx_staged, data, n);
+        session->rx_staged += n;
+        data += n;
+        size -= n;
 
-    // ssize_t bytes = recv(session->fd, buffer_next(buffer), buffer_remaining(buffer), 0);
-    // if (bytes == 0)
-    // {
-    //     return -2;
-    // }
-    // if (bytes == -1)
-    // {
-    //     if (errno == ECONNRESET || errno == EPIPE)
-    //     {
-    //         debug_print("Client disconnected\n");
-    //         return -2;
-    //     }
-
-    //     if (errno == EAGAIN || errno == EWOULDBLOCK)
-    //     {
-    //         debug_print("No more data to read, bytes: %zd, buff[%zd/%zd]\n", bytes, buffer->size, buffer->capacity);
-    //         return 0;
-    //     }
-
-    //     debug_print("Failed to read data\n");
-    //     return -1;
-    // }
+        if (session->rx_staged == STREAM_STAGING_SIZE && __flush_staging(session, 0) < 0)
+            return -1;
+    }
 
-    // buffer->size += bytes;
-    // debug_print("ptr: %p, data ptr: %p buffer size: %zu, capacity: %zu, buffer_full: %d, buffer_next: %p, buffer_remaining: %zu\n",
-    //             buffer,
-    //             buffer_ptr(buffer),
-    //             buffer->size,
-    //             buffer->capacity,
-    //             buffer_full(buffer),
-    //             buffer_next(buffer),
-    //             buffer_remaining(buffer));
-
-    // if (buffer_full(buffer))
-    // {
-    //     int err = handle_packet_event(session);
-    //     return err;
-    // }
+    return 0;
+}
+
+static int __end_stream(generic_session_t *session)
+{
+    if (session->rx_stream_direct)
+    {
+        session->rx_stream_direct = 0;
+        if (__flush_staging(session, 1) < 0)
+            return -1;
+    }
+
+    return handle_stream_end(session);
+}
+
+// O_DIRECT streams are received straight into the staging buffer
+static int __receive_direct_stream(generic_session_t *session)
+{
+    while (session->rx_stream_remaining > 0)
+    {
+        size_t len = STREAM_STAGING_SIZE - session->rx_staged;
+        if (len > session->rx_stream_remaining)
+            len = session->rx_stream_remaining;
+
+        ssize_t bytes = recv(session->fd, session->rx_staging + session->rx_staged, len, 0);
+        if (bytes == 0)
+            return -2;
+
+        if (bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            if (errno == EINTR)
+                continue;
+
+            if (errno == ECONNRESET || errno == EPIPE)
+                return -2;
+
+            perror("Failed to receive stream data");
+            return -1;
+        }
+
+        session->rx_staged += bytes;
+        session->rx_stream_remaining -= bytes;
+        if (session->rx_staged == STREAM_STAGING_SIZE && __flush_staging(session, 0) < 0)
+            return -1;
+    }
+
+    return __end_stream(session) == 0 ? 1 : -1;
+}
+
+#if defined(__linux__)
+// moves size bytes already in the pipe to fd, on failure the pipe is emptied so that it can be reused
+static int __splice_to_file(socket_server_t *server, int fd, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t moved = splice(server->stream_pipe[0], NULL, fd, NULL, size, SPLICE_F_MOVE);
+        if (moved <= 0)
+        {
+            if (moved < 0 && errno == EINTR)
+                continue;
+
+            perror("Failed to splice stream data to file");
+            char discard[4096];
+            while (read(server->stream_pipe[0], discard, sizeof(discard)) > 0)
+                ;
+            return -1;
+        }
+
+        size -= moved;
+    }
+
+    return 0;
+}
+#endif
+
+// moves the remaining stream bytes from the socket to the stream fd
+// returns 0 when the socket has been drained, 1 when the stream is complete, -1 on error, -2 on EOF
+static int __receive_stream(socket_server_config_t *config, generic_session_t *session)
+{
+    if (session->rx_stream_direct)
+        return __receive_direct_stream(session);
+
+    socket_server_t *server = session->server;
+    while (session->rx_stream_remaining > 0)
+    {
+#if defined(__linux__)
+        size_t len = session->rx_stream_remaining < server->stream_pipe_size ? session->rx_stream_remaining : server->stream_pipe_size;
+        ssize_t bytes = splice(session->fd, NULL, server->stream_pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+        // nothing is buffered while streaming, the receive buffer is free
+        size_t len = session->rx_stream_remaining < config->max_message_size ? session->rx_stream_remaining : config->max_message_size;
+        ssize_t bytes = recv(session->fd, session->rx_buffer, len, 0);
+#endif
+        if (bytes == 0)
+            return -2;
+
+        if (bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            if (errno == EINTR)
+                continue;
+
+            if (errno == ECONNRESET || errno == EPIPE)
+                return -2;
+
+            perror("Failed to receive stream data");
+            return -1;
+        }
+
+#if defined(__linux__)
+        if (__splice_to_file(server, session->rx_stream_fd, bytes) < 0)
+            return -1;
+#else
+        if (__write_all(session->rx_stream_fd, session->rx_buffer, bytes) < 0)
+            return -1;
+#endif
+
+        session->rx_stream_remaining -= bytes;
+    }
+
+    return __end_stream(session) == 0 ? 1 : -1;
+}
+
+int __handle_write_event(socket_server_config_t *config, event_t *event)
+{
+    set_debug(config->debug);
+    assert(event->data != NULL);
+
+    generic_session_t *session = (generic_session_t *)event->data;
+    if (session->rx_buffer == NULL)
+    {
+        session->rx_buffer = malloc(config->max_message_size);
+        if (session->rx_buffer == NULL)
+        {
+            perror("Failed to allocate receive buffer");
+            return -1;
+        }
+
+        session->rx_size = 0;
+    }
+
+    // drain the socket, a single event can carry many frames and the end of a partial one
+    while (1)
+    {
+        if (session->rx_stream_remaining > 0)
+        {
+            assert(session->rx_size == 0);
+            int res = __receive_stream(config, session);
+            if (res <= 0)
+                return res;
+        }
+
+        ssize_t bytes = recv(session->fd, session->rx_buffer + session->rx_size, config->max_message_size - session->rx_size, 0);
+        if (bytes == 0)
+            return -2;
+
+        if (bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            if (errno == EINTR)
+                continue;
 
-    // return 0;
+            if (errno == ECONNRESET || errno == EPIPE)
+            {
+                debug_print("Client disconnected\n");
+                return -2;
+            }
+
+            debug_print("Failed to read data - %s - fd: (%d)\n", strerror(errno), session->fd);
+            return -1;
+        }
+
+        session->rx_size += bytes;
+        if (__handle_frames(config, session) != 0)
+            return -1;
+
+        // a full buffer without a complete frame would never make progress,
+        // __frame_size already rejected frames larger than the buffer
+        assert(session->rx_size < config->max_message_size);
+    }
 }
 
 int parallel_socket_server_init(parallel_socket_server_t *server, int num_threads, socket_server_config_t config)
@@ -22,12 +22,37 @@
 #include "event_loop.h"
 #include "buffer.h"
 #include "debug.h"
+#include "shared_buffer.h"
+#include "slab.h"
 
 #define MAX_PENDING_WRITES 2048
+#define STREAM_PIPE_SIZE (1024 * 1024) // requested size of the per worker pipe used by client_receive_to_file
+#define STREAM_DIRECT_ALIGNMENT 4096
+#define STREAM_STAGING_SIZE (1024 * 1024) // multiple of STREAM_DIRECT_ALIGNMENT
+#define SMALL_PAYLOAD_SIZE 64 // client_clone_and_send copies up to this size come from the worker payload pool
+#define STREAM_SPLICE_MIN_SIZE (1024 * 1024) // smaller streams keep using the multishot recv (io_uring backend)
+
+// how a session receives data
+#define RX_MODE_READINESS 0 // EVENT_READ + recv/splice
+#define RX_MODE_MULTISHOT 1 // EVENT_RECV completions, only with event_loop_completions
+#define RX_MODE_STOPPING 2  // multishot recv cancelled, waiting for its last completion
+
+#define BUFFER_NODE_MEMORY 0 // data is owned by the node and freed once sent
+#define BUFFER_NODE_FILE 1   // size bytes of file_fd starting at file_offset, drained with sendfile
+#define BUFFER_NODE_SHARED 2 // size bytes of shared starting at data, the node holds a reference
+#define BUFFER_NODE_SMALL 3  // data belongs to the worker payload pool
+#define BUFFER_NODE_DEFERRED 4 // placeholder of a reply produced by another thread, see client_defer_reply
+
+typedef struct deferred_reply deferred_reply_t;
 
 struct buffer_list_node_t
 {
+    uint8_t type;
     void *data;
+    shared_buffer_t *shared;
+    deferred_reply_t *reply; // BUFFER_NODE_DEFERRED only
+    int file_fd; // owned by the node, closed once sent
+    off_t file_offset;
     size_t size;
     size_t cursor;
     struct timespec *request_time;
@@ -36,14 +61,23 @@ struct buffer_list_node_t
 
 struct socket_server;
 
-#define GENERIC_SESSION_FIELDS              \
-    int fd;                                 \
-    buffer_t *buffer;                       \
-    struct timespec *last_request_time;     \
-    struct socket_server *server;           \
-    uint8_t write_event_enabled;            \
-    struct buffer_list_node_t *buffer_list; \
-    struct buffer_list_node_t *buffer_list_end;
+#define GENERIC_SESSION_FIELDS                                                 \
+    int fd;                                                                    \
+    buffer_t *buffer;                                                          \
+    struct timespec *last_request_time;                                        \
+    struct socket_server *server;                                              \
+    uint8_t write_event_enabled;                                               \
+    struct buffer_list_node_t *buffer_list;                                    \
+    struct buffer_list_node_t *buffer_list_end;                                \
+    char *rx_buffer; /* max_message_size bytes, allocated on the first read */ \
+    size_t rx_size;                                                            \
+    int rx_stream_fd; /* not owned, see client_receive_to_file */              \
+    size_t rx_stream_remaining;                                                \
+    uint8_t rx_stream_direct;                                                  \
+    off_t rx_stream_offset; /* file offset of rx_staging */                    \
+    char *rx_staging; /* aligned, allocated by the first O_DIRECT stream */    \
+    size_t rx_staged;                                                          \
+    uint8_t rx_mode;
 
 typedef struct
 {
@@ -78,6 +112,23 @@ typedef struct socket_server
 
     size_t write_fd_queue_size;
     write_fd_t *write_fd_queue;
+
+    // socket -> pipe -> file, used to receive streams without copying them in user space
+    int stream_pipe[2];
+    size_t stream_pipe_size;
+
+    // replies completed by other threads (see client_complete_reply), the worker is woken up through reply_pipe
+    pthread_t thread;
+    pthread_mutex_t reply_lock;
+    deferred_reply_t *completed_replies; // protected by reply_lock
+    int reply_pipe[2];
+    generic_session_t reply_session; // event loop data of reply_pipe[0]
+
+    // recycled without going through malloc, used only by the worker thread
+    slab_t session_pool; // config.session_size
+    slab_t node_pool;    // struct buffer_list_node_t
+    slab_t time_pool;    // struct timespec of the pending requests
+    slab_t payload_pool; // SMALL_PAYLOAD_SIZE bytes
 } socket_server_t;
 
 typedef struct
@@ -99,11 +150,34 @@ int parallel_socket_server_stop(parallel_socket_server_t *server);
 void parallel_socket_server_destroy(parallel_socket_server_t *server);
 
 int handle_packet_event(generic_session_t *session);
+// Called once the last byte of a stream started with client_receive_to_file has been written
+int handle_stream_end(generic_session_t *session);
 void client_cleanup(generic_session_t *session);
 void on_next_iteration();
 
 int client_clone_and_send(generic_session_t *session, void *data, size_t size);
 int client_pass_ownership_and_send(generic_session_t *session, void *data, size_t size);
+// Sends size bytes of the file starting at offset without copying them in user space,
+// fd is owned by the server from now on (also on failure)
+int client_send_file(generic_session_t *session, int fd, off_t offset, size_t size);
+// Sends size bytes of buffer starting at offset without copying them,
+// a reference is taken only if the data cannot be sent right away, the caller keeps its own
+int client_send_shared(generic_session_t *session, shared_buffer_t *buffer, size_t offset, size_t size);
+// Reserves the place of a reply produced later by another thread, the replies sent after it wait for it.
+// It MUST be completed with client_complete_reply, also if the session is closed in the meantime.
+deferred_reply_t *client_defer_reply(generic_session_t *session);
+// Can be called by any thread: buffer (its reference is owned by the server from now on) is sent
+// in place of the deferred reply, NULL closes the session. The reply can not be used after this call.
+void client_complete_reply(deferred_reply_t *reply, shared_buffer_t *buffer);
+
+// The next size bytes received from the client are not framed, they are written to fd (at its current offset)
+// with splice, without passing through user space. fd stays owned by the caller.
+// It can be called by handle_packet_event, bytes already buffered after the current frame belong to the stream.
+void client_receive_to_file(generic_session_t *session, int fd, size_t size);
+// Same as client_receive_to_file for a file opened with O_DIRECT: prefix and then the next size bytes
+// are written from offset 0 in STREAM_STAGING_SIZE aligned blocks, through the session staging buffer.
+// prefix_size must be at most STREAM_STAGING_SIZE.
+int client_receive_to_direct_file(generic_session_t *session, int fd, const void *prefix, size_t prefix_size, size_t size);
 
 int __handle_write_event(socket_server_config_t *config, event_t *event);
 int socket_server_init(socket_server_t *server, socket_server_config_t config);
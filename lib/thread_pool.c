@@ -0,0 +1,166 @@
+#include "thread_pool.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+static void __thread_pool_drain(thread_pool_t *pool, size_t worker)
+{
+    while (1)
+    {
+        size_t task = atomic_fetch_add(&pool->next_task, 1);
+        if (task >= pool->n_tasks)
+            break;
+
+        pool->fn(pool->arg, task, worker);
+    }
+}
+
+typedef struct
+{
+    thread_pool_t *pool;
+    size_t index;
+} __thread_pool_worker_args_t;
+
+static void *__thread_pool_worker(void *_args)
+{
+    __thread_pool_worker_args_t *args = (__thread_pool_worker_args_t *)_args;
+    thread_pool_t *pool = args->pool;
+    size_t index = args->index;
+    free(args);
+
+    uint64_t seen_generation = 0;
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && pool->generation == seen_generation)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+
+        if (pool->stop)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+
+        seen_generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        __thread_pool_drain(pool, index);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+        if (pool->running == 0)
+            pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+int thread_pool_init(thread_pool_t *pool, size_t n_workers)
+{
+    pool->n_workers = 0;
+    pool->threads = NULL;
+    pool->generation = 0;
+    pool->stop = 0;
+    pool->running = 0;
+    pool->fn = NULL;
+    pool->arg = NULL;
+    pool->n_tasks = 0;
+    atomic_init(&pool->next_task, 0);
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0)
+        return -1;
+
+    if (pthread_cond_init(&pool->wake, NULL) != 0 || pthread_cond_init(&pool->done, NULL) != 0)
+    {
+        pthread_mutex_destroy(&pool->lock);
+        return -1;
+    }
+
+    if (n_workers == 0)
+        return 0;
+
+    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * n_workers);
+    if (pool->threads == NULL)
+    {
+        perror("Failed to allocate memory for thread pool");
+        return -1;
+    }
+
+    for (size_t i = 0; i < n_workers; i++)
+    {
+        __thread_pool_worker_args_t *args = malloc(sizeof(__thread_pool_worker_args_t));
+        if (args == NULL)
+        {
+            perror("Failed to allocate memory for thread pool worker");
+            thread_pool_destroy(pool);
+            return -1;
+        }
+
+        args->pool = pool;
+        args->index = i;
+
+        if (pthread_create(&pool->threads[i], NULL, __thread_pool_worker, args) != 0)
+        {
+            perror("Failed to create thread pool worker");
+            free(args);
+            thread_pool_destroy(pool);
+            return -1;
+        }
+
+        pool->n_workers++;
+    }
+
+    return 0;
+}
+
+void thread_pool_destroy(thread_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->n_workers; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->n_workers = 0;
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+int thread_pool_run(thread_pool_t *pool, thread_pool_task_fn fn, void *arg, size_t n_tasks)
+{
+    assert(fn != NULL);
+    if (n_tasks == 0)
+        return 0;
+
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->n_tasks = n_tasks;
+    atomic_store(&pool->next_task, 0);
+
+    if (pool->n_workers > 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->running = pool->n_workers;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    __thread_pool_drain(pool, pool->n_workers);
+
+    if (pool->n_workers > 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->running > 0)
+            pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return 0;
+}
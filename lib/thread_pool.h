@@ -0,0 +1,42 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// task: index of the task in [0, n_tasks), worker: index of the thread running it in [0, n_workers]
+// (the calling thread of thread_pool_run is worker n_workers)
+typedef void (*thread_pool_task_fn)(void *arg, size_t task, size_t worker);
+
+typedef struct
+{
+    size_t n_workers;
+    pthread_t *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+
+    uint64_t generation;
+    uint8_t stop;
+    size_t running;
+
+    thread_pool_task_fn fn;
+    void *arg;
+    size_t n_tasks;
+    atomic_size_t next_task;
+} thread_pool_t;
+
+// n_workers can be 0, in that case every task is run by the calling thread
+int thread_pool_init(thread_pool_t *pool, size_t n_workers);
+void thread_pool_destroy(thread_pool_t *pool);
+
+// Runs fn(arg, task, worker) for every task in [0, n_tasks) and blocks until all of them are done.
+// Only one thread at a time can call this function on the same pool.
+int thread_pool_run(thread_pool_t *pool, thread_pool_task_fn fn, void *arg, size_t n_tasks);
+
+#define thread_pool_size(pool) ((pool)->n_workers + 1)
+
+#endif // THREAD_POOL_H
@@ -7,105 +7,18 @@
 #include "socket_server.h"
 #include "buffer.h"
 #include "event_loop.h"
+#include "agg_engine.h"
+#include "kernels.h"
+#include "diff_cache.h"
+#include "global_model.h"
+#include "agg_policy.h"
+#include "compression.h"
+#include "tensor.h"
 
 parallel_socket_server_t server;
-
-static inline int n_metadata(mf_metadata_t *_metadata, size_t buff_size)
-{
-    size_t n = 0;
-    char *next = (char *)_metadata;
-    ssize_t remaining = buff_size;
-
-    int i = 0;
-    while (remaining > (ssize_t)sizeof(mf_metadata_t))
-    {
-        i++;
-        fflush(stdout);
-        uint8_t data_type = ((mf_metadata_t *)next)->data_type;
-        uint16_t name_len = ((mf_metadata_t *)next)->name_len;
-        uint8_t type_size = 0;
-
-        if (data_type == MF_TSTRING)
-        {
-            uint32_t str_len = *(uint32_t *)(next + sizeof(mf_metadata_t) + name_len);
-            type_size = sizeof(uint32_t) + str_len;
-        }
-        else
-        {
-            type_size = MF_SIZE(data_type);
-        }
-
-        if (type_size == 0)
-        {
-            perror("Invalid data type");
-            return -1;
-        }
-
-        size_t struct_size = sizeof(mf_metadata_t) + type_size + name_len;
-        remaining -= struct_size;
-        next += struct_size;
-        n++;
-    }
-
-    if (remaining != 0)
-    {
-        perror("malformed metadata");
-        return -1;
-    }
-
-    return n;
-}
-
-static inline void *get_meta(char *buff, size_t size, const char *key, uint8_t type)
-{
-
-    size_t key_len = strlen(key);
-    char *next = buff;
-    ssize_t remaining = size;
-
-    int i = 0;
-    while (remaining > (ssize_t)sizeof(mf_metadata_t))
-    {
-        i++;
-        uint8_t data_type = ((mf_metadata_t *)next)->data_type;
-        uint16_t name_len = ((mf_metadata_t *)next)->name_len;
-        uint8_t type_size = 0;
-
-        if (data_type == MF_TSTRING)
-        {
-            uint32_t str_len = *(uint32_t *)(next + sizeof(mf_metadata_t) + name_len);
-            type_size = sizeof(uint32_t) + str_len;
-        }
-        else
-        {
-            type_size = MF_SIZE(data_type);
-        }
-
-        if (type_size == 0)
-        {
-            perror("Invalid data type");
-            return NULL;
-        }
-
-        if (name_len == key_len && data_type == type && strncmp(next + sizeof(mf_metadata_t), key, key_len) == 0)
-        {
-            return (void *)(next + sizeof(mf_metadata_t) + name_len);
-        }
-
-        size_t struct_size = sizeof(mf_metadata_t) + type_size + name_len;
-        remaining -= struct_size;
-        next += struct_size;
-    }
-
-    if (remaining != 0)
-    {
-        perror("malformed metadata");
-        return NULL;
-    }
-
-    perror("key not found");
-    return NULL;
-}
+agg_engine_t agg_engine;
+agg_policy_t agg_policy;
+diff_cache_t diff_cache;
 
 int is_valid_metadata(mf_metadata_t *_metadata, size_t buff_size)
 {
@@ -117,364 +30,278 @@ int is_valid_metadata(mf_metadata_t *_metadata, size_t buff_size)
     return 1;
 }
 
-double get_weights_from_metadata(char *buff, size_t size)
+void should_aggregate_models(const agg_round_t *round, agg_config_t *conf)
 {
-    uint32_t *dataset_size = (uint32_t *)get_meta(buff, size, "dataset_size", MF_TUINT32);
-
-    if (dataset_size == NULL)
-    {
-        perror("Failed to get dataset size");
-        return -1;
-    }
-
-    return (double)*dataset_size;
+    agg_policy_decide(&agg_policy, round, conf);
 }
 
-void should_aggregate_models(size_t buffered_updates, struct timespec *last_aggregation, agg_config_t *conf)
+int aggregate_models(model_upd_t **updates, size_t len, uint64_t *id, shared_buffer_t **model)
 {
-    if (buffered_updates >= 10)
-    {
-        conf->type = 1;
-        return;
-    }
-
-    conf->type = 0;
+    return agg_engine_aggregate(&agg_engine, updates, len, id, model);
 }
 
-int open_fds(size_t len, model_upd_t *updates[len], int fds[len])
+volatile uint8_t stop = 0;
+void handle_signal(int signal)
 {
-    assert(len > 0);
-    for (size_t i = 0; i < len; i++)
-    {
-        fds[i] = open(updates[i]->file_name, O_RDONLY);
-        if (fds[i] == -1)
-        {
-            for (size_t j = 0; j < i; j++)
-                close(fds[j]);
-
-            perror("Failed to open model update file");
-            return -1;
-        }
-    }
-
-    return 0;
+    write(STDOUT_FILENO, "Caught signal, exiting\n", 24);
+    stop = 1;
+    // server.stop_server = 1;
 }
 
-// This function seeks to the data part of the model file, and returns the size of the data
-int seek_to_data(size_t n, int fd[n], model_file_info_t model_info[n])
+void client_cleanup(generic_session_t *session)
 {
-    for (size_t i = 0; i < n; i++)
+    session_t *s = (session_t *)session;
+    if (s->state == WEIGHT_STREAM)
     {
-        if (lseek(fd[i], model_info[i].data_offset, SEEK_SET) == -1)
+        client_update_t *update = &s->model_update;
+        if (update->fd != -1)
         {
-            perror("Failed to seek to data offset");
-            goto fail;
+            close(update->fd);
+            update->fd = -1;
         }
-    }
-
-    return 0;
-
-fail:
-    for (size_t i = 0; i < n; i++)
-        close(fd[i]);
 
-    return -1;
+        free(update->meta);
+        update->meta = NULL;
+    }
 }
 
-int load_model_info(size_t n, int fd[n], model_file_info_t model_info[n])
+void on_next_iteration()
 {
-    char buff[MIN_MF_SIZE];
-    for (size_t i = 0; i < n; i++)
-    {
-        if (read(fd[i], buff, MIN_MF_SIZE) != MIN_MF_SIZE)
-        {
-            perror("Failed to read model info");
-            goto fail;
-        }
-
-        if (extract_file_info(&model_info[i], buff, MIN_MF_SIZE) < 0)
-        {
-            perror("Failed to extract model info");
-            goto fail;
-        }
-    }
-
-    return 0;
-
-fail:
-    for (size_t i = 0; i < n; i++)
-        close(fd[i]);
-
-    return -1;
+    set_debug(1);
+    // the global model read by the previous requests can be freed
+    global_model_quiescent();
+    // debug_print("Pending updates: %ld, Done updates: %ld\n", pending_client_updates_counter, pending_client_updates_done_counter);
 }
 
-int compute_weights(size_t n, int fd[n], model_file_info_t model_info[n], double w[n])
+// constant | poly[:a] | hinge[:a:b]
+static int parse_decay(const char *arg, agg_staleness_t *staleness)
 {
-    // load metadata
-    size_t max_metadata = 0;
-    for (size_t i = 0; i < n; i++)
+    if (strcmp(arg, "constant") == 0)
     {
-        if (model_info[i].metadata_size > max_metadata)
-            max_metadata = model_info[i].metadata_size;
+        staleness->decay = AGG_DECAY_CONSTANT;
+        return 0;
     }
 
-    char metadata_buff[max_metadata];
-    for (size_t i = 0; i < n; i++)
+    if (strncmp(arg, "poly", 4) == 0)
     {
-        if (read(fd[i], metadata_buff, model_info[i].metadata_size) != model_info[i].metadata_size)
-        {
-            perror("Failed to read metadata");
-            goto fail;
-        }
-
-        w[i] = get_weights_from_metadata(metadata_buff, model_info[i].metadata_size);
-        if (w[i] < 0)
-        {
-            perror("Failed to get weights from metadata");
-            goto fail;
-        }
+        staleness->decay = AGG_DECAY_POLYNOMIAL;
+        return arg[4] == '\0' || sscanf(arg + 4, ":%lf", &staleness->a) == 1 ? 0 : -1;
     }
 
-    return 0;
-
-fail:
-    for (size_t i = 0; i < n; i++)
-        close(fd[i]);
+    if (strncmp(arg, "hinge", 5) == 0)
+    {
+        staleness->decay = AGG_DECAY_HINGE;
+        return arg[5] == '\0' || sscanf(arg + 5, ":%lf:%lf", &staleness->a, &staleness->b) == 2 ? 0 : -1;
+    }
 
     return -1;
 }
 
-int clone_headers(int fd_source, int fd_dest)
+// mean | median | trimmed[:trim] | krum[:f[:m]]
+static int parse_reducer(const char *arg, agg_reducer_t *reducer)
 {
-    char buff[MIN_MF_SIZE];
-    if (read(fd_source, buff, MIN_MF_SIZE) != MIN_MF_SIZE)
-    {
-        perror("Failed to read model info");
-        return -1;
-    }
-
-    model_file_info_t model_info;
-    if (extract_file_info(&model_info, buff, MIN_MF_SIZE) < 0)
-    {
-        perror("Failed to extract model info");
-        return -1;
-    }
-
-    size_t header_size = model_info.file_size - model_info.data_size;
-
-    if (lseek(fd_source, 0, SEEK_SET) == -1)
+    if (strcmp(arg, "mean") == 0)
     {
-        perror("Failed to seek to start of file");
-        return -1;
+        reducer->type = AGG_REDUCER_MEAN;
+        return 0;
     }
 
-    if (lseek(fd_dest, 0, SEEK_SET) == -1)
+    if (strcmp(arg, "median") == 0)
     {
-        perror("Failed to seek to start of file");
-        return -1;
+        reducer->type = AGG_REDUCER_MEDIAN;
+        return 0;
     }
 
-    char header[header_size];
-    if (read(fd_source, header, header_size) != header_size)
+    if (strncmp(arg, "trimmed", 7) == 0)
     {
-        perror("Failed to read header");
-        return -1;
+        reducer->type = AGG_REDUCER_TRIMMED_MEAN;
+        if (arg[7] != '\0' && sscanf(arg + 7, ":%lf", &reducer->trim) != 1)
+            return -1;
+        return reducer->trim >= 0 && reducer->trim < 0.5 ? 0 : -1;
     }
 
-    if (write(fd_dest, header, header_size) != header_size)
+    if (strncmp(arg, "krum", 4) == 0)
     {
-        perror("Failed to write header");
-        return -1;
+        reducer->type = AGG_REDUCER_KRUM;
+        return arg[4] == '\0' || sscanf(arg + 4, ":%zu:%zu", &reducer->f, &reducer->m) >= 1 ? 0 : -1;
     }
 
-    return 0;
+    return -1;
 }
 
-#define COMPUTE_CHUNK_SIZE 64
-int aggregate_models(model_upd_t **updates, size_t len)
+// the file of model id stays on disk as <id>.v1 (a hard link: nothing is copied), a backup that is
+// never served. One left by a previous conversion belongs to an older model, it is replaced.
+static int keep_v1_model_file(uint64_t id)
 {
-    set_debug(1);
-
-    int fds[len];
-    int ret_code = 0;
-    int out_fd = -1;
-    model_file_info_t model_info[len];
-    double weights[len];
-    double avg[COMPUTE_CHUNK_SIZE];
-    double data[COMPUTE_CHUNK_SIZE];
+    char path[255];
+    char v1_path[255];
+    snprintf(path, sizeof(path), "%s/%lu", MODEL_FOLDER, id);
+    snprintf(v1_path, sizeof(v1_path), "%s/%lu.v1", MODEL_FOLDER, id);
 
-    if (open_fds(len, updates, fds) < 0)
+    if ((unlink(v1_path) == -1 && errno != ENOENT) || link(path, v1_path) == -1)
     {
-        perror("Failed to open model update files");
+        perror("Failed to keep the version 1 model file");
         return -1;
     }
 
-    debug_print("Opened model update files\n");
+    return 0;
+}
 
-    if (load_model_info(len, fds, model_info) < 0)
-    {
-        perror("Failed to load model info");
+// the global models are served in place and diffed from their files, a compressed one is rewritten raw.
+// With version MF_VERSION_2 a version 1 one is rewritten in version 2 (the original file is kept as
+// <id>.v1), the aggregated models keep its headers and layout: every client MUST read version 2 files.
+// Otherwise it is served as it is.
+static int prepare_model_file(uint64_t id, uint8_t version)
+{
+    int fd = open_model(id);
+    if (fd == -1)
         return -1;
-    }
-
-    debug_print("Loaded model info\n");
-
-    uint64_t last_global_model_id = model_info[0].diffed_from_model_version;
-    uint64_t new_global_model_id = last_global_model_id + 1;
-    out_fd = open_model_w(new_global_model_id);
-    if (out_fd == -1)
-    {
-        perror("Failed to open output model file");
-        ret_code = -1;
-        goto close_all;
-    }
 
-    int old_fd = open_model(last_global_model_id);
-    if (old_fd == -1)
-    {
-        perror("Failed to open old model file");
-        ret_code = -1;
-        goto close_all;
-    }
-
-    if (clone_headers(old_fd, out_fd) < 0)
-    {
-        perror("Failed to clone headers");
-        close(old_fd);
-        ret_code = -1;
-        goto close_all;
-    }
-
-    close(old_fd);
-
-    debug_print("Opened output model file\n");
-
-    if (compute_weights(len, fds, model_info, weights) < 0)
+    mapped_model_t model = {0};
+    int res = map_model(fd, &model);
+    close(fd);
+    uint8_t convert = res == 0 && model.info.version < version;
+    if (res < 0 || (!mfi_is_compressed(model.info) && !convert))
     {
-        perror("Failed to compute weights");
-        return -1;
+        unmap_model(&model);
+        return res;
     }
 
-    debug_print("Computed weights\n");
-
-    if (seek_to_data(len, fds, model_info) < 0)
+    if (mf_inflate_mapped_model(&model) < 0)
     {
-        perror("Failed to seek to data");
+        perror("Failed to decompress model file");
+        unmap_model(&model);
         return -1;
     }
 
-    debug_print("Seeked to data\n");
-
-    // normalize weights
-    double max_weight = 0;
-    for (size_t i = 0; i < len; i++)
-    {
-        if (weights[i] > max_weight)
-            max_weight = weights[i];
-    }
-
-    for (size_t i = 0; i < len; i++)
+    if (convert)
     {
-        weights[i] /= max_weight;
-    }
-
-    debug_print("Normalized weights\n");
-    debug_print("Max weight: %f\n", max_weight);
-    debug_print("Weights: \n");
-    for (size_t i = 0; i < len; i++)
-    {
-        debug_print("\t%f\n", weights[i]);
-    }
-
-    size_t computed = 0;
-    while (computed < model_info[0].data_size)
-    {
-        size_t remaining = model_info[0].data_size - computed;
-        size_t chunk_size = remaining > COMPUTE_CHUNK_SIZE ? COMPUTE_CHUNK_SIZE : remaining;
-
-        for (int f_idx = 0; f_idx < len; f_idx++)
+        char *data = NULL;
+        size_t size = 0;
+        if (mf_convert_model_v2(model.data, model.size, &model.info, &data, &size) < 0 || keep_v1_model_file(id) < 0)
         {
-            if (read(fds[f_idx], data, chunk_size) != chunk_size)
-            {
-                perror("Failed to read data");
-                ret_code = -1;
-                goto close_all;
-            }
-
-            for (int i = 0; i < chunk_size; i++)
-            {
-                avg[i] += data[i] * weights[f_idx];
-            }
+            perror("Failed to convert model file");
+            if (data != NULL)
+                unmap_file(data, size);
+            unmap_model(&model);
+            return -1;
         }
 
-        debug_print("Computed chunk [%zu, %lu]\n", computed + chunk_size, model_info[0].data_size);
-        computed += chunk_size;
-        if (write(out_fd, avg, chunk_size) != chunk_size)
-        {
-            perror("Failed to write data");
-            ret_code = -1;
-            goto close_all;
-        }
+        unmap_model(&model);
+        model.data = data;
+        model.size = size;
     }
 
-    ret_code = new_global_model_id;
+    // only written, the buffer is not shared
+    shared_buffer_t file = {.data = model.data, .size = model.size};
+    res = agg_engine_write_model(id, &file);
+    unmap_model(&model);
+    return res;
+}
 
-close_all:
-    for (size_t i = 0; i < len; i++)
-        close(fds[i]);
+int main(int argc, char **argv)
+{
 
-    if (out_fd != -1)
-        close(out_fd);
+    // usage ./main [-a n_aggregation_threads] [-m batch|stream] [-p policy] [-r reducer] [-s max_staleness] [-f constant|poly[:a]|hinge[:a:b]] [-v model_version] [-d] <n_threads>
+    int n_agg_threads = 1;
+    const char *policy = NULL;
+    uint8_t model_version = MF_VERSION_1; // the initial model is converted to it if older
+    aggregator_config_t agg_config = {
+        .mode = AGG_MODE_BATCH,
+        .engine = &agg_engine,
+    };
 
-    return ret_code;
-}
+    agg_staleness_t staleness = {
+        .decay = AGG_DECAY_POLYNOMIAL,
+        .a = 0.5,
+        .b = 4,
+        .max_staleness = AGG_DEFAULT_MAX_STALENESS,
+    };
 
-volatile uint8_t stop = 0;
-void handle_signal(int signal)
-{
-    write(STDOUT_FILENO, "Caught signal, exiting\n", 24);
-    stop = 1;
-    // server.stop_server = 1;
-}
+    agg_reducer_t reducer = {
+        .type = AGG_REDUCER_MEAN,
+        .trim = 0.1,
+        .f = 1,
+        .m = 0,
+    };
 
-void client_cleanup(generic_session_t *session)
-{
-    session_t *s = (session_t *)session;
-    if (s->state == WEIGHT_STREAM)
+    int opt;
+    while ((opt = getopt(argc, argv, "a:m:p:r:s:f:v:d")) != -1)
     {
-        client_update_t *update = &s->model_update;
-        if (update->fd != -1)
+        switch (opt)
         {
-            close(update->fd);
-            update->fd = -1;
+        case 'a':
+            n_agg_threads = atoi(optarg);
+            break;
+        case 'd':
+            update_direct_io = 1;
+            break;
+        case 'm':
+            if (strcmp(optarg, "batch") == 0)
+                agg_config.mode = AGG_MODE_BATCH;
+            else if (strcmp(optarg, "stream") == 0)
+                agg_config.mode = AGG_MODE_STREAMING;
+            else
+                n_agg_threads = 0;
+            break;
+        case 'p':
+            policy = optarg;
+            break;
+        case 'r':
+            if (parse_reducer(optarg, &reducer) < 0)
+                n_agg_threads = 0;
+            break;
+        case 's':
+            staleness.max_staleness = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            if (parse_decay(optarg, &staleness) < 0)
+                n_agg_threads = 0;
+            break;
+        case 'v':
+        {
+            int version = atoi(optarg);
+            if (version < MF_VERSION_1 || version > MF_VERSION)
+                n_agg_threads = 0;
+            model_version = version;
+            break;
+        }
+        default:
+            n_agg_threads = 0;
         }
     }
-}
-
-void on_next_iteration()
-{
-    set_debug(1);
-    // debug_print("Pending updates: %ld, Done updates: %ld\n", pending_client_updates_counter, pending_client_updates_done_counter);
-}
 
-int main(int argc, char **argv)
-{
+    // the streaming accumulator can only be a weighted mean
+    if (agg_config.mode == AGG_MODE_STREAMING && reducer.type != AGG_REDUCER_MEAN)
+        n_agg_threads = 0;
 
-    // usage ./main <n_threads>
-    assert(argc == 2);
+    if (optind != argc - 1 || n_agg_threads <= 0 || agg_policy_init(&agg_policy, policy) < 0)
+    {
+        fprintf(stderr, "usage: %s [-a n_aggregation_threads] [-m batch|stream] [-p policy] [-r reducer] [-s max_staleness] [-f constant|poly[:a]|hinge[:a:b]] [-v model_version] [-d] <n_threads>\n", argv[0]);
+        fprintf(stderr, "policy: count:<updates> | deadline:<seconds>[:<min updates>] | weight:<dataset size> | adaptive:<seconds>[:<min updates>]\n");
+        fprintf(stderr, "reducer (batch mode only): mean | median | trimmed[:fraction] | krum[:f[:m]]\n");
+        fprintf(stderr, "model_version: 1 (default, the initial model is served as it is) | 2 (a version 1 one is converted, the clients must read version 2; the original is kept as <id>.v1, not served)\n");
+        return -1;
+    }
 
-    int n_threads = atoi(argv[1]);
+    int n_threads = atoi(argv[optind]);
     assert(n_threads > 0);
 
     set_debug(1);
     signal(SIGINT, handle_signal);
 
-    if (queue_model_upd_init(&model_queue, 100) < 0)
+    if (ring_model_upd_init(&model_queue, MODEL_QUEUE_CAPACITY) < 0)
     {
         perror("Failed to initialize model queue");
         return -1;
     }
 
+    if (prepare_model_file(0, model_version) < 0)
+    {
+        perror("Failed to open model file");
+        return -1;
+    }
+
     int fd = open_model(0);
     if (fd == -1)
     {
@@ -539,7 +366,7 @@ int main(int argc, char **argv)
 
     loop_theaders(header_data, global_model_info.tensor_header_size)
     {
-        assert(th->data_type == 0);
+        assert(mf_kernel_supported_type(th->data_type));
     }
 
     // loop_theaders(header_data, global_model_info.tensor_header_size)
@@ -563,11 +390,7 @@ int main(int argc, char **argv)
     free(header_data);
     close(fd);
 
-    if (mfi_is_compressed(global_model_info))
-    {
-        perror("Global model must not be compressed");
-        return -1;
-    }
+    printf("Using %s kernels\n", mf_kernel_isa_name(mf_kernel_isa()));
 
     if (mfi_is_diff_format(global_model_info))
     {
@@ -587,12 +410,31 @@ int main(int argc, char **argv)
         return -1;
     }
 
+    // the thread calling aggregate_models takes part in the reduction
+    if (agg_engine_init(&agg_engine, n_agg_threads - 1, AGG_DEFAULT_TILE_SIZE, &staleness, &reducer) < 0)
+    {
+        perror("Failed to initialize aggregation engine");
+        return -1;
+    }
+
+    if (diff_cache_init(&diff_cache, DIFF_CACHE_MAX_BYTES, DIFF_CACHE_THREADS) < 0)
+    {
+        perror("Failed to initialize diff cache");
+        return -1;
+    }
+
+    if (global_model_publish(0, NULL) < 0)
+    {
+        perror("Failed to publish global model");
+        return -1;
+    }
+
     socket_server_config_t config = {
         .debug = 1,
         .event_loop_timeout = 1000,
         .max_connections = 100,
         .max_events = 100,
-        .max_message_size = 2048,
+        .max_message_size = MAX_MESSAGE_SIZE,
         .port = PORT,
         .session_size = sizeof(session_t),
         .metrics_file = "metrics.csv",
@@ -616,12 +458,12 @@ int main(int argc, char **argv)
     //     return -1;
     // }
 
-    // pthread_t queue_thread;
-    // if (pthread_create(&queue_thread, NULL, (void *)model_queue_thread, (void *)NULL) < 0)
-    // {
-    //     perror("Failed to create queue thread");
-    //     return -1;
-    // }
+    pthread_t queue_thread;
+    if (pthread_create(&queue_thread, NULL, (void *)model_queue_thread, (void *)&agg_config) < 0)
+    {
+        perror("Failed to create queue thread");
+        return -1;
+    }
 
     // if (socket_server_run(&server) < 0)
     // {
@@ -642,13 +484,18 @@ int main(int argc, char **argv)
     }
 
     parallel_socket_server_stop(&server);
+    // the diffs in flight complete replies of the workers
+    diff_cache_stop(&diff_cache);
     parallel_socket_server_destroy(&server);
 
-    queue_model_upd_close(&model_queue);
-    // pthread_join(queue_thread, NULL);
+    ring_model_upd_close(&model_queue);
+    pthread_join(queue_thread, NULL);
     printf("Server stopped\n");
     fflush(stdout);
 
-    queue_model_upd_destroy(&model_queue);
+    ring_model_upd_destroy(&model_queue);
+    agg_engine_destroy(&agg_engine);
+    diff_cache_destroy(&diff_cache);
+    global_model_destroy();
     return 0;
 }
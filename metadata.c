@@ -0,0 +1,130 @@
+#include "metadata.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// size of the entry at p (header, name and value), -1 if it does not fit in remaining bytes
+static ssize_t entry_size(const char *p, size_t remaining, uint32_t *value_size)
+{
+    if (remaining < sizeof(mf_metadata_t))
+        return -1;
+
+    const mf_metadata_t *meta = (const mf_metadata_t *)p;
+    size_t size = sizeof(mf_metadata_t) + meta->name_len;
+    if (meta->data_type == MF_TSTRING)
+    {
+        uint32_t len;
+        if (remaining < size + sizeof(len))
+            return -1;
+
+        memcpy(&len, p + size, sizeof(len));
+        size += sizeof(len);
+        *value_size = len;
+    }
+    else
+    {
+        *value_size = MF_SIZE(meta->data_type);
+        if (*value_size == 0)
+            return -1;
+    }
+
+    size += *value_size;
+    return size <= remaining ? (ssize_t)size : -1;
+}
+
+static int compare_names(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    int res = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    return res != 0 ? res : (a_len > b_len) - (a_len < b_len);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const mf_meta_entry_t *x = (const mf_meta_entry_t *)a;
+    const mf_meta_entry_t *y = (const mf_meta_entry_t *)b;
+    return compare_names(x->name, x->name_len, y->name, y->name_len);
+}
+
+mf_meta_index_t *mf_meta_index_build(const char *buff, size_t size)
+{
+    // sizes first: one allocation for the entries and the bytes they point to
+    size_t n = 0;
+    uint32_t value_size;
+    for (size_t pos = 0; pos < size; n++)
+    {
+        ssize_t len = entry_size(buff + pos, size - pos, &value_size);
+        if (len < 0)
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+
+        pos += len;
+    }
+
+    mf_meta_index_t *index = (mf_meta_index_t *)malloc(sizeof(mf_meta_index_t) + n * sizeof(mf_meta_entry_t) + size);
+    if (index == NULL)
+    {
+        perror("Failed to allocate metadata index");
+        return NULL;
+    }
+
+    char *bytes = (char *)&index->entries[n];
+    memcpy(bytes, buff, size);
+
+    index->n = n;
+    for (size_t i = 0, pos = 0; i < n; i++)
+    {
+        const mf_metadata_t *meta = (const mf_metadata_t *)(bytes + pos);
+        mf_meta_entry_t *entry = &index->entries[i];
+        ssize_t len = entry_size(bytes + pos, size - pos, &value_size);
+
+        entry->name = meta->buff;
+        entry->name_len = meta->name_len;
+        entry->type = meta->data_type;
+        entry->size = value_size;
+        entry->value = bytes + pos + len - value_size;
+        pos += len;
+    }
+
+    qsort(index->entries, n, sizeof(mf_meta_entry_t), compare_entries);
+
+    const mf_meta_entry_t *dataset_size = mf_meta_find(index, MF_META_DATASET_SIZE, strlen(MF_META_DATASET_SIZE), MF_TUINT32);
+    index->dataset_size = -1;
+    if (dataset_size != NULL)
+    {
+        uint32_t value;
+        memcpy(&value, dataset_size->value, sizeof(value));
+        index->dataset_size = value;
+    }
+
+    return index;
+}
+
+const mf_meta_entry_t *mf_meta_find(const mf_meta_index_t *index, const char *name, size_t name_len, uint8_t type)
+{
+    size_t lo = 0;
+    size_t hi = index->n;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const mf_meta_entry_t *entry = &index->entries[mid];
+        if (compare_names(entry->name, entry->name_len, name, name_len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // a name can be repeated with different types
+    for (; lo < index->n; lo++)
+    {
+        const mf_meta_entry_t *entry = &index->entries[lo];
+        if (compare_names(entry->name, entry->name_len, name, name_len) != 0)
+            break;
+
+        if (entry->type == type)
+            return entry;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "model.h"
+
+#define MF_META_DATASET_SIZE "dataset_size" // uint32, the weight of an update
+
+// One metadata entry, a string value is its bytes (size is the u32 length in the file)
+typedef struct
+{
+    const char *name;
+    uint16_t name_len;
+    uint8_t type;
+    uint32_t size;
+    const char *value;
+} mf_meta_entry_t;
+
+// Parsed metadata of a model file, built once from the header and kept with the update.
+// A single allocation (release it with free): the entries sorted by name, then a copy of the
+// names and values, so the index outlives the buffer it is built from.
+typedef struct
+{
+    size_t n;
+    double dataset_size; // MF_META_DATASET_SIZE, -1 if missing
+    mf_meta_entry_t entries[];
+} mf_meta_index_t;
+
+// NULL if the metadata section is malformed (errno EINVAL) or on allocation failure
+mf_meta_index_t *mf_meta_index_build(const char *buff, size_t size);
+
+// the entry called name with the given type, NULL if none
+const mf_meta_entry_t *mf_meta_find(const mf_meta_index_t *index, const char *name, size_t name_len, uint8_t type);
+
+#endif // METADATA_H
@@ -8,6 +8,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #pragma pack(push, 1) // Set alignment to 1 byte
 typedef struct
@@ -19,11 +21,11 @@ typedef struct
 } mf_theader_t;
 #pragma pack(pop) // Restore the previous alignment
 
-// This is safe becouse string is not a valid data type
+// Every tensor header is followed by its name and by dim uint32_t (the shape)
 #define loop_theaders(buff, size)                 \
     for (mf_theader_t *th = (mf_theader_t *)buff; \
          (char *)th < (buff + size);              \
-         th = (mf_theader_t *)((char *)th + sizeof(mf_theader_t) + th->name_len + MF_SIZE(th->data_type) * th->dim))
+         th = (mf_theader_t *)((char *)th + sizeof(mf_theader_t) + th->name_len + sizeof(uint32_t) * th->dim))
 
 typedef struct
 {
@@ -39,6 +41,11 @@ typedef struct
     size_t tensor_header_offset; // valid only if tensor_header_size > 0
     size_t metadata_offset;      // valid only if metadata_size > 0
     size_t data_offset;
+
+    // version 2 only (0 in version 1 files)
+    size_t tensor_offsets_offset; // n_tensors uint64_t, see MF_VERSION_2
+    uint32_t n_tensors;
+    uint32_t data_align;
 } model_file_info_t;
 
 #pragma pack(push, 1) // Set alignment to 1 byte
@@ -166,10 +173,12 @@ static inline char *MF_TYPE_NAME(uint8_t type)
 #define MF_FLAG_COMPRESSED 0x01
 #define MF_FLAG_DIFF_FORMAT 0x02
 #define MF_FLAG_HEADER_LESS 0x04
+#define MF_FLAG_SPARSE 0x08 // diffs only, see quant.h
 
 #define mfi_is_compressed(info) ((info).flags & MF_FLAG_COMPRESSED)
 #define mfi_is_diff_format(info) ((info).flags & MF_FLAG_DIFF_FORMAT)
 #define mfi_is_header_less(info) ((info).flags & MF_FLAG_HEADER_LESS)
+#define mfi_is_sparse(info) ((info).flags & MF_FLAG_SPARSE)
 
 #define MF_SIZE_OFF 0
 #define MF_FLAGS_OFF (MF_SIZE_OFF + MF_SFILE_SIZE)
@@ -178,10 +187,83 @@ static inline char *MF_TYPE_NAME(uint8_t type)
 #define MF_TENSOR_HEADER_SIZE_OFF (MF_METADATA_SIZE_OFF + MF_METADATA_SIZE)
 #define MF_DIFFED_FROM_MODEL_VERSION_OFF (MF_TENSOR_HEADER_SIZE_OFF + MF_TENSOR_HEADER_SIZE)
 
-#define MF_VERSION (1)
+// Version 2 keeps the version 1 fields (the same prefix) and adds a fixed section table, so the data
+// section and every tensor start at a multiple of data_align (at least 64 bytes) in the file: a mapped
+// model can be read with aligned vector loads without copying it.
+//   v1 fields | u32 data_align | u32 n_tensors | MF_V2_SECTIONS x (u64 offset | u64 size)
+// The sections are, in this order: metadata, tensor headers, tensor offsets (n_tensors u64, from the
+// start of the data section, increasing) and data. Sizes are the ones of the raw file (the data
+// section of a compressed file is file_size - data offset), the gaps between sections and tensors are
+// zero padding. A sparse update keeps its encoding in the data section, its tensor offsets are unused.
+#define MF_VERSION_1 (1)
+#define MF_VERSION_2 (2)
+#define MF_VERSION MF_VERSION_2 // newest version the readers support
+
+#define MF_V2_SECTION_METADATA 0
+#define MF_V2_SECTION_TENSOR_HEADERS 1
+#define MF_V2_SECTION_TENSOR_OFFSETS 2
+#define MF_V2_SECTION_DATA 3
+#define MF_V2_SECTIONS 4
+#define MF_V2_MIN_ALIGN 64           // of the tensors
+#define MF_V2_DATA_OFFSET_ALIGN 4096 // of the data section written by mf_convert_model_v2, a page...
+#define MF_V2_PAGE_ALIGN_MIN_DATA (16 * MF_V2_DATA_OFFSET_ALIGN) // ...once the padding is small next to the data
+
+#define MF_DATA_ALIGN_OFF (MF_DIFFED_FROM_MODEL_VERSION_OFF + MF_DIFFED_FROM_MODEL_VERSION_SIZE)
+#define MF_N_TENSORS_OFF (MF_DATA_ALIGN_OFF + sizeof(uint32_t))
+#define MF_SECTION_TABLE_OFF (MF_N_TENSORS_OFF + sizeof(uint32_t))
+#define MF_SECTION_OFF(section) (MF_SECTION_TABLE_OFF + (section) * 2 * sizeof(uint64_t))
+#define MIN_MF_V2_SIZE MF_SECTION_OFF(MF_V2_SECTIONS)
 
 #define mf_valid_header_size(size) ((size) >= MIN_MF_SIZE)
 
+// offset and size of a section of a version 2 header
+static inline void mf_v2_section(const char *buff, int section, uint64_t *offset, uint64_t *size)
+{
+    memcpy(offset, buff + MF_SECTION_OFF(section), sizeof(*offset));
+    memcpy(size, buff + MF_SECTION_OFF(section) + sizeof(uint64_t), sizeof(*size));
+}
+
+static inline int extract_file_info_v2(model_file_info_t *info, char *buff, size_t size)
+{
+    if (size < MIN_MF_V2_SIZE)
+    {
+        perror("Buffer too small");
+        return ERR_MF_MALFORMED;
+    }
+
+    info->data_align = *(uint32_t *)(buff + MF_DATA_ALIGN_OFF);
+    info->n_tensors = *(uint32_t *)(buff + MF_N_TENSORS_OFF);
+
+    uint64_t offset[MF_V2_SECTIONS];
+    uint64_t section_size[MF_V2_SECTIONS];
+    for (int i = 0; i < MF_V2_SECTIONS; i++)
+        mf_v2_section(buff, i, &offset[i], &section_size[i]);
+
+    info->metadata_offset = offset[MF_V2_SECTION_METADATA];
+    info->tensor_header_offset = offset[MF_V2_SECTION_TENSOR_HEADERS];
+    info->tensor_offsets_offset = offset[MF_V2_SECTION_TENSOR_OFFSETS];
+    info->data_offset = offset[MF_V2_SECTION_DATA];
+
+    // the sections follow the table in order, before the aligned data section
+    uint64_t end = MIN_MF_V2_SIZE;
+    for (int i = 0; i < MF_V2_SECTION_DATA; i++)
+    {
+        if (offset[i] < end || section_size[i] > info->data_offset || offset[i] > info->data_offset - section_size[i])
+            return ERR_MF_MALFORMED;
+        end = offset[i] + section_size[i];
+    }
+
+    if (info->data_align < MF_V2_MIN_ALIGN || (info->data_align & (info->data_align - 1)) != 0 ||
+        info->data_offset % info->data_align != 0 || info->data_offset > info->file_size ||
+        section_size[MF_V2_SECTION_METADATA] != info->metadata_size ||
+        section_size[MF_V2_SECTION_TENSOR_HEADERS] != info->tensor_header_size ||
+        section_size[MF_V2_SECTION_TENSOR_OFFSETS] != (uint64_t)info->n_tensors * sizeof(uint64_t))
+        return ERR_MF_MALFORMED;
+
+    info->data_size = info->file_size - info->data_offset;
+    return 0;
+}
+
 // ENSURE BUFFER SIZE IS AT LEAST MIN_MF_SIZE BEFORE CALLING THIS FUNCTION
 static inline int extract_file_info(model_file_info_t *info, char *buff, size_t size)
 {
@@ -197,6 +279,15 @@ static inline int extract_file_info(model_file_info_t *info, char *buff, size_t
     info->metadata_size = *(uint32_t *)(buff + MF_METADATA_SIZE_OFF);
     info->tensor_header_size = *(uint32_t *)(buff + MF_TENSOR_HEADER_SIZE_OFF);
     info->diffed_from_model_version = *(uint64_t *)(buff + MF_DIFFED_FROM_MODEL_VERSION_OFF);
+    info->tensor_offsets_offset = 0;
+    info->n_tensors = 0;
+    info->data_align = 0;
+
+    if (info->version > MF_VERSION)
+        return ERR_MF_UNSUPPORTED_VERSION;
+
+    if (info->version == MF_VERSION_2)
+        return extract_file_info_v2(info, buff, size);
 
     info->metadata_offset = MF_DIFFED_FROM_MODEL_VERSION_OFF + MF_DIFFED_FROM_MODEL_VERSION_SIZE;
     info->tensor_header_offset = info->metadata_offset + info->metadata_size;
@@ -208,15 +299,16 @@ static inline int extract_file_info(model_file_info_t *info, char *buff, size_t
 
 static inline int load_model_info_from_file(int fd, model_file_info_t *info)
 {
-    char buff[MIN_MF_SIZE];
-    ssize_t bytes_read = read(fd, buff, MIN_MF_SIZE);
-    if (bytes_read != MIN_MF_SIZE)
+    // enough for the section table of a version 2 file, a version 1 file can be shorter
+    char buff[MIN_MF_V2_SIZE];
+    ssize_t bytes_read = read(fd, buff, MIN_MF_V2_SIZE);
+    if (bytes_read < (ssize_t)MIN_MF_SIZE)
     {
         perror("Failed to read file");
         return -1;
     }
 
-    return extract_file_info(info, buff, MIN_MF_SIZE);
+    return extract_file_info(info, buff, bytes_read);
 }
 
 // this function dynamically allocates memory for the metadata buff, you must free it
@@ -247,6 +339,23 @@ static inline char *mfi_load_metadata_from_fd(int fd, model_file_info_t *info)
     return buff;
 }
 
+// returns the data type shared by every tensor of the model, -1 if the tensors have different types
+// buff must contain the whole tensor header section
+static inline int mfi_data_type(model_file_info_t *info, char *buff)
+{
+    int type = -1;
+    char *theaders = buff + info->tensor_header_offset;
+    loop_theaders(theaders, info->tensor_header_size)
+    {
+        if (type != -1 && type != th->data_type)
+            return -1;
+
+        type = th->data_type;
+    }
+
+    return type;
+}
+
 static inline void print_model_info(model_file_info_t *info)
 {
     printf("Model file size: %ld\n", info->file_size);
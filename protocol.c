@@ -1,21 +1,71 @@
 #define DEBUG_PROTOCOL 1
+#define _GNU_SOURCE // fallocate, O_DIRECT
 
 #include "protocol.h"
+#include "diff_cache.h"
+#include "global_model.h"
+#include "aggregator.h"
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <stdatomic.h>
+#include <errno.h>
 
 const char *__thread_model_prefix = "model_thread_";
-uint64_t thread_model_counter = 0;
-#define thread_model_name(model_id) ({                                            \
-    char tmp[255];                                                                \
-    int n = sprintf(tmp, UPDATE_FOLDER "%s%ld", __thread_model_prefix, model_id); \
-    assert(n > 0);                                                                \
-    tmp[n] = '\0';                                                                \
-    tmp;                                                                          \
+atomic_uint_fast64_t thread_model_counter = 0; // shared by every worker
+#define thread_model_name(dest, model_id) ({                                                 \
+    int n = sprintf(dest, UPDATE_FOLDER "%s%lu", __thread_model_prefix, (uint64_t)model_id); \
+    assert(n > 0);                                                                           \
+    dest;                                                                                    \
 })
 
+// Creates an update file of size bytes, its blocks are allocated upfront so that
+// streaming the model does not grow (and fragment) it one write at a time.
+// *direct is cleared if the file system does not support O_DIRECT
+static int open_update_file(const char *file_name, uint64_t size, uint8_t *direct)
+{
+    int flags = O_CREAT | O_WRONLY | O_TRUNC;
+    int fd = -1;
+#if defined(O_DIRECT)
+    if (*direct)
+    {
+        fd = open(file_name, flags | O_DIRECT, S_IRUSR | S_IWUSR);
+        if (fd == -1 && errno != EINVAL)
+        {
+            perror("Failed to create update file");
+            return -1;
+        }
+    }
+#endif
+
+    if (fd == -1)
+    {
+        *direct = 0;
+        fd = open(file_name, flags, S_IRUSR | S_IWUSR);
+        if (fd == -1)
+        {
+            perror("Failed to create update file");
+            return -1;
+        }
+    }
+
+#if defined(__linux__)
+    int res = fallocate(fd, 0, 0, size);
+#else
+    int res = -1;
+    errno = EOPNOTSUPP;
+#endif
+    if (res == -1 && (errno != EOPNOTSUPP || ftruncate(fd, size) == -1))
+    {
+        perror("Failed to preallocate update file");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
 // 0x03, file_header, Stream: file_data
 int handle_send_weight_packet(session_t *session, size_t cursor)
 {
@@ -48,6 +98,12 @@ int handle_send_weight_packet(session_t *session, size_t cursor)
         return -1;
     }
 
+    if (mfi_is_header_less(model_info))
+    {
+        perror("Header less models are not supported");
+        return -1;
+    }
+
     if (model_info.diffed_from_model_version > latest_model)
     {
         debug_print("Model is diffed from a non-existent model\n");
@@ -64,115 +120,115 @@ int handle_send_weight_packet(session_t *session, size_t cursor)
         return -1;
     }
 
+    // parsed once while the header is in memory, it goes with the update to the aggregator
     mf_metadata_t *metadata = (mf_metadata_t *)(buff + model_info.metadata_offset);
-    if (!is_valid_metadata(metadata, model_info.metadata_size))
+    mf_meta_index_t *meta = NULL;
+    if (!is_valid_metadata(metadata, model_info.metadata_size) ||
+        (meta = mf_meta_index_build((char *)metadata, model_info.metadata_size)) == NULL)
     {
         perror("Invalid metadata");
         return -1;
     }
 
-    uint64_t model_id = thread_model_counter;
-    const char *file_name = thread_model_name(model_id);
+    // an update without a dataset_size would count for the policy and then be folded with weight 0
+    if (meta->dataset_size <= 0)
+    {
+        debug_print("Update without a dataset size\n");
+        free(meta);
+        return -1;
+    }
 
-    // create a file, signal the os to create a new file of size global_model_size
-    int fd = open(file_name, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+    uint64_t model_id = atomic_fetch_add(&thread_model_counter, 1);
+    char file_name[255];
+    thread_model_name(file_name, model_id);
+
+    uint64_t stream_size = model_info.file_size - buff_size;
+    uint8_t direct = update_direct_io && stream_size > 0;
+    int fd = open_update_file(file_name, model_info.file_size, &direct);
     if (fd == -1)
     {
-        perror("Failed to create update file");
+        free(meta);
         return -1;
     }
 
-    ssize_t written = write(fd, buff, buff_size);
-    if (written != buff_size)
+    if (!direct && write(fd, buff, buff_size) != (ssize_t)buff_size)
     {
         perror("Failed to write model header to file");
+        free(meta);
         close(fd);
         return -1;
     }
 
-    // TODO: make this optimization
-    //  if (ftruncate(fd, global_model_info->) == -1)
-    //  {
-    //      perror("Failed to set update file size");
-    //      close(fd);
-    //      return -1;
-    //  }
-
     update->fd = fd;
     session->state = WEIGHT_STREAM;
     update->model_id = model_id;
+    update->flags = model_info.flags;
+    update->diffed_from = model_info.diffed_from_model_version;
+    update->meta = meta;
+    update->weight = meta->dataset_size;
     update->written = 0;
     update->done = 0;
-    update->stream_size = model_info.file_size - buff_size;
-    thread_model_counter++;
+    update->stream_size = stream_size;
+
+    if (stream_size == 0)
+        return handle_stream_end((generic_session_t *)session);
+
+    // the model data follows unframed, it goes from the socket to the file without passing through this code
+    if (direct)
+        return client_receive_to_direct_file((generic_session_t *)session, fd, buff, buff_size, stream_size);
+
+    client_receive_to_file((generic_session_t *)session, fd, stream_size);
     return 0;
 }
 
-int handle_weight_stream(session_t *session, size_t cursor)
+int handle_stream_end(generic_session_t *__session)
 {
     set_debug(DEBUG_PROTOCOL);
-    debug_print("Handling weight stream\n");
+    session_t *session = (session_t *)__session;
 
     assert(session->state == WEIGHT_STREAM);
-    debug_print("Session state == WEIGHT_STREAM\n");
-
     client_update_t *update = &session->model_update;
     assert(update->fd != -1);
     assert(update->done == 0);
     assert(update->model_id != UINT64_MAX);
-    assert(update->written < update->stream_size);
 
-    size_t remaining = buffer_cremaining(session->buffer, cursor);
-    if (remaining > update->stream_size - update->written)
-    {
-        debug_print("Remaining: %ld, Stream size: %ld, Written: %ld\n", remaining, update->stream_size, update->written);
-        perror("Malformed weight stream packet");
-        return -1;
-    }
+    update->written = update->stream_size;
+    debug_print("Written: %ld/%ld\n", update->written, update->stream_size);
 
-    while (buffer_cremaining(session->buffer, cursor) > 0)
+    model_upd_t *model_upd = malloc(sizeof(model_upd_t));
+    if (model_upd == NULL)
     {
-        ssize_t written = write(update->fd, buffer_cptr(session->buffer, cursor), buffer_cremaining(session->buffer, cursor));
-        update->written += written;
-        cursor += written;
+        perror("Failed to allocate memory for model update");
+        return -1;
     }
 
-    assert(update->stream_size >= update->written);
+    thread_model_name(model_upd->file_name, update->model_id);
+    model_upd->flags = update->flags;
+    model_upd->diffed_from = update->diffed_from;
+    model_upd->weight = update->weight;
+    model_upd->meta = update->meta;
 
-    if (update->written == update->stream_size)
+    // blocks while the aggregator is MODEL_QUEUE_CAPACITY updates behind
+    if (ring_model_upd_enqueue(&model_queue, model_upd) < 0)
     {
+        perror("Failed to enqueue model update");
+        free(model_upd);
+        return -1;
+    }
 
-        model_upd_t *model_upd = malloc(sizeof(model_upd_t));
-        if (model_upd == NULL)
-        {
-            perror("Failed to allocate memory for model update");
-            return -1;
-        }
-
-        int n = sprintf(model_upd->file_name, thread_model_name(update->model_id));
-        assert(n > 0);
-
-        if (queue_model_upd_enqueue(&model_queue, model_upd) < 0)
-        {
-            perror("Failed to enqueue model update");
-            return -1;
-        }
-
-        close(update->fd);
-        update->model_id = UINT64_MAX;
-        update->done = 1;
-        update->fd = -1;
-        update->written = 0;
-        update->stream_size = UINT64_MAX;
-        session->state = IDLE;
+    update->meta = NULL;
 
-        // TODO: Add model to queue
+    close(update->fd);
+    update->model_id = UINT64_MAX;
+    update->done = 1;
+    update->fd = -1;
+    update->written = 0;
+    update->stream_size = UINT64_MAX;
+    session->state = IDLE;
 
-        uint8_t response = 0x01;
-        client_clone_and_send((generic_session_t *)session, (void *)&response, sizeof(response));
-    }
+    uint8_t response = 0x01;
+    client_clone_and_send((generic_session_t *)session, (void *)&response, sizeof(response));
 
-    debug_print("Written: %ld/%ld\n", update->written, update->stream_size);
     debug_print("Done handling weight stream correctly\n");
     return 0;
 }
@@ -199,6 +255,7 @@ int handle_auth_packet(session_t *session, size_t cursor)
     // initialize sesssion
     client_update_t *update = &session->model_update;
     update->fd = -1;
+    update->meta = NULL;
     update->done = 0;
     update->model_id = UINT64_MAX;
     update->written = 0;
@@ -206,6 +263,40 @@ int handle_auth_packet(session_t *session, size_t cursor)
     return 0;
 }
 
+// 0x02, u64 model_id, u64 local_model_id, u8 flags -> model file (diff format if local_model_id != UINT64_MAX)
+static void complete_diff_reply(void *arg, shared_buffer_t *diff)
+{
+    client_complete_reply((deferred_reply_t *)arg, diff);
+}
+
+// Diffs are computed once per (from, to) pair by the diff cache threads and shared by every client asking for them,
+// the reply waits in the session queue while the diff is computed, the worker keeps serving the other sessions
+static int send_diff(session_t *session, uint64_t from, uint64_t to, uint8_t compressed)
+{
+    shared_buffer_t *diff = diff_cache_find(&diff_cache, from, to, compressed);
+    if (diff != NULL)
+    {
+        debug_print("2) Sending cached model:: len %ld\n", diff->size);
+        int res = client_send_shared((generic_session_t *)session, diff, 0, diff->size);
+        shared_buffer_release(diff);
+        return res;
+    }
+
+    deferred_reply_t *reply = client_defer_reply((generic_session_t *)session);
+    if (reply == NULL)
+        return -1;
+
+    if (diff_cache_request(&diff_cache, from, to, compressed, complete_diff_reply, reply) < 0)
+    {
+        debug_print("Failed to request model %lu from %lu\n", to, from);
+        client_complete_reply(reply, NULL);
+        return -1;
+    }
+
+    debug_print("2) Deferred model %lu from %lu\n", to, from);
+    return 0;
+}
+
 int handle_get_weight_packet(session_t *session, size_t cursor)
 {
     set_debug(DEBUG_PROTOCOL);
@@ -216,116 +307,67 @@ int handle_get_weight_packet(session_t *session, size_t cursor)
         return -1;
     }
 
+    // valid until the next event loop iteration (see global_model_quiescent)
+    global_model_t *global = global_model_get();
     uint64_t model_id = buffer_read_net_uint64(buffer, cursor);
     if (model_id == UINT64_MAX)
     {
         model_id = global_model_id;
     }
 
-    int file_fd = open_model(model_id);
-    if (file_fd == -1)
-    {
-        debug_print("Failed to open model file id: %lu, (latest_version) %lu\n", model_id, global_model_id);
-        return -1;
-    }
-
     uint64_t local_model_id = buffer_read_net_uint64(buffer, cursor);
     if (local_model_id != UINT64_MAX && local_model_id >= model_id)
     {
         debug_print("Local model id is invalid\n");
-        close(file_fd);
         return -1;
     }
 
+    // MF_FLAG_COMPRESSED: the reply is a compressed model file (see compression.h)
     uint8_t flags = buffer_read_uint8(buffer, cursor);
-    assert(flags == 0x00); // TODO: add support for compression and headerless models
-
-    char *file;
-    size_t file_size;
-    if (load_file_fd(file_fd, &file, &file_size) < 0)
-    {
-        debug_print("Failed to load model file\n");
-        close(file_fd);
-        return -1;
-    }
-
-    close(file_fd);
-
-    model_file_info_t file_info = {0};
-    if (extract_file_info(&file_info, file, file_size) < 0)
+    if (flags & ~MF_FLAG_COMPRESSED)
     {
-        debug_print("Failed to extract model info\n");
-        free(file);
+        debug_print("Unsupported get weight flags: %d\n", flags);
         return -1;
     }
 
-    if (file_info.file_size != file_size)
+    if (flags & MF_FLAG_COMPRESSED)
     {
-        debug_print("Model file size mismatch malformed local file\n");
-        free(file);
-        return -1;
+        // compressed once per (local, requested) pair, or per model if the client has none
+        uint64_t from = local_model_id == UINT64_MAX ? DIFF_CACHE_FULL_MODEL : local_model_id;
+        return send_diff(session, from, model_id, 1);
     }
 
-    if (local_model_id == UINT64_MAX)
+    global_model_version_t *resident = global_model_find(global, model_id);
+    if (local_model_id == UINT64_MAX && resident != NULL)
     {
-        debug_print("1) Sending model data:: len %ld\n", file_size);
-        client_pass_ownership_and_send((generic_session_t *)session, file, file_size);
-        return 0;
+        // one of the last global models, already in memory
+        debug_print("0) Sending resident model:: len %ld\n", resident->file->size);
+        return client_send_shared((generic_session_t *)session, resident->file, 0, resident->file->size);
     }
 
-    // diff model
-    debug_print("Diffing model\n");
-    char *local_file = NULL;
-    size_t local_file_size = 0;
-
-    int local_file_fd = open_model(local_model_id);
-    if (local_file_fd == -1)
-    {
-        debug_print("Failed to open model reference\n");
-        free(file);
-        return -1;
-    }
+    // a missing model fails in the diff cache, the session is closed once the request is answered
+    if (local_model_id != UINT64_MAX)
+        return send_diff(session, local_model_id, model_id, 0);
 
-    if (load_file_fd(local_file_fd, &local_file, &local_file_size) < 0)
+    int file_fd = open_model(model_id);
+    if (file_fd == -1)
     {
-        debug_print("Failed to load model reference\n");
-        free(file);
-        close(local_file_fd);
+        debug_print("Failed to open model file id: %lu, (latest_version) %lu\n", model_id, global_model_id);
         return -1;
     }
 
-    close(local_file_fd);
-
-    model_file_info_t local_file_info = {0};
-    if (extract_file_info(&local_file_info, local_file, local_file_size) < 0)
+    // full model, straight from the page cache to the socket
+    struct stat st;
+    model_file_info_t file_info = {0};
+    if (load_model_info_from_file(file_fd, &file_info) < 0 || fstat(file_fd, &st) == -1 || file_info.file_size != (uint64_t)st.st_size)
     {
-        debug_print("Failed to load model info\n");
-        free(file);
-        free(local_file);
+        debug_print("Model file size mismatch malformed local file\n");
+        close(file_fd);
         return -1;
     }
 
-    float *model_data = (float *)mfi_get_data_ptr(file_info, file);
-    float *model_ref_data = (float *)mfi_get_data_ptr(local_file_info, local_file);
-
-    // TODO add support for differenr tensor headers (types)
-    assert(file_info.data_size % sizeof(float) == 0);
-    assert(local_file_info.data_size % sizeof(float) == 0);
-    assert(file_info.data_size == local_file_info.data_size);
-
-    for (size_t i = 0; i < file_info.data_size / sizeof(float); i++)
-    {
-        model_data[i] -= model_ref_data[i];
-    }
-
-    // set file format to diff
-    mf_add_flags(MF_FLAG_DIFF_FORMAT, file);
-    mfi_set_diffed_from_version(file_info, local_model_id, file);
-
-    debug_print("2) Sending model data:: len %ld\n", file_size);
-    client_pass_ownership_and_send((generic_session_t *)session, file, file_size);
-    free(local_file);
-    return 0;
+    debug_print("1) Sending model file:: len %ld\n", file_info.file_size);
+    return client_send_file((generic_session_t *)session, file_fd, 0, file_info.file_size);
 }
 
 int handle_get_latest_model_packet(session_t *session, size_t cursor)
@@ -397,21 +439,8 @@ int handle_packet_event(generic_session_t *__session)
         }
         break;
 
-    case WEIGHT_STREAM:
-        debug_print("CASE WEIGHT_STREAM\n");
-        switch (packet_type)
-        {
-        case SEND_WEIGHT_PACKET:
-            debug_print("CASE WEIGHT_STREAM: SEND_WEIGHT_PACKET\n");
-            err_code = handle_weight_stream(session, cursor);
-            break;
-
-        default:
-            err_code = -1;
-            break;
-        }
-        break;
     default:
+        // WEIGHT_STREAM data is not framed, it never gets here (see client_receive_to_file)
         debug_print("Invalid session state\n");
         err_code = -1;
     }
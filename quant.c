@@ -0,0 +1,186 @@
+#include "quant.h"
+#include "kernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// *param[t] = the float32 entry prefix<tensor t name>, the arrays are allocated on the first one found
+static int load_param(mf_quant_t *quant, const mf_meta_index_t *meta, size_t t, const char *prefix, double **param)
+{
+    const mf_tensor_t *tensor = &quant->layout.tensors[t];
+    size_t prefix_len = strlen(prefix);
+    char name[prefix_len + tensor->name_len];
+    memcpy(name, prefix, prefix_len);
+    memcpy(name + prefix_len, tensor->name, tensor->name_len);
+
+    const mf_meta_entry_t *entry = mf_meta_find(meta, name, sizeof(name), MF_TFLOAT32);
+    if (entry == NULL)
+        return 0;
+
+    size_t n_tensors = quant->layout.n_tensors;
+    if (quant->scale == NULL)
+    {
+        quant->scale = (double *)malloc(sizeof(double) * n_tensors);
+        quant->zero = (double *)malloc(sizeof(double) * n_tensors);
+        if (quant->scale == NULL || quant->zero == NULL)
+        {
+            perror("Failed to allocate quantization parameters");
+            return -1;
+        }
+
+        for (size_t i = 0; i < n_tensors; i++)
+        {
+            quant->scale[i] = 1;
+            quant->zero[i] = 0;
+        }
+    }
+
+    float value;
+    memcpy(&value, entry->value, sizeof(value));
+    (*param)[t] = value;
+    return 0;
+}
+
+// per tensor stored elements of a sparse data section, -1 if it does not match the layout
+static int load_sparse(mf_quant_t *quant, model_file_info_t *info, char *buff)
+{
+    const mf_layout_t *layout = &quant->layout;
+    quant->sparse = (mf_sparse_tensor_t *)malloc(sizeof(mf_sparse_tensor_t) * (layout->n_tensors > 0 ? layout->n_tensors : 1));
+    if (quant->sparse == NULL)
+    {
+        perror("Failed to allocate sparse update index");
+        return -1;
+    }
+
+    const char *data = buff + info->data_offset;
+    size_t size = info->data_size;
+    size_t pos = 0;
+    for (size_t t = 0; t < layout->n_tensors; t++)
+    {
+        uint32_t nnz;
+        if (size - pos < sizeof(nnz))
+            return -1;
+
+        memcpy(&nnz, data + pos, sizeof(nnz));
+        pos += sizeof(nnz);
+
+        size_t n_elems = layout->tensors[t].n_elems;
+        size_t elem_size = MF_SIZE(layout->tensors[t].type);
+        if (nnz > n_elems || (size - pos) / (sizeof(uint32_t) + elem_size) < nnz)
+            return -1;
+
+        mf_sparse_tensor_t *tensor = &quant->sparse[t];
+        tensor->nnz = nnz;
+        tensor->index = (const uint32_t *)(data + pos);
+        pos += sizeof(uint32_t) * nnz;
+        tensor->values = data + pos;
+        pos += elem_size * nnz;
+
+        for (size_t k = 0; k < nnz; k++)
+            if (tensor->index[k] >= n_elems || (k > 0 && tensor->index[k] <= tensor->index[k - 1]))
+                return -1;
+    }
+
+    return pos == size ? 0 : -1;
+}
+
+int mf_quant_init(mf_quant_t *quant, const mf_layout_t *base, model_file_info_t *info, char *buff, const mf_meta_index_t *meta)
+{
+    set_debug(1);
+
+    memset(quant, 0, sizeof(mf_quant_t));
+    if (mf_layout_init(&quant->layout, info, buff) < 0)
+        return -1;
+
+    const mf_layout_t *layout = &quant->layout;
+    if (!mf_layout_same_shapes(layout, base))
+        goto malformed;
+
+    quant->plain = !mfi_is_sparse(*info);
+    for (size_t t = 0; t < layout->n_tensors; t++)
+    {
+        if (!mf_kernel_input_type(layout->tensors[t].type))
+            goto malformed;
+
+        // read with the tensor views of base: same types and, for version 2 files, same padding
+        quant->plain &= layout->tensors[t].type == base->tensors[t].type && layout->tensors[t].offset == base->tensors[t].offset;
+    }
+
+    if (mfi_is_sparse(*info) ? load_sparse(quant, info, buff) < 0 : info->data_size != layout->data_size)
+        goto malformed;
+
+    for (size_t t = 0; meta != NULL && t < layout->n_tensors; t++)
+    {
+        if (load_param(quant, meta, t, QUANT_SCALE_PREFIX, &quant->scale) < 0 ||
+            load_param(quant, meta, t, QUANT_ZERO_POINT_PREFIX, &quant->zero) < 0)
+        {
+            mf_quant_destroy(quant);
+            return -1;
+        }
+    }
+
+    quant->plain &= quant->scale == NULL;
+    return 0;
+
+malformed:
+    debug_print("Update tensors do not match the global model\n");
+    mf_quant_destroy(quant);
+    return -1;
+}
+
+void mf_quant_destroy(mf_quant_t *quant)
+{
+    mf_layout_destroy(&quant->layout);
+    free(quant->scale);
+    free(quant->zero);
+    free(quant->sparse);
+    quant->scale = NULL;
+    quant->zero = NULL;
+    quant->sparse = NULL;
+
+    if (quant->dense != NULL)
+        munmap(quant->dense, quant->dense_size);
+    quant->dense = NULL;
+    quant->dense_size = 0;
+}
+
+int mf_quant_densify(mf_quant_t *quant)
+{
+    if (quant->sparse == NULL)
+        return 0;
+
+    // anonymous memory: zero filled, untouched pages are never allocated
+    mf_layout_t *layout = &quant->layout;
+    size_t size = sizeof(double) * (layout->n_elems > 0 ? layout->n_elems : 1);
+    double *dense = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (dense == MAP_FAILED)
+    {
+        perror("Failed to allocate dense update");
+        return -1;
+    }
+
+    for (size_t t = 0; t < layout->n_tensors; t++)
+    {
+        mf_tensor_t *tensor = &layout->tensors[t];
+        mf_sparse_tensor_t *stored = &quant->sparse[t];
+        double scale = quant->scale != NULL ? quant->scale[t] : 1;
+        double bias = quant->scale != NULL ? -quant->scale[t] * quant->zero[t] : 0;
+        mf_kernel_scatter(tensor->type, dense + tensor->start, 0, stored->index, stored->values, scale, bias, stored->nnz);
+
+        tensor->type = MF_TFLOAT64;
+        tensor->offset = tensor->start * sizeof(double);
+        tensor->size = tensor->n_elems * sizeof(double);
+    }
+
+    layout->data_size = layout->n_elems * sizeof(double);
+    free(quant->scale);
+    free(quant->zero);
+    free(quant->sparse);
+    quant->scale = NULL;
+    quant->zero = NULL;
+    quant->sparse = NULL;
+    quant->dense = dense;
+    quant->dense_size = size;
+    return 0;
+}
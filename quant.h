@@ -0,0 +1,71 @@
+#ifndef QUANT_H
+#define QUANT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "globals.h"
+#include "tensor.h"
+#include "metadata.h"
+
+// Quantized updates: the tensors of a diff can be int8 or float16 while the global model is float32
+// (or float64). Tensor <name> is dequantized as x = scale * (q - zero_point), with the float32
+// metadata "scale:<name>" and "zero_point:<name>" (1 and 0 when missing). The aggregation kernels
+// read the quantized data directly, the dequantization happens in the same pass as the reduction.
+//
+// Sparse updates (MF_FLAG_SPARSE, top-k diffs): the data section holds, for every tensor in header order,
+//   u32 nnz | u32 index[nnz] | nnz values of the tensor type
+// with the indexes strictly increasing and below the number of elements of the tensor, the other
+// elements are 0 (before dequantization: the zero point only applies to the stored values).
+
+#define QUANT_SCALE_PREFIX "scale:"
+#define QUANT_ZERO_POINT_PREFIX "zero_point:"
+
+// The stored elements of a tensor of a sparse update
+typedef struct
+{
+    size_t nnz;
+    const uint32_t *index;
+    const char *values;
+} mf_sparse_tensor_t;
+
+// How an update is read by the kernels
+typedef struct
+{
+    mf_layout_t layout; // of the update: same shapes as the global model, every tensor has its own type
+    uint8_t plain;      // every tensor has the type of the global model one and is used as it is
+    double *scale;      // per tensor, NULL if the values are used as they are
+    double *zero;
+    mf_sparse_tensor_t *sparse; // per tensor, NULL for dense updates
+    double *dense;              // owned float64 copy of a densified sparse update, see mf_quant_densify
+    size_t dense_size;
+} mf_quant_t;
+
+// The first stored element of a sparse tensor at or after element i (of the tensor)
+static inline size_t mf_sparse_lower_bound(const mf_sparse_tensor_t *tensor, size_t i)
+{
+    size_t lo = 0;
+    size_t hi = tensor->nnz;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (tensor->index[mid] < i)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Checks that the tensors of the update have the shapes of base and types the kernels can read,
+// then looks up their scales and zero points in meta (and indexes the stored elements of a sparse update).
+// Returns -1 if the update can not be aggregated.
+int mf_quant_init(mf_quant_t *quant, const mf_layout_t *base, model_file_info_t *info, char *buff, const mf_meta_index_t *meta);
+void mf_quant_destroy(mf_quant_t *quant);
+
+// Expands a sparse update into quant->dense, dequantized: the update is then read as a plain float64
+// one (for the reductions that need every element of every update).
+int mf_quant_densify(mf_quant_t *quant);
+
+#endif // QUANT_H
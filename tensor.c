@@ -0,0 +1,252 @@
+#include "tensor.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// 1 if the tensor header th (and its name and shape) ends before end
+static inline int theader_fits(const mf_theader_t *th, const char *end)
+{
+    const char *p = (const char *)th;
+    return end - p >= (ptrdiff_t)sizeof(mf_theader_t) &&
+           (size_t)(end - p) >= sizeof(mf_theader_t) + th->name_len + sizeof(uint32_t) * th->dim;
+}
+
+// offset of tensor t in the data section: packed after the previous one in version 1, from the
+// tensor offsets section in version 2 (increasing, the gaps are padding). The offsets of a sparse
+// update are unused, its data section has its own encoding.
+static int tensor_data_offset(const mf_layout_t *layout, model_file_info_t *info, char *buff, size_t t, size_t *offset)
+{
+    if (info->version != MF_VERSION_2 || mfi_is_sparse(*info))
+    {
+        *offset = layout->data_size;
+        return 0;
+    }
+
+    uint64_t value;
+    memcpy(&value, buff + info->tensor_offsets_offset + t * sizeof(uint64_t), sizeof(value));
+    if (value < layout->data_size || value > info->data_size || value % info->data_align != 0)
+        return -1;
+
+    *offset = value;
+    return 0;
+}
+
+int mf_layout_init(mf_layout_t *layout, model_file_info_t *info, char *buff)
+{
+    memset(layout, 0, sizeof(mf_layout_t));
+
+    char *theaders = buff + info->tensor_header_offset;
+    char *end = theaders + info->tensor_header_size;
+    size_t n_tensors = 0;
+    loop_theaders(theaders, info->tensor_header_size)
+    {
+        if (!theader_fits(th, end))
+        {
+            perror("Malformed tensor headers");
+            return -1;
+        }
+
+        n_tensors++;
+    }
+
+    if (info->version == MF_VERSION_2 && n_tensors != info->n_tensors)
+    {
+        perror("Malformed tensor offsets");
+        return -1;
+    }
+
+    layout->tensors = (mf_tensor_t *)malloc(sizeof(mf_tensor_t) * (n_tensors > 0 ? n_tensors : 1));
+    if (layout->tensors == NULL)
+    {
+        perror("Failed to allocate model layout");
+        return -1;
+    }
+
+    size_t t = 0;
+    loop_theaders(theaders, info->tensor_header_size)
+    {
+        mf_tensor_t *tensor = &layout->tensors[t];
+        tensor->name = (const char *)th->data;
+        tensor->name_len = th->name_len;
+        tensor->type = th->data_type;
+        tensor->dim = th->dim;
+        tensor->shape = (const char *)th->data + th->name_len;
+
+        tensor->n_elems = 1;
+        for (uint8_t d = 0; d < th->dim; d++)
+        {
+            uint32_t dim;
+            memcpy(&dim, tensor->shape + d * sizeof(uint32_t), sizeof(dim));
+            tensor->n_elems *= dim;
+        }
+
+        tensor->start = layout->n_elems;
+        if (tensor_data_offset(layout, info, buff, t, &tensor->offset) < 0)
+        {
+            perror("Malformed tensor offsets");
+            mf_layout_destroy(layout);
+            return -1;
+        }
+
+        tensor->size = tensor->n_elems * MF_SIZE(tensor->type);
+
+        // mapped files are page aligned
+        size_t pos = info->data_offset + tensor->offset;
+        tensor->align = MF_TENSOR_MAX_ALIGN;
+        while (pos % tensor->align != 0)
+            tensor->align /= 2;
+
+        layout->n_elems += tensor->n_elems;
+        layout->data_size = tensor->offset + tensor->size;
+        t++;
+    }
+
+    layout->n_tensors = n_tensors;
+    return 0;
+}
+
+void mf_layout_destroy(mf_layout_t *layout)
+{
+    free(layout->tensors);
+    free(layout->tiles);
+    memset(layout, 0, sizeof(mf_layout_t));
+}
+
+int mf_layout_split(mf_layout_t *layout, size_t tile_size)
+{
+    size_t n_tiles = 0;
+    for (size_t t = 0; t < layout->n_tensors; t++)
+    {
+        size_t tile_elems = tile_size / MF_SIZE(layout->tensors[t].type);
+        n_tiles += (layout->tensors[t].n_elems + tile_elems - 1) / tile_elems;
+    }
+
+    mf_tile_t *tiles = (mf_tile_t *)malloc(sizeof(mf_tile_t) * (n_tiles > 0 ? n_tiles : 1));
+    if (tiles == NULL)
+    {
+        perror("Failed to allocate model tiles");
+        return -1;
+    }
+
+    size_t k = 0;
+    layout->max_tile = 0;
+    for (size_t t = 0; t < layout->n_tensors; t++)
+    {
+        mf_tensor_t *tensor = &layout->tensors[t];
+        size_t tile_elems = tile_size / MF_SIZE(tensor->type);
+        for (size_t i = 0; i < tensor->n_elems; i += tile_elems)
+        {
+            tiles[k].t = t;
+            tiles[k].start = tensor->start + i;
+            tiles[k].count = tensor->n_elems - i < tile_elems ? tensor->n_elems - i : tile_elems;
+            if (tiles[k].count > layout->max_tile)
+                layout->max_tile = tiles[k].count;
+            k++;
+        }
+    }
+
+    free(layout->tiles);
+    layout->tiles = tiles;
+    layout->n_tiles = n_tiles;
+    return 0;
+}
+
+ssize_t mf_layout_find_name(const mf_layout_t *layout, const char *name, size_t name_len)
+{
+    for (size_t t = 0; t < layout->n_tensors; t++)
+    {
+        const mf_tensor_t *tensor = &layout->tensors[t];
+        if (tensor->name_len == name_len && memcmp(tensor->name, name, name_len) == 0)
+            return t;
+    }
+
+    return -1;
+}
+
+int mf_layout_same_shapes(const mf_layout_t *a, const mf_layout_t *b)
+{
+    if (a->n_tensors != b->n_tensors)
+        return 0;
+
+    for (size_t t = 0; t < a->n_tensors; t++)
+    {
+        if (a->tensors[t].n_elems != b->tensors[t].n_elems)
+            return 0;
+    }
+
+    return 1;
+}
+
+int mf_convert_model_v2(const char *model, size_t size, model_file_info_t *info, char **out, size_t *out_size)
+{
+    if (info->version != MF_VERSION_1 || mfi_is_compressed(*info) || mfi_is_sparse(*info) ||
+        info->file_size != size || info->data_offset > size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mf_layout_t layout;
+    if (mf_layout_init(&layout, info, (char *)model) < 0)
+        return -1;
+
+    if (layout.data_size != info->data_size || layout.n_tensors > UINT32_MAX)
+    {
+        mf_layout_destroy(&layout);
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t offsets[layout.n_tensors > 0 ? layout.n_tensors : 1];
+    size_t data_size = 0;
+    for (size_t t = 0; t < layout.n_tensors; t++)
+    {
+        offsets[t] = (data_size + MF_V2_MIN_ALIGN - 1) & ~(size_t)(MF_V2_MIN_ALIGN - 1);
+        data_size = offsets[t] + layout.tensors[t].size;
+    }
+
+    uint64_t section[MF_V2_SECTIONS][2];
+    section[MF_V2_SECTION_METADATA][0] = MIN_MF_V2_SIZE;
+    section[MF_V2_SECTION_METADATA][1] = info->metadata_size;
+    section[MF_V2_SECTION_TENSOR_HEADERS][0] = MIN_MF_V2_SIZE + info->metadata_size;
+    section[MF_V2_SECTION_TENSOR_HEADERS][1] = info->tensor_header_size;
+    section[MF_V2_SECTION_TENSOR_OFFSETS][0] = section[MF_V2_SECTION_TENSOR_HEADERS][0] + info->tensor_header_size;
+    section[MF_V2_SECTION_TENSOR_OFFSETS][1] = sizeof(uint64_t) * layout.n_tensors;
+    size_t data_offset = section[MF_V2_SECTION_TENSOR_OFFSETS][0] + section[MF_V2_SECTION_TENSOR_OFFSETS][1];
+    size_t offset_align = data_size >= MF_V2_PAGE_ALIGN_MIN_DATA ? MF_V2_DATA_OFFSET_ALIGN : MF_V2_MIN_ALIGN;
+    data_offset = (data_offset + offset_align - 1) & ~(offset_align - 1);
+    section[MF_V2_SECTION_DATA][0] = data_offset;
+    section[MF_V2_SECTION_DATA][1] = data_size;
+
+    // anonymous memory: the padding is already zero
+    size_t file_size = data_offset + data_size;
+    char *dst = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (dst == MAP_FAILED)
+    {
+        perror("Failed to allocate version 2 model");
+        mf_layout_destroy(&layout);
+        return -1;
+    }
+
+    uint64_t file_size_field = file_size;
+    uint32_t data_align = MF_V2_MIN_ALIGN;
+    uint32_t n_tensors = layout.n_tensors;
+    memcpy(dst, model, MIN_MF_SIZE);
+    memcpy(dst + MF_SIZE_OFF, &file_size_field, sizeof(file_size_field));
+    dst[MF_VERSION_OFF] = MF_VERSION_2;
+    memcpy(dst + MF_DATA_ALIGN_OFF, &data_align, sizeof(data_align));
+    memcpy(dst + MF_N_TENSORS_OFF, &n_tensors, sizeof(n_tensors));
+    memcpy(dst + MF_SECTION_TABLE_OFF, section, sizeof(section));
+
+    memcpy(dst + section[MF_V2_SECTION_METADATA][0], model + info->metadata_offset, info->metadata_size);
+    memcpy(dst + section[MF_V2_SECTION_TENSOR_HEADERS][0], model + info->tensor_header_offset, info->tensor_header_size);
+    memcpy(dst + section[MF_V2_SECTION_TENSOR_OFFSETS][0], offsets, section[MF_V2_SECTION_TENSOR_OFFSETS][1]);
+    for (size_t t = 0; t < layout.n_tensors; t++)
+        memcpy(dst + data_offset + offsets[t], model + info->data_offset + layout.tensors[t].offset, layout.tensors[t].size);
+
+    mf_layout_destroy(&layout);
+    *out = dst;
+    *out_size = file_size;
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef TENSOR_H
+#define TENSOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "globals.h"
+
+// Tensor views of a model file: where every tensor of the data section is and how to read it.
+// Elements are numbered across the whole data section in header order (tensor t holds
+// [start, start + n_elems)), bytes are offsets in the data section, so tensors of different types
+// can follow each other (packed in version 1 files, aligned with padding between them in version 2).
+typedef struct
+{
+    const char *name; // in the tensor headers, not NUL terminated
+    uint8_t name_len;
+    uint8_t type;
+    uint8_t dim;
+    const char *shape; // dim uint32_t, unaligned
+    size_t start;
+    size_t n_elems;
+    size_t offset;
+    size_t size;
+    size_t align; // of the data in a mapped file (power of two, at most MF_TENSOR_MAX_ALIGN)
+} mf_tensor_t;
+
+#define MF_TENSOR_MAX_ALIGN 64
+
+// A unit of work: elements [start, start + count) of tensor t, at most tile_size bytes of it.
+// Tiles never cross a tensor, so the kernels see a single type and a single set of quantization parameters.
+typedef struct
+{
+    size_t t;
+    size_t start;
+    size_t count;
+} mf_tile_t;
+
+typedef struct
+{
+    size_t n_tensors;
+    mf_tensor_t *tensors;
+    size_t n_elems;
+    size_t data_size; // end of the last tensor: the sum of the tensor sizes and of the padding between them
+
+    size_t n_tiles; // see mf_layout_split
+    mf_tile_t *tiles;
+    size_t max_tile; // elements of the largest tile
+} mf_layout_t;
+
+// -1 if the tensor headers do not fit in their section (or the version 2 offsets do not match them)
+int mf_layout_init(mf_layout_t *layout, model_file_info_t *info, char *buff);
+void mf_layout_destroy(mf_layout_t *layout);
+
+// Cuts every tensor in tiles of tile_size bytes (a multiple of every element size),
+// large tensors are spread over the workers and small ones are one tile each
+int mf_layout_split(mf_layout_t *layout, size_t tile_size);
+
+// index of the tensor called name, -1 if none
+ssize_t mf_layout_find_name(const mf_layout_t *layout, const char *name, size_t name_len);
+
+// 1 if both layouts have as many tensors with as many elements (types can differ)
+int mf_layout_same_shapes(const mf_layout_t *a, const mf_layout_t *b);
+
+// byte offset of element i (of the data section) of tensor
+static inline size_t mf_tensor_offset(const mf_tensor_t *tensor, size_t i)
+{
+    return tensor->offset + (i - tensor->start) * MF_SIZE(tensor->type);
+}
+
+static inline const char *mf_tensor_ptr(const mf_tensor_t *tensor, const char *data, size_t i)
+{
+    return data + mf_tensor_offset(tensor, i);
+}
+
+// Version 2 copy of a raw version 1 model file in anonymous memory (release it with unmap_file):
+// the same metadata, tensor headers and tensors, every tensor on MF_V2_MIN_ALIGN bytes and the data
+// section on a page (on MF_V2_MIN_ALIGN bytes below MF_V2_PAGE_ALIGN_MIN_DATA bytes of data). -1 if the model can not be converted (compressed or sparse).
+int mf_convert_model_v2(const char *model, size_t size, model_file_info_t *info, char **out, size_t *out_size);
+
+#endif // TENSOR_H